@@ -88,11 +88,51 @@ sampling.dep <- function(n, random_fraction, mut_times) {
   final_sampling_T
 }
 
+native_sampling <- function(sampling_fn) {
+  if (identical(sampling_fn, sampling.expo))
+    return("expo")
+  if (identical(sampling_fn, sampling.norm))
+    return("norm")
+  if (identical(sampling_fn, sampling.const))
+    return("const")
+  if (identical(sampling_fn, sampling.unif))
+    return("unif")
+  if (identical(sampling_fn, sampling.dep))
+    return("dep")
+  return(NULL)
+}
+
 #' sample_timed_genotypes_with_eps
 #' @export
-sample_genotypes <- function (n, poset, sampling_param, lambdas, sampling_fn=sampling.expo, eps=0.0) 
+sample_genotypes <- function (n, poset, sampling_param, lambdas, sampling_fn=sampling.expo, eps=0.0, thrds=1L) 
 {
   p = length(lambdas)
+  sampling <- native_sampling(sampling_fn)
+  if (!is.null(sampling)) {
+    # Sampling-time distributions provided in this file are implemented natively
+    native_param <- sampling_param
+    if (sampling == "unif")
+      native_param <- sum(sampling_param/sampling_param)
+    native <- sample.genotypes(n, poset, lambdas, sampling=sampling,
+                               sampling.param=native_param, thrds=thrds)
+    T_events <- native$Tdiff
+    T_sum_events <- native$mutation_times
+    T_sampling <- native$sampling_time
+    hidden_genotypes <- native$samples * 1
+    obs_events <- hidden_genotypes
+    if (eps > 0) {
+      flip <- matrix(rbinom(n * p, 1, eps), n, p)
+      obs_events <- abs(hidden_genotypes - flip)
+    }
+    genotype_list = apply(obs_events, 1, function(x) {
+      which(x == 1)
+    })
+    return(list(n = n, p = p, T_sampling = T_sampling, obs_events = obs_events,
+                hidden_genotypes = hidden_genotypes, genotype_list = genotype_list,
+                sampling_param = sampling_param, lambdas = lambdas,
+                T_events = T_events, T_sum_events = T_sum_events, eps = eps))
+  }
+
   T_events <- matrix(0, n, p)
   T_sampling <- sampling_fn(n, sampling_param, NULL)
   for (i in 1:p) {
@@ -1,26 +1,52 @@
-
 ################### Expected sampling time by importance sampling ######################
 
 expected_sampling_time_importance_sampling <- function(genotype, poset, lambda, nrOfSamples ) {
-  topo_path = my.topological.sort(poset) -1
-  stimes = rexp(nrOfSamples, 1)
-  
-  T = list(T=matrix(0, 0, ncol(poset)), densities=c())
-  for(stime in stimes) {
-    t_ = .Call("drawHiddenVarsSamples", 1, genotype, stime, lambda,  poset, topo_path)  
-    
-    T$T  = rbind(T$T, t_$T)
-    T$densities = c(T$densities, t_$densities)
-  }
-  
-  values = cbn_density_(T$T, lambda) - T$densities
-  #   logp = logsumexp(values)$logR
-  
-  #    weights = exp(cbn_density_(T$T, lambda) - T$densities)
-  
-  #   (sum(stimes * weights)/ nrOfSamples) /exp(logp) 
-  #     sum(stimes * weights)/ sum(weights)
-  
-  logp = logsumexp(values)$logR
-  exp(logsumexp(log(stimes) + values)$logR - logp)
+  expected.sampling.time(matrix(genotype, nrow=1), poset, lambda, lambda.s=1,
+                         L=nrOfSamples)$mean
+}
+
+#' @title Expected Sampling Time
+#' @export
+#'
+#' @description predict the sampling time of each genotype by its posterior
+#' mean and standard deviation given the poset, the rate parameters and the
+#' rate of the sampling process. Estimates are obtained by importance
+#' sampling, where sampling times are drawn from the sampling process and
+#' mutation times conditioned on the genotype. Identical genotypes share their
+#' samples, and genotypes are processed in parallel
+#'
+#' @param obs a matrix containing observations or genotypes, where each row
+#' corresponds to a genotype vector whose entries indicate whether an event has
+#' been observed (\code{1}) or not (\code{0})
+#' @param poset a matrix containing the cover relations
+#' @param lambda a vector of the rate parameters
+#' @param lambda.s rate of the sampling process. Defaults to \code{1.0}
+#' @param L number of samples per distinct genotype
+#' @param thrds number of threads for parallel execution
+#' @param verbose an optional argument indicating whether to output logging
+#' information
+#' @param seed seed for reproducibility
+#' @return returns a list with the posterior mean (\code{mean}) and standard
+#' deviation (\code{sd}) of the sampling time, and the effective sample size
+#' (\code{ess}) per genotype. Predictions of genotypes that are not compatible
+#' with the poset are \code{NaN}
+expected.sampling.time <- function(obs, poset, lambda, lambda.s=1.0, L=1000L,
+                                   thrds=1L, verbose=FALSE, seed=NULL) {
+
+  if (is.vector(obs))
+    obs <- matrix(obs, nrow=1)
+  N <- nrow(obs)
+  p <- ncol(poset)
+  if (ncol(obs) != p)
+    stop("Genotypes of length ", p, " are expected")
+  if (!is.integer(obs))
+    obs <- matrix(as.integer(obs), nrow=N, ncol=p)
+  poset <- matrix(as.integer(poset), nrow=p, ncol=p)
+
+  if (is.null(seed))
+    seed <- sample.int(3e4, 1)
+
+  .Call('_expected_sampling_time', PACKAGE = 'mccbn', obs, poset,
+        as.numeric(lambda), lambda.s, as.integer(L), as.integer(thrds),
+        verbose, as.integer(seed))
 }
@@ -13,6 +13,8 @@
 #include <cassert>
 #include "mcem.hpp"
 #include "not_acyclic_exception.hpp"
+#include "vector_math.hpp"
+#include "compiled_poset.hpp"
 
 VectorXd scale_path_to_mutation(const Model& model) {
 
@@ -141,80 +143,143 @@ RowVectorXb draw_sample(const RowVectorXb& genotype, const Model& model,
 }
 
 /* Probability density function of an exponential distribution in log scale */
-VectorXd dexp_log(const VectorXd& time, double rate) {
-  VectorXd ret = std::log(rate) - (rate * time).array();
+template <typename Scalar>
+VectorT<Scalar> dexp_log(const VectorT<Scalar>& time, Scalar rate) {
+  VectorT<Scalar> ret = std::log(rate) - (rate * time).array();
   return ret;
 }
 
 /* Cumulative distribution function of an exponential distribution in log scale */
+template <typename Scalar>
+VectorT<Scalar> pexp_log(VectorT<Scalar>& time, Scalar rate) {
+  /* 1 - exp(-rate * time) is computed as -expm1(-rate * time), which avoids
+   * the cancellation for short times, notably in single precision
+   */
+  VectorT<Scalar> ret = (-(-rate * time).array().unaryExpr(
+    [](const Scalar x) { return std::expm1(x); })).log();
+  return ret;
+}
+
+/* Double-precision variant on top of the vectorized kernels */
 VectorXd pexp_log(VectorXd& time, double rate) {
-  // FIXME: -(-rate * time).array().expm1().array().log()
-  VectorXd ret = (1 - (-rate * time).array().exp()).array().log();
+  const unsigned int n = time.size();
+  VectorXd ret = -rate * time;
+  vexpm1(n, ret.data(), ret.data());
+  ret = -ret;
+  vlog(n, ret.data(), ret.data());
   return ret;
 }
 
-MatrixXd generate_mutation_times(
+/* Maximum number of times drawn at once (32 KB in double precision) */
+static const unsigned int LEVEL_BATCH_ELEMENTS = 4096;
+
+//' Generate mutation times conditioned on the genotypes. Times are sampled
+//' and stored in the precision 'Scalar', while the log-density of the
+//' proposal is accumulated in double precision. Events are processed level
+//' by level: the events of a level only depend on events of previous levels,
+//' and their truncated exponential times are drawn at once
+//'
+//' @noRd
+template <typename Scalar>
+MatrixT<Scalar> generate_mutation_times(
     const MatrixXb& obs, const Model& model, VectorXd& dens,
-    VectorXd& sampling_time, Context::rng_type& rng, 
-    const bool sampling_times_available=false) {
+    VectorT<Scalar>& sampling_time, Context::rng_type& rng,
+    const bool sampling_times_available) {
 
   unsigned int N = obs.rows();
   unsigned int p = obs.cols();
-  MatrixXd time_events = MatrixXd::Zero(N, p);
-  MatrixXd time_events_sum = MatrixXd::Zero(N, p);
-  MatrixXd cutoff = MatrixXd::Zero(N, p);
+  MatrixT<Scalar> time_events = MatrixT<Scalar>::Zero(N, p);
+  MatrixT<Scalar> time_events_sum = MatrixT<Scalar>::Zero(N, p);
 
   /* Generate sampling times sampling_time ~ Exp(lambda_{s}) */
   if (!sampling_times_available)
-    sampling_time = rexp(N, model.get_lambda_s(), rng);
-  
-  std::vector<node_container> parents = model.get_direct_predecessors();
-  /* Loop through nodes in topological order */
-  for (node_container::const_reverse_iterator v = model.topo_path.rbegin();
-       v != model.topo_path.rend(); ++v) {
-    /* Alternative vec1.cwiseMax(vec2)
-     * see https://eigen.tuxfamily.org/dox/group__QuickRefPage.html)
-     */
-    VectorXd time_parents_max = VectorXd::Zero(N);
-    if (!parents[model.poset[*v].event_id].empty()) {
-      MatrixXd aux1 = MatrixXd::Zero(N, parents[model.poset[*v].event_id].size());
-
-      for (unsigned int u = 0; u < parents[model.poset[*v].event_id].size(); ++u)
-        aux1.col(u) = time_events_sum.col(parents[model.poset[*v].event_id][u]);
-      time_parents_max = aux1.rowwise().maxCoeff();
+    sampling_time = rexp<Scalar>(N, model.get_lambda_s(), rng);
+
+  const CompiledPoset poset(model);
+  const VectorXd lambda = model.get_lambda();
+  /* Events of a level are processed in batches that fit into the cache */
+  const unsigned int batch_size =
+    std::max(LEVEL_BATCH_ELEMENTS / std::max(N, 1u), 1u);
+  MatrixT<Scalar> time_parents_max;
+  VectorT<Scalar> cutoff;
+  double log_lambda_sum = 0.0;
+  for (unsigned int l = 0; l < poset.num_levels(); ++l) {
+    for (unsigned int first = poset.level_offset[l];
+         first < poset.level_offset[l + 1]; first += batch_size) {
+      const unsigned int m =
+        std::min(batch_size, poset.level_offset[l + 1] - first);
+      time_parents_max.setZero(N, m);
+      cutoff.resize(N * m);
+      Map< MatrixT<Scalar> > cutoff_batch(cutoff.data(), N, m);
+
+      /* if x = 1, Z ~ TExp(lambda, 0, sampling_time - time{max parents})
+       * if x = 0, Z ~ TExp(lambda, 0, inf)
+       * Z is drawn as Z' / lambda, with Z' ~ TExp(1, 0, lambda * cutoff), such
+       * that all events of the batch share the same draw
+       */
+      for (unsigned int c = 0; c < m; ++c) {
+        const unsigned int j = poset.topo_order[first + c];
+        for (unsigned int i = poset.parents_offset[j];
+             i < poset.parents_offset[j + 1]; ++i)
+          time_parents_max.col(c) = time_parents_max.col(c).cwiseMax(
+            time_events_sum.col(poset.parents[i]));
+        cutoff_batch.col(c) = obs.col(j).select(
+          (Scalar) lambda[j] * (sampling_time - time_parents_max.col(c)),
+          std::numeric_limits<Scalar>::infinity());
+      }
+      VectorT<Scalar> time = rtexp(N * m, (Scalar) 1, cutoff, rng);
+
+      /* log f(Z) - log F(cutoff) = log(lambda) - Z' - log F'(lambda cutoff) */
+      VectorT<Scalar> log_density = -time - pexp_log(cutoff, (Scalar) 1);
+      dens += Map< MatrixT<Scalar> >(log_density.data(), N, m).rowwise().sum()
+        .template cast<double>();
+
+      for (unsigned int c = 0; c < m; ++c) {
+        const unsigned int j = poset.topo_order[first + c];
+        log_lambda_sum += std::log(lambda[j]);
+
+        /* The time difference is obtained without subtracting the cumulative
+         * times, which would lose precision for short times in single
+         * precision
+         */
+        VectorT<Scalar> aux2 = obs.col(j).select(0,
+          (sampling_time - time_parents_max.col(c)).cwiseMax(0));
+        time_events.col(j) = aux2 + time.segment(c * N, N) / (Scalar) lambda[j];
+        time_events_sum.col(j) = time_parents_max.col(c) + time_events.col(j);
+      }
     }
-
-    /* if x = 1, Z ~ TExp(lambda, 0, sampling_time - time{max parents})
-     * if x = 0, Z ~ TExp(lambda, 0, inf)
-     */
-    VectorXd cutoff = obs.col(model.poset[*v].event_id).select(sampling_time - time_parents_max,
-                              std::numeric_limits<double>::infinity());
-    VectorXd time = rtexp(N, model.get_lambda()[model.poset[*v].event_id], cutoff, rng);
-
-    VectorXd aux2 = obs.col(model.poset[*v].event_id).select(time_parents_max,
-                            time_parents_max.cwiseMax(sampling_time));
-    time_events_sum.col(model.poset[*v].event_id) = aux2 + time;
-    time_events.col(model.poset[*v].event_id) = time_events_sum.col(model.poset[*v].event_id) - time_parents_max;
-
-    dens += dexp_log(time, model.get_lambda()[model.poset[*v].event_id]) -
-      pexp_log(cutoff, model.get_lambda()[model.poset[*v].event_id]);
   }
+  dens.array() += log_lambda_sum;
   return time_events;
 }
 
-
-VectorXd cbn_density_log(const MatrixXd& time, const VectorXd& lambda) {
+template MatrixXd generate_mutation_times<double>(
+    const MatrixXb&, const Model&, VectorXd&, VectorXd&, Context::rng_type&,
+    const bool);
+template MatrixXf generate_mutation_times<float>(
+    const MatrixXb&, const Model&, VectorXd&, VectorXf&, Context::rng_type&,
+    const bool);
+
+//' Log-density of the time differences. The products with the rates are
+//' accumulated in double precision
+//'
+//' @noRd
+template <typename Scalar>
+VectorXd cbn_density_log(const MatrixT<Scalar>& time, const VectorXd& lambda) {
   
   unsigned int nrows = time.rows();
   VectorXd ret(nrows);
   ret.setConstant(lambda.array().log().sum());
-  ret -= time * lambda;
+  ret -= time.template cast<double>() * lambda;
   // for (unsigned int i = 0; i < nrows; ++i)
   //   ret[i] -= (time.row(i) * lambda);
 
   return ret;
 }
 
+template VectorXd cbn_density_log<double>(const MatrixXd&, const VectorXd&);
+template VectorXd cbn_density_log<float>(const MatrixXf&, const VectorXd&);
+
 RcppExport SEXP _scale_path_to_mutation(SEXP posetSEXP, SEXP lambdaSEXP) {
   try {
     /* Convert input to C++ types */
@@ -325,7 +390,7 @@ RcppExport SEXP _cbn_density_log(SEXP timeSEXP, SEXP lambdaSEXP) {
     const MapMatd time(Rcpp::as<MapMatd>(timeSEXP));
     const MapVecd lambda(Rcpp::as<MapVecd>(lambdaSEXP));
 
-    VectorXd ret = cbn_density_log(time, lambda);
+    VectorXd ret = cbn_density_log<double>(time, lambda);
     
     return Rcpp::wrap( ret );
   } catch  (...) {
@@ -23,11 +23,13 @@ RowVectorXb draw_sample(const RowVectorXb& genotype, const Model& model,
                         const int idx_remove, const int idx_add,
                         bool compatible);
 
-MatrixXd generate_mutation_times(const MatrixXb& obs, const Model& model,
-                                 VectorXd& dens, VectorXd& sampling_time,
-                                 Context::rng_type& rng,
-                                 const bool sampling_times_available=false);
+template <typename Scalar>
+MatrixT<Scalar> generate_mutation_times(
+    const MatrixXb& obs, const Model& model, VectorXd& dens,
+    VectorT<Scalar>& sampling_time, Context::rng_type& rng,
+    const bool sampling_times_available=false);
 
-VectorXd cbn_density_log(const MatrixXd& time, const VectorXd& lambda);
+template <typename Scalar>
+VectorXd cbn_density_log(const MatrixT<Scalar>& time, const VectorXd& lambda);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Walker's alias method for drawing from a discrete distribution
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <stdexcept>
+#include "alias_table.hpp"
+
+void AliasTable::set_weights(const VectorXd& weights) {
+  const unsigned int n = weights.size();
+  const double total = weights.sum();
+  if (n == 0 || !(total > 0))
+    throw std::runtime_error("ERROR: weights of the discrete distribution " \
+                             "should be non-negative and not all zero");
+
+  _prob.resize(n);
+  _alias.resize(n);
+  _small.clear();
+  _large.clear();
+
+  /* Scale the weights such that they average to one */
+  for (unsigned int i = 0; i < n; ++i) {
+    _prob[i] = weights[i] * n / total;
+    _alias[i] = i;
+    if (_prob[i] < 1.0)
+      _small.push_back(i);
+    else
+      _large.push_back(i);
+  }
+
+  /* Fill every column below one with the excess of a column above one */
+  while (!_small.empty() && !_large.empty()) {
+    const unsigned int s = _small.back();
+    const unsigned int l = _large.back();
+    _small.pop_back();
+    _alias[s] = l;
+    _prob[l] = (_prob[l] + _prob[s]) - 1.0;
+    if (_prob[l] < 1.0) {
+      _large.pop_back();
+      _small.push_back(l);
+    }
+  }
+
+  /* Remaining columns are full, up to rounding errors */
+  for (unsigned int i = 0; i < _large.size(); ++i)
+    _prob[_large[i]] = 1.0;
+  for (unsigned int i = 0; i < _small.size(); ++i)
+    _prob[_small[i]] = 1.0;
+}
@@ -0,0 +1,70 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Walker's alias method for drawing from a discrete distribution
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef ALIAS_TABLE_HPP
+#define ALIAS_TABLE_HPP
+
+#include <algorithm>
+#include <vector>
+#include <RcppEigen.h>
+#include "mcem.hpp"
+
+/* Alias table of a discrete distribution over {0, ..., n - 1}, built with
+ * Vose's method in O(n). Each draw takes a single uniform random number and
+ * O(1) operations. Storage is kept between calls to 'set_weights', such that
+ * a table can be reused for distributions of similar size
+ */
+class AliasTable {
+public:
+  AliasTable() {}
+
+  AliasTable(const VectorXd& weights) {
+    set_weights(weights);
+  }
+
+  void set_weights(const VectorXd& weights);
+
+  inline unsigned int size() const {
+    return _prob.size();
+  }
+
+  /* Draw N indices into 'output'. Uniform random numbers are generated in
+   * blocks of RNG_BUFFER_SIZE values
+   */
+  void sample(const unsigned int N, int* output, Context::rng_type& rng) {
+    const unsigned int n = size();
+    const unsigned int block = std::min(N, RNG_BUFFER_SIZE);
+    _u.resize(block);
+    for (unsigned int start = 0; start < N; start += block) {
+      const unsigned int len = std::min(block, N - start);
+      rng.fill_uniform(_u.data(), len);
+      for (unsigned int i = 0; i < len; ++i) {
+        /* The integer part selects the column and the fractional part
+         * decides between the column and its alias
+         */
+        const double x = _u[i] * n;
+        const unsigned int col = std::min((unsigned int) x, n - 1);
+        output[start + i] = (x - col) < _prob[col] ? col : _alias[col];
+      }
+    }
+  }
+
+  std::vector<int> sample(const unsigned int N, Context::rng_type& rng) {
+    std::vector<int> ret(N);
+    sample(N, ret.data(), rng);
+    return ret;
+  }
+
+private:
+  std::vector<double> _prob;          // probability of keeping each column
+  std::vector<unsigned int> _alias;   // alias of each column
+  std::vector<unsigned int> _small;   // work lists used while building
+  std::vector<unsigned int> _large;
+  std::vector<double> _u;             // uniform random numbers of a block
+};
+
+#endif
@@ -13,6 +13,12 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <ctime>
 
 #include <Rcpp.h>
 #include <RcppEigen.h>
@@ -24,7 +30,9 @@
 
 #include "mcem.hpp"
 #include "asa.hpp"
+#include "move_table.hpp"
 #include "not_acyclic_exception.hpp"
+#include "task_runtime.hpp"
 
 using namespace Rcpp;
 
@@ -52,10 +60,137 @@ bool ControlSA::get_adaptive() const {
   return _adaptive;
 }
 
+unsigned int ControlSA::get_surrogate_L() const {
+  return _surrogate_L;
+}
+
+unsigned int ControlSA::get_surrogate_max_iter() const {
+  return _surrogate_max_iter;
+}
+
+bool ControlSA::get_adaptive_moves() const {
+  return _adaptive_moves;
+}
+
+unsigned int ControlSA::get_fidelity_levels() const {
+  return _fidelity_levels;
+}
+
 const std::string& ControlSA::get_outdir() const{
   return _outdir;
 }
 
+const std::vector<double>& MoveSelector::get_weights() const {
+  return _weights;
+}
+
+int MoveSelector::draw(Context::rng_type& rng) const {
+  std::discrete_distribution<int> distribution(_weights.begin(),
+                                               _weights.end());
+  return distribution(rng);
+}
+
+//' @description Record the improvement in log-likelihood and the CPU time
+//' spent on a proposed move, and update the move-type weights
+void MoveSelector::update(const int move, const double gain,
+                          const double cpu_time) {
+  const unsigned int num_types = _weights.size();
+  _gain[move] += std::max(gain, 0.0);
+  _cpu_time[move] += cpu_time;
+  _num_moves[move] += 1;
+
+  if (!_adaptive)
+    return;
+
+  /* Adapt only once every move type has been proposed */
+  for (unsigned int k = 0; k < num_types; ++k)
+    if (_initial_weights[k] > 0.0 && _num_moves[k] == 0)
+      return;
+
+  /* Improvement per CPU-second */
+  std::vector<double> rate(num_types, 0.0);
+  double rate_sum = 0.0;
+  double initial_sum = 0.0;
+  for (unsigned int k = 0; k < num_types; ++k) {
+    initial_sum += _initial_weights[k];
+    if (_initial_weights[k] > 0.0) {
+      rate[k] = _gain[k] / std::max(_cpu_time[k], 1e-9);
+      rate_sum += rate[k];
+    }
+  }
+  if (rate_sum <= 0.0) {
+    /* No improvement so far */
+    rate = _initial_weights;
+    rate_sum = initial_sum;
+  }
+
+  /* Move the weights towards the target distribution. A fraction of the
+   * initial weights is kept, such that all move types are proposed
+   */
+  _num_updates += 1;
+  const double step = 1.0 / std::pow(_num_updates + 1.0, _decay);
+  for (unsigned int k = 0; k < num_types; ++k) {
+    double target = (1 - _min_weight) * rate[k] / rate_sum +
+      _min_weight * _initial_weights[k] / initial_sum;
+    _weights[k] = (1 - step) * _weights[k] + step * target;
+  }
+}
+
+unsigned int FidelitySchedule::get_level() const {
+  return _level;
+}
+
+unsigned int FidelitySchedule::get_L() const {
+  return std::max(_L >> (_num_levels - 1 - _level), 1u);
+}
+
+ControlEM FidelitySchedule::get_control_EM() const {
+  ControlEM control_EM(_control_EM);
+  control_EM.max_iter =
+    std::max(_control_EM.max_iter >> (_num_levels - 1 - _level), 1u);
+  control_EM.update_step_size =
+    std::min(_control_EM.update_step_size, control_EM.max_iter);
+  return control_EM;
+}
+
+//' @description Update the fidelity level given the current temperature and
+//' the absolute difference in log-likelihood between the last proposed poset
+//' and the current one (NaN if the proposal was not evaluated)
+//' @return returns true if the fidelity level was raised
+bool FidelitySchedule::update(const float T, const double llhood_diff) {
+  if (_level == _num_levels - 1)
+    return false;
+
+  if (!std::isnan(llhood_diff)) {
+    _num_diffs += 1;
+    if (_num_diffs == 1)
+      _mean_diff = llhood_diff;
+    else
+      _mean_diff += _smoothing * (llhood_diff - _mean_diff);
+    if (_num_diffs == _min_diffs)
+      _reference_diff = _mean_diff;
+  }
+
+  /* Level given by the temperature */
+  unsigned int level = _level;
+  if (_T0 > 0.0 && T < _T0) {
+    unsigned int level_T = (unsigned int) (_num_levels * (1.0 - T / _T0));
+    level = std::max(level, std::min(level_T, _num_levels - 1));
+  }
+  /* Likelihood differences shrink */
+  if (_num_diffs > _min_diffs && _mean_diff < 0.5 * _reference_diff)
+    level = std::max(level, _level + 1);
+
+  if (level == _level)
+    return false;
+
+  _level = level;
+  _num_diffs = 0;
+  _mean_diff = 0.0;
+  _reference_diff = 0.0;
+  return true;
+}
+
 void write_poset(const Poset& poset, const std::string& outdir) {
   std::ofstream outfile_poset;
   outfile_poset.open(outdir + "poset.txt", std::ofstream::trunc);
@@ -128,182 +263,348 @@ void initialize_lambda(Model& model, const MatrixXb& obs, const float max_lambda
   model.update_lambda(lambda, max_lambda);
 }
 
+/* Outcome of testing a candidate move */
+enum ScreeningStatus {
+  SCREEN_CYCLE,          // the resulting graph contains cycles
+  SCREEN_NOT_REDUCED,    // the resulting graph is not transitively reduced
+  SCREEN_FEASIBLE,       // the resulting graph is a valid poset
+  SCREEN_REJECTED,       // rejected by the compatibility heuristic
+  SCREEN_ACCEPTED        // accepted by the compatibility heuristic
+};
+
 //' Heuristic based on the fraction of compatible observations with the
-//' proposed poset
-bool heuristic_compatibility(Model& M, const MatrixXb& obs,
-                             const double fraction_compatible,
-                             double& fraction_compatible_new,
+//' proposed poset. A random number is only drawn if the fraction decreases
+//'
+//' @noRd
+bool heuristic_compatibility(const double fraction_compatible,
+                             const double fraction_compatible_new,
                              const float factor_fraction_compatible,
-                             Context& ctx) {
+                             Context::rng_type& rng) {
 
-  std::uniform_real_distribution<> rand(0.0, 1.0);
-
-  const auto N = obs.rows();
-  fraction_compatible_new =
-    (double) num_compatible_observations(obs, M, N) / N;
-  if (ctx.get_verbose())
-    std::cout << "Fraction of compatible observations: "
-              << fraction_compatible_new << std::endl;
   if (fraction_compatible_new < fraction_compatible) {
     double prob =
       std::exp((fraction_compatible_new - fraction_compatible) /
         factor_fraction_compatible);
-    if (prob > rand(ctx.rng)) {
-      if (ctx.get_verbose())
-        std::cout << "Edge accepted despite of a lower fraction of "
-                  << "compatible genotypes (accept. prob. = " << prob  << ")"
-                  << std::endl;
-        return true;
+    return prob > rng.uniform();
+  }
+  return true;
+}
+
+//' Apply a move to (a copy of) the current poset
+//'
+//' @noRd
+//' @param move 0: add/remove edge, 1: swap edge, 2: add/remove cover relation
+//' while preserving the remaining cover relations, and 3: swap node labels
+//' @param added set to true if an edge or cover relation was added
+ScreeningStatus apply_move(Model& M_new, const int move, const Node v1,
+                           const Node v2, bool& added) {
+  added = false;
+  switch(move) {
+  case 0:
+    /* Change edge
+     * if the edge already existed, remove it. Otherwise, add it
+     */
+    added = M_new.add_edge(v1, v2);
+    if (added) {
+      if (M_new.cycle)
+        return SCREEN_CYCLE;
+      if (!M_new.reduction_flag)
+        return SCREEN_NOT_REDUCED;
+    } else {
+      M_new.remove_edge(v1, v2);
     }
-  } else {
-    return true;
+    break;
+  case 1:
+    /* Swap edge: remove edge v1 -> v2 and add edge v2 -> v1 */
+    M_new.remove_edge(v1, v2);
+    M_new.add_edge(v2, v1);
+    if (M_new.cycle)
+      return SCREEN_CYCLE;
+    break;
+  case 2:
+    /* Add or remove an edge, while preserving cover relations */
+    added = M_new.add_relation(v1, v2);
+    if (added) {
+      if (M_new.cycle)
+        return SCREEN_CYCLE;
+      /* NOTE: The resulting poset can be non transitively reduced, e.g.,
+       * if the new edge doesn't correspond to a new cover relation (v2
+       * was already reachable from v1)
+       */
+      if (!M_new.reduction_flag)
+        return SCREEN_NOT_REDUCED;
+    } else {
+      M_new.remove_relation(v1, v2);
+    }
+    break;
+  case 3:
+    /* Swap node labels */
+    M_new.swap_node(v1, v2);
+    break;
   }
-  return false;
+  return SCREEN_FEASIBLE;
+}
+
+//' Log the outcome of testing a candidate move
+//'
+//' @noRd
+void report_candidate(const Model& M, const int move, const Node v1,
+                      const Node v2, const ScreeningStatus status,
+                      const bool added, const double fraction_compatible_new) {
+
+  const unsigned int e1 = M.poset[v1].event_id;
+  const unsigned int e2 = M.poset[v2].event_id;
+  switch(move) {
+  case 0:
+    std::cout << "Testing edge: " << e1 << "->" << e2 << std::endl;
+    break;
+  case 1:
+    std::cout << "Testing the edge swap: " << e1 << "->" << e2 << std::endl;
+    break;
+  case 2:
+    std::cout << "Testing edge (preserving cover relations): " << e1 << "->"
+              << e2 << std::endl;
+    break;
+  case 3:
+    std::cout << "Testing node swap: " << e1 << ", " << e2 << std::endl;
+    break;
+  }
+
+  if (status == SCREEN_CYCLE) {
+    std::cout << "Cycle!" << std::endl;
+    return;
+  } else if (status == SCREEN_NOT_REDUCED) {
+    return;
+  }
+
+  switch(move) {
+  case 0:
+    std::cout << (added ? "Adding new edge: (" : "Removing edge: (") << e1
+              << "," << e2 << ")" << std::endl;
+    break;
+  case 1:
+    std::cout << "Swapping edge: (" << e1 << "," << e2 << ")" << std::endl;
+    break;
+  case 2:
+    std::cout << (added ? "Adding new cover relation: (" :
+                    "Removing cover relation: (")
+              << e1 << "," << e2 << ")" << std::endl;
+    break;
+  }
+  std::cout << "Fraction of compatible observations: "
+            << fraction_compatible_new << std::endl;
+}
+
+//' Screen candidate moves and select the first one, in the order given by
+//' 'candidates', which yields a valid poset and passes the compatibility
+//' heuristic. With several threads, batches of 'thrds' candidates are
+//' applied and their fractions of compatible observations computed in
+//' parallel. The heuristic is then evaluated in the candidate order and stops
+//' at the first accepted candidate, such that random numbers are only drawn
+//' for the candidates a sequential scan would test, and the selected move does
+//' not depend on the number of threads
+//'
+//' @noRd
+//' @return returns the index of the selected candidate or -1 if none of them
+//' was accepted
+int screen_candidates(
+    const Model& M, const edge_container& candidates, const int move,
+    const MatrixXb& obs, const double fraction_compatible,
+    const float factor_fraction_compatible, Model& M_new,
+    double& fraction_compatible_new, const unsigned int thrds, Context& ctx) {
+
+  const unsigned int num_candidates = candidates.size();
+  const unsigned int N = obs.rows();
+  const unsigned int max_batch_size = std::max(thrds, 1u);
+
+  std::vector< std::unique_ptr<Model> > models(max_batch_size);
+  std::vector<ScreeningStatus> status(max_batch_size);
+  std::vector<char> added(max_batch_size, false);
+  std::vector<double> fractions(max_batch_size, 0.0);
+
+  auto apply_candidate = [&](const unsigned int start, const unsigned int k) {
+    bool add = false;
+    models[k].reset(new Model(M));
+    status[k] = apply_move(*models[k], move, candidates[start + k].first,
+                           candidates[start + k].second, add);
+    added[k] = add;
+    if (status[k] == SCREEN_FEASIBLE)
+      fractions[k] =
+        (double) num_compatible_observations(obs, *models[k], N) / N;
+  };
+
+  for (unsigned int start = 0; start < num_candidates;
+       start += max_batch_size) {
+    const unsigned int batch_size =
+      std::min(max_batch_size, num_candidates - start);
+    if (batch_size == 1)
+      apply_candidate(start, 0);
+    else
+      parallel_for(batch_size, thrds, [&](const unsigned int k) {
+        apply_candidate(start, k);
+      });
+
+    /* The first accepted candidate wins, exactly as in a sequential scan */
+    for (unsigned int k = 0; k < batch_size; ++k) {
+      if (status[k] == SCREEN_FEASIBLE)
+        status[k] = heuristic_compatibility(
+          fraction_compatible, fractions[k], factor_fraction_compatible,
+          ctx.rng) ? SCREEN_ACCEPTED : SCREEN_REJECTED;
+      if (ctx.get_verbose()) {
+        report_candidate(M, move, candidates[start + k].first,
+                         candidates[start + k].second, status[k], added[k],
+                         fractions[k]);
+        if (move == 3 && status[k] != SCREEN_CYCLE)
+          models[k]->print_cover_relations();
+        if (status[k] == SCREEN_ACCEPTED && fractions[k] < fraction_compatible)
+          std::cout << "Edge accepted despite of a lower fraction of "
+                    << "compatible genotypes" << std::endl;
+      }
+      if (status[k] == SCREEN_ACCEPTED) {
+        M_new = *models[k];
+        fraction_compatible_new = fractions[k];
+        return start + k;
+      }
+    }
+  }
+  return -1;
+}
+
+//' Surrogate score of a poset used for the delayed acceptance, i.e., the
+//' observed log-likelihood after a short MCEM run with few samples
+//'
+//' @noRd
+double surrogate_llhood(
+    const Model& M, const MatrixXb& obs, const VectorXd& times,
+    const RowVectorXd& weights, const std::string& sampling,
+    const ControlEM& control_EM, const ControlSA& control_ASA,
+    const bool sampling_times_available, const unsigned int thrds,
+    Context& ctx) {
+
+  const vertices_size_type p = M.size();  // Number of mutations / events
+  const auto N = obs.rows();              // Number of observations / genotypes
+  const unsigned int max_iter = control_ASA.get_surrogate_max_iter();
+  ControlEM control_surrogate(max_iter, std::max(max_iter / 2, 1u),
+                              control_EM.tol, control_EM.max_lambda,
+                              control_EM.neighborhood_dist);
+
+  Model M_surrogate(M);
+  initialize_lambda(M_surrogate, obs, control_EM.max_lambda);
+  M_surrogate.update_epsilon(
+    (double) num_incompatible_events(obs, M_surrogate) / (N * p),
+    std::numeric_limits<double>::epsilon());
+
+  return MCEM_hcbn(
+    M_surrogate, obs, times, weights, control_ASA.get_surrogate_L(), sampling,
+    control_surrogate, sampling_times_available, thrds, ctx);
 }
 
 //' Propose moves for the simulated annealing
 //'
 //' @noRd
+//' @param llhood_surrogate surrogate score of the current poset. It is
+//' computed on demand, if it is NaN
+//' @param llhood_proposal log-likelihood of the proposed poset. It is set to
+//' NaN, if no poset was evaluated with the full MCEM
+//' @param move_table feasible moves given the current poset. It is updated
+//' if the proposed poset is accepted
+//' @param move type of move: modify - add/delete - edge (0), swap edge (1),
+//' add/delete edge while preserving cover relations (2) or swap node labels
+//' (3)
 double propose_edge(
-    Model& M, const MatrixXb& obs, const double llhood_current,
-    double& fraction_compatible, const VectorXd& times,
-    const RowVectorXd& weights, const float T, int& num_accept,
-    const float factor_fraction_compatible, const unsigned int L,
+    Model& M, const int move, const MatrixXb& obs, const double llhood_current,
+    double& llhood_surrogate, double& llhood_proposal,
+    double& fraction_compatible,
+    const VectorXd& times, const RowVectorXd& weights,
+    const ControlSA& control_ASA, int& num_accept, const unsigned int L,
     const std::string& sampling, const ControlEM& control_EM,
     const bool sampling_times_available, MatrixXd& llhood_addRemove,
-    MatrixXd& llhood_swap, MatrixXd& llhood_preserve, const unsigned int thrds,
-    Context& ctx) {
+    MatrixXd& llhood_swap, MatrixXd& llhood_preserve, MoveTable& move_table,
+    const unsigned int thrds, Context& ctx) {
   
   const vertices_size_type p = M.size();  // Number of mutations / events
   const auto N = obs.rows();              // Number of observations / genotypes
+  const float T = control_ASA.T;
+  const float factor_fraction_compatible =
+    control_ASA.get_compatible_fraction_factor();
   
   Model M_new(M);
   double llhood_new = 0.0;
+  llhood_proposal = std::numeric_limits<double>::quiet_NaN();
   double fraction_compatible_new = 0.0;
-  unsigned int num_edges = boost::num_edges(M.poset);
-  std::vector<int> idxs_pool(num_edges);
-  std::vector<int> cover_relations_pool(p * p);
-
-  /* Shuffle pool of indices. Use to draw edges/cover relations */
-  std::iota(idxs_pool.begin(), idxs_pool.end(), 0);
-  std::shuffle(idxs_pool.begin(), idxs_pool.end(), ctx.rng);
-  std::iota(cover_relations_pool.begin(), cover_relations_pool.end(), 0);
-  std::shuffle(cover_relations_pool.begin(), cover_relations_pool.end(), ctx.rng);
-
-  std::uniform_real_distribution<> rand(0.0, 1.0);
 
-  /* Propose an update.
-   * Pick move: modify - add/delete - edge, swap edge or add/delete edge while
-   * preserving cover relations
+  /* Candidate moves in the order in which they are tested. Only moves that
+   * yield a valid poset are drawn
    */
-  std::discrete_distribution<int> distribution({0.5, 0.0, 0.4, 0.1});
-  int move = distribution(ctx.rng);
-  unsigned int i, v1, v2;
-
-  switch(move) {
-  case 0:
-    /* Change edge
-     * if the edge already existed, remove it. Otherwise, add it
-     */
-    for (i = 0; i < p * p; ++i) {
-
-      /* Every time a new move is proposed, start with the initial poset */
-      M_new = M;
-
-      /* Draw one relation at random */
-      v1 = (int) cover_relations_pool[i] / p;
-      v2 = cover_relations_pool[i] % p;
-      if (v1 == v2)
-        continue;
-
-      if (ctx.get_verbose())
-        std::cout << "Testing edge: " <<  M_new.poset[v1].event_id << "->"
-                  << M_new.poset[v2].event_id << std::endl;
-
-      bool add = M_new.add_edge(v1, v2);
-      if (add) {
-        if (M_new.cycle) {
-          if (ctx.get_verbose())
-            std::cout << "Cycle!" << std::endl;
-          continue;
-        } else {
-          if (M_new.reduction_flag) {
-            if (ctx.get_verbose())
-              std::cout << "Adding new edge: (" <<  M_new.poset[v1].event_id
-                        << "," << M_new.poset[v2].event_id << ")" << std::endl;
-          } else {
-            continue;
-          }
-        }
-      } else {
-        /* Remove edge*/
-        M_new.remove_edge(v1, v2);
-        if (ctx.get_verbose())
-          std::cout << "Removing edge: (" <<  M_new.poset[v1].event_id << ","
-                    << M_new.poset[v2].event_id << ")" << std::endl;
-      }
-      if (heuristic_compatibility(M_new, obs, fraction_compatible,
-                                  fraction_compatible_new,
-                                  factor_fraction_compatible, ctx))
-        break;
-    }
-    if (i == p * p)
+  edge_container candidates = move_table.feasible_moves(M, move);
+  std::shuffle(candidates.begin(), candidates.end(), ctx.rng);
+  if (move == 2 && M.get_update_children())
+    M.set_children();
+
+  int selected = screen_candidates(
+    M, candidates, move, obs, fraction_compatible, factor_fraction_compatible,
+    M_new, fraction_compatible_new, thrds, ctx);
+
+  if (selected < 0) {
+    switch(move) {
+    case 0:
       std::cout << "Warning: All add/remove moves yielded a poset with lower "
                 << "fraction of compatible observations" << std::endl;
-
-    if (llhood_addRemove(v1, v2) == 0.0) {
-      /* Initialization */
-      initialize_lambda(M_new, obs, control_EM.max_lambda);
-      M_new.update_epsilon((double) num_incompatible_events(obs, M_new) / (N * p),
-              std::numeric_limits<double>::epsilon());
-
-      /* Compute likelihood of the proposed/new poset */
-      llhood_new = MCEM_hcbn(
-        M_new, obs, times, weights, L, sampling, control_EM,
-        sampling_times_available, thrds, ctx);
-      llhood_addRemove(v1, v2) = llhood_new;
-    } else {
-      llhood_new = llhood_addRemove(v1, v2);
+      break;
+    case 1:
+      std::cout << "Warning: All swap-edge moves yielded a poset with lower "
+                << "fraction of compatible observations" << std::endl;
+      break;
+    case 2:
+      std::cout << "Warning: All moves yielded a poset with lower fraction "
+                << "of compatible observations" << std::endl;
+      break;
+    case 3:
+      std::cout << "Warning: All swap-node moves yielded a poset with lower "
+                << "fraction of compatible observations" << std::endl;
+      break;
     }
-    break;
-  case 1:
-    /* Swap edge: remove and add edge.
-     * Pick random edge v1 -> v2
-     */
-    for (i = 0; i < num_edges; ++i) {
-
-      /* Every time a new move is proposed, start with the initial poset */
-      M_new = M;
-
-      boost::graph_traits<Poset>::edge_iterator ei;
-      ei = boost::next(boost::edges(M_new.poset).first, idxs_pool[i]);
-      Node v1 = source(*ei, M_new.poset);
-      Node v2 = target(*ei, M_new.poset);
+    /* None of the candidates yields a valid poset, keep the current one */
+    return llhood_current;
+  }
+  const Node v1 = candidates[selected].first;
+  const Node v2 = candidates[selected].second;
+
+  /* Likelihoods of previously evaluated moves (none for edge swaps) */
+  MatrixXd* llhood_cache = NULL;
+  if (move == 0)
+    llhood_cache = &llhood_addRemove;
+  else if (move == 2)
+    llhood_cache = &llhood_preserve;
+  else if (move == 3)
+    llhood_cache = &llhood_swap;
+
+  double llhood_surrogate_new = std::numeric_limits<double>::quiet_NaN();
+  bool delayed_acceptance = false;
+  if (llhood_cache == NULL || (*llhood_cache)(v1, v2) == 0.0) {
+    if (control_ASA.get_surrogate_L() > 0 && T > 0.0) {
+      /* Delayed acceptance. First stage: accept the proposal with probability
+       * min(1, exp((surrogate_new - surrogate_current) / T)). Only proposals
+       * that pass are evaluated with the full MCEM
+       */
+      if (std::isnan(llhood_surrogate))
+        llhood_surrogate = surrogate_llhood(
+          M, obs, times, weights, sampling, control_EM, control_ASA,
+          sampling_times_available, thrds, ctx);
+      llhood_surrogate_new = surrogate_llhood(
+        M_new, obs, times, weights, sampling, control_EM, control_ASA,
+        sampling_times_available, thrds, ctx);
 
-      if (ctx.get_verbose())
-        std::cout << "Testing the edge swap: " << M_new.poset[v1].event_id
-                  << "->" << M_new.poset[v2].event_id << std::endl;
-      /* Remove edge v1 -> v2 */
-      M_new.remove_edge(v1, v2);
-      /* Add edge v2 -> v1 */
-      M_new.add_edge(v2, v1);
-      if (M_new.cycle) {
+      double log_ratio = (llhood_surrogate_new - llhood_surrogate) / T;
+      if (log_ratio < 0.0 && std::exp(log_ratio) <= ctx.rng.uniform()) {
         if (ctx.get_verbose())
-          std::cout << "Cycle!" << std::endl;
-        continue;
-      } else {
-         if (ctx.get_verbose())
-           std::cout << "Swapping edge: (" <<  M_new.poset[v1].event_id << ","
-                     << M_new.poset[v2].event_id << ")" << std::endl;
+          std::cout << "Proposal rejected based on the surrogate score: "
+                    << llhood_surrogate_new << " (current: "
+                    << llhood_surrogate << ")" << std::endl;
+        return llhood_current;
       }
-      if (heuristic_compatibility(M_new, obs, fraction_compatible,
-                                 fraction_compatible_new,
-                                 factor_fraction_compatible, ctx))
-        break;
+      delayed_acceptance = true;
     }
-    if (i == num_edges)
-      std::cout << "Warning: All swap-edge moves yielded a poset with lower "
-                << "fraction of compatible observations" << std::endl;
 
     /* Initialization */
     initialize_lambda(M_new, obs, control_EM.max_lambda);
@@ -314,129 +615,48 @@ double propose_edge(
     llhood_new = MCEM_hcbn(
       M_new, obs, times, weights, L, sampling, control_EM,
       sampling_times_available, thrds, ctx);
-    break;
-  case 2:
-    /* Add or remove a cover relation. Add or remove an edge, while preserving
-     * cover relations
-     */
-    for (i = 0; i < p * p; ++i) {
-      /* Draw one relation at random */
-      v1 = (int) cover_relations_pool[i] / p;
-      v2 = cover_relations_pool[i] % p;
-      if (v1 == v2)
-        continue;
-
-      if (ctx.get_verbose())
-        std::cout << "Testing edge (preserving cover relations): "
-                  << M.poset[v1].event_id << "->" << M.poset[v2].event_id
-                  << std::endl;
-
-      if (M.get_update_children())
-        M.set_children();
-      M_new = M;
-
-      bool add = M_new.add_relation(v1, v2);
-      if (add) {
-        if (M_new.cycle) {
-          if (ctx.get_verbose())
-            std::cout << "Cycle!" << std::endl;
-          continue;
-        } else {
-          if (M_new.reduction_flag) {
-            /* NOTE: The resulting poset can be non transitively reduced, e.g.,
-             * if the new edge doesn't correspond to a new cover relation (v2
-             * was already reachable from v1)
-             */
-            if (ctx.get_verbose())
-              std::cout << "Adding new cover relation: ("
-                        << M_new.poset[v1].event_id << ","
-                        << M_new.poset[v2].event_id << ")" << std::endl;
-          } else {
-            continue;
-          }
-        }
-      } else {
-        /* Remove cover relation */
-        M_new.remove_relation(v1, v2);
-        if (ctx.get_verbose())
-          std::cout << "Removing cover relation: (" <<  M_new.poset[v1].event_id
-                    << "," << M_new.poset[v2].event_id << ")" << std::endl;
-      }
-      if (heuristic_compatibility(M_new, obs, fraction_compatible,
-                                  fraction_compatible_new,
-                                  factor_fraction_compatible, ctx))
-        break;
+    if (llhood_cache != NULL) {
+      (*llhood_cache)(v1, v2) = llhood_new;
+      if (move == 3)
+        (*llhood_cache)(v2, v1) = llhood_new;
     }
-    if (i == p * p)
-      std::cout << "Warning: All moves yielded a poset with lower fraction "
-                << "of compatible observations" << std::endl;
-
-    if (llhood_preserve(v1, v2) == 0.0) {
-      /* Initialization */
-      initialize_lambda(M_new, obs, control_EM.max_lambda);
-      M_new.update_epsilon((double) num_incompatible_events(obs, M_new) / (N * p),
-              std::numeric_limits<double>::epsilon());
-
-      /* Compute likelihood of the proposed/new poset */
-      llhood_new = MCEM_hcbn(
-        M_new, obs, times, weights, L, sampling, control_EM,
-        sampling_times_available, thrds, ctx);
-      llhood_preserve(v1, v2) = llhood_new;
-    } else {
-      llhood_new = llhood_preserve(v1, v2);
-    }
-    break;
-  case 3:
-    /* Swap node labels */
-    for (i = 0; i < p * p; ++i) {
-
-      M_new = M;
-
-      /* Draw two nodes at random */
-      v1 = (int) cover_relations_pool[i] / p;
-      v2 = cover_relations_pool[i] % p;
-      if (v1 == v2)
-        continue;
-
-      if (ctx.get_verbose())
-        std::cout << "Testing node swap: " << M_new.poset[v1].event_id << ", "
-                  << M_new.poset[v2].event_id << std::endl;
-
-      M_new.swap_node(v1, v2);
-      if (ctx.get_verbose())
-        M_new.print_cover_relations();
-
-      if (heuristic_compatibility(M_new, obs, fraction_compatible,
-                                  fraction_compatible_new,
-                                  factor_fraction_compatible, ctx))
-        break;
-    }
-    if (i == p * p)
-      std::cout << "Warning: All swap-node moves yielded a poset with lower "
-                << "fraction of compatible observations" << std::endl;
-
-    if (llhood_swap(v1, v2) == 0.0) {
-      /* Initialization */
-      initialize_lambda(M_new, obs, control_EM.max_lambda);
-      M_new.update_epsilon((double) num_incompatible_events(obs, M_new) / (N * p),
-              std::numeric_limits<double>::epsilon());
+  } else {
+    llhood_new = (*llhood_cache)(v1, v2);
+  }
+  llhood_proposal = llhood_new;
 
-      /* Compute likelihood of the proposed/new poset */
-      llhood_new = MCEM_hcbn(
-        M_new, obs, times, weights, L, sampling, control_EM,
-        sampling_times_available, thrds, ctx);
-      llhood_swap(v1, v2) = llhood_swap(v2, v1) = llhood_new;
-    } else {
-      llhood_new = llhood_swap(v1, v2);
-    }
-    break;
+  /* Accept the proposed poset, if it improves the likelihood. Otherwise,
+   * accept it with certain probability. However, when the temperature (T) is
+   * 0, only accept steps that increase the likelihood
+   */
+  bool accept = false;
+  if (delayed_acceptance) {
+    /* Second stage of the delayed acceptance. The surrogate ratio is divided
+     * out, such that the chain targets the same distribution as without the
+     * first stage
+     */
+    double log_ratio = ((llhood_new - llhood_current) -
+      (llhood_surrogate_new - llhood_surrogate)) / T;
+    accept = log_ratio >= 0.0 || std::exp(log_ratio) > ctx.rng.uniform();
+  } else if (llhood_new > llhood_current) {
+    accept = true;
+  } else if (T != 0.0) {
+    double acceptance_prob = std::exp(-(llhood_current - llhood_new)/T);
+    accept = acceptance_prob > ctx.rng.uniform();
   }
 
-  /* Accept the proposed poset, if it improves the likelihood */
-  if (llhood_new > llhood_current) {
+  if (accept) {
     num_accept += 1;
     M = M_new;
     fraction_compatible = fraction_compatible_new;
+    llhood_surrogate = llhood_surrogate_new;
+    /* Only the successors of v1 and of its predecessors change, unless an
+     * edge is reversed. Swapping node labels leaves the relations unchanged
+     */
+    if (move == 0 || move == 2)
+      move_table.update(M, v1);
+    else if (move == 1)
+      move_table.rebuild(M);
     if (ctx.get_verbose())
       std::cout << "Log-likelihood new poset:" << llhood_new << std::endl;
     llhood_addRemove.setZero();
@@ -444,28 +664,7 @@ double propose_edge(
     llhood_preserve.setZero();
     return llhood_new;
   }
-  
-  /* Accept the proposed poset, if it doesn't improve the solution with certain
-   * probability. However, when the temperature (T) is 0, only accept steps
-   * that increase the likelihood
-   */
-  if (T == 0.0)
-    return llhood_current;
-  
-  double acceptance_prob = std::exp(-(llhood_current - llhood_new)/T);
-  
-  if (acceptance_prob > rand(ctx.rng)) {
-    num_accept += 1;
-    M = M_new;
-    fraction_compatible = fraction_compatible_new;
-    if (ctx.get_verbose())
-      std::cout << "Log-likelihood new poset:" << llhood_new << std::endl;
-    llhood_addRemove.setZero();
-    llhood_swap.setZero();
-    llhood_preserve.setZero();
-    return llhood_new;
-  } else
-    return llhood_current;
+  return llhood_current;
 }
 
 //' Simulated annealing
@@ -483,17 +682,25 @@ double simulated_annealing(
   float acceptace_rate_current;
   float scaling_const = -std::log(2.0) / std::log(control_ASA.get_acceptance_rate());
   int num_accept = 0;
+  double llhood_surrogate = std::numeric_limits<double>::quiet_NaN();
 
   MatrixXd llhood_addRemove = MatrixXd::Zero(poset.size(), poset.size());
   MatrixXd llhood_swap = MatrixXd::Zero(poset.size(), poset.size());
   MatrixXd llhood_preserve = MatrixXd::Zero(poset.size(), poset.size());
 
+  /* Start with low-fidelity likelihood evaluations, if requested */
+  FidelitySchedule fidelity(control_ASA.get_fidelity_levels(), control_ASA.T,
+                            L, control_EM);
+
   /* 1. Compute likelihood of the initial model */
   double llhood = MCEM_hcbn(
-    poset, obs, times, weights, L, sampling, control_EM,
-    sampling_times_available, thrds, ctx);
+    poset, obs, times, weights, fidelity.get_L(), sampling,
+    fidelity.get_control_EM(), sampling_times_available, thrds, ctx);
   Model poset_ML(poset);
   double llhood_ML = llhood;
+  MoveTable move_table(poset);
+  MoveSelector move_selector({0.5, 0.0, 0.4, 0.1},
+                             control_ASA.get_adaptive_moves());
 
   /* 2. Compute the fraction of compatible observations/genotypes with the
    *    initial poset
@@ -532,12 +739,24 @@ double simulated_annealing(
       std::cout << "Step " << iter << " - log-likelihood: " << llhood
                 << std::endl;
 
-    /* 3.a Compute the likelihood for the new move */
-    llhood = propose_edge(
-      poset, obs, llhood, fraction_compatible, times, weights, control_ASA.T,
-      num_accept, control_ASA.get_compatible_fraction_factor(), L, sampling,
-      control_EM, sampling_times_available, llhood_addRemove, llhood_swap,
-      llhood_preserve, thrds, ctx);
+    /* 3.a Propose an update and compute the likelihood for the new move.
+     *     Pick move: modify - add/delete - edge, swap edge, add/delete edge
+     *     while preserving cover relations or swap node labels
+     */
+    const int move = move_selector.draw(ctx.rng);
+    std::clock_t cpu_start = std::clock();
+    double llhood_proposal;
+    double llhood_new = propose_edge(
+      poset, move, obs, llhood, llhood_surrogate, llhood_proposal,
+      fraction_compatible, times, weights, control_ASA, num_accept,
+      fidelity.get_L(), sampling, fidelity.get_control_EM(),
+      sampling_times_available, llhood_addRemove, llhood_swap,
+      llhood_preserve, move_table, thrds, ctx);
+    move_selector.update(
+      move, llhood_new - llhood,
+      (double) (std::clock() - cpu_start) / CLOCKS_PER_SEC);
+    const double llhood_diff = std::abs(llhood_proposal - llhood);
+    llhood = llhood_new;
     if (llhood > llhood_ML) {
       llhood_ML = llhood;
       poset_ML = poset;
@@ -569,14 +788,45 @@ double simulated_annealing(
         control_ASA.get_adap_rate());
       num_accept = 0;
 
-      if (ctx.get_verbose())
+      if (ctx.get_verbose()) {
         std::cout << "Temperature update: " << control_ASA.T
                   << " (acceptance rate: " << acceptace_rate_current << ")"
                   << std::endl;
+        std::cout << "Move-type weights:";
+        for (const auto& w: move_selector.get_weights())
+          std::cout << " " << w;
+        std::cout << std::endl;
+      }
       /* Write to output file */
       outfile_temperature << iter << "\t" << llhood << "\t" << control_ASA.T
                           << "\t" << acceptace_rate_current << std::endl;
     }
+
+    /* 3.c Raise the fidelity of the likelihood evaluations as the chain cools
+     *     down. Log-likelihoods computed at different fidelity levels are
+     *     not comparable, so the current and the best poset are re-evaluated
+     */
+    if (fidelity.update(control_ASA.T, llhood_diff)) {
+      llhood = MCEM_hcbn(
+        poset, obs, times, weights, fidelity.get_L(), sampling,
+        fidelity.get_control_EM(), sampling_times_available, thrds, ctx);
+      llhood_ML = MCEM_hcbn(
+        poset_ML, obs, times, weights, fidelity.get_L(), sampling,
+        fidelity.get_control_EM(), sampling_times_available, thrds, ctx);
+      if (llhood > llhood_ML) {
+        llhood_ML = llhood;
+        poset_ML = poset;
+        write_poset(poset.poset, control_ASA.get_outdir());
+      }
+      llhood_addRemove.setZero();
+      llhood_swap.setZero();
+      llhood_preserve.setZero();
+
+      if (ctx.get_verbose())
+        std::cout << "Fidelity update: level " << fidelity.get_level()
+                  << " (L: " << fidelity.get_L() << ", EM iterations: "
+                  << fidelity.get_control_EM().max_iter << ")" << std::endl;
+    }
   }
 
   /* 4. Compute likelihood of the final model */
@@ -599,8 +849,10 @@ RcppExport SEXP _adaptive_simulated_annealing(
     SEXP update_step_sizeSEXP, SEXP tolSEXP, SEXP max_lambdaSEXP, SEXP T0SEXP,
     SEXP adap_rateSEXP, SEXP acceptance_rateSEXP, SEXP step_sizeSEXP,
     SEXP max_iter_ASASEXP, SEXP neighborhood_distSEXP, SEXP adaptiveSEXP,
-    SEXP outdirSEXP, SEXP sampling_times_availableSEXP, SEXP thrdsSEXP,
-    SEXP verboseSEXP, SEXP seedSEXP) {
+    SEXP outdirSEXP, SEXP sampling_times_availableSEXP, SEXP surrogate_LSEXP,
+    SEXP surrogate_max_iterSEXP, SEXP adaptive_movesSEXP,
+    SEXP fidelity_levelsSEXP, SEXP thrdsSEXP, SEXP verboseSEXP,
+    SEXP seedSEXP) {
   
   try {
     /* Convert input to C++ types */
@@ -624,6 +876,10 @@ RcppExport SEXP _adaptive_simulated_annealing(
     const bool adaptive = as<bool>(adaptiveSEXP);
     const std::string& outdir = as<std::string>(outdirSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const unsigned int surrogate_L = as<unsigned int>(surrogate_LSEXP);
+    const unsigned int surrogate_max_iter = as<unsigned int>(surrogate_max_iterSEXP);
+    const bool adaptive_moves = as<bool>(adaptive_movesSEXP);
+    const int fidelity_levels = as<int>(fidelity_levelsSEXP);
     const int thrds = as<int>(thrdsSEXP);
     const bool verbose = as<bool>(verboseSEXP);
     const int seed = as<int>(seedSEXP);
@@ -641,10 +897,15 @@ RcppExport SEXP _adaptive_simulated_annealing(
     M.update_epsilon((double) num_incompatible_events(obs, M) / (obs.rows() * p),
             std::numeric_limits<double>::epsilon());
 
+    if (fidelity_levels < 1)
+      throw std::runtime_error("ERROR: number of fidelity levels must be at least one");
+
     ControlEM control_EM(max_iter_EM, update_step_size, tol, max_lambda,
                          neighborhood_dist);
     ControlSA control_ASA(outdir, acceptance_rate, T0, adap_rate, step_size,
-                          max_iter_ASA, adaptive);
+                          max_iter_ASA, adaptive, 0.05, surrogate_L,
+                          surrogate_max_iter, adaptive_moves,
+                          fidelity_levels);
 
     /* Call the underlying C++ function */
     Context ctx(seed, verbose);
@@ -11,8 +11,14 @@
 #define ASA_HPP
 
 #include <Rcpp.h>
+#include <stdexcept>
 #include "mcem.hpp"
 
+/* Largest number of fidelity levels. L and the number of EM iterations are
+ * shifted by up to MAX_FIDELITY_LEVELS - 1 bits
+ */
+static const unsigned int MAX_FIDELITY_LEVELS = 31;
+
 /* Class containing customisable options for the simulated annealing 
  * algorithm
  */
@@ -23,21 +29,32 @@ public:
   ControlSA(unsigned int p, const std::string& outdir, float T=50.0,
             float adap_rate=0.3, unsigned int step_size=20,
             unsigned int max_iter=1000, bool adaptive=true,
-            float compatible_fraction_factor=0.05) :
+            float compatible_fraction_factor=0.05,
+            unsigned int surrogate_L=0, unsigned int surrogate_max_iter=10,
+            bool adaptive_moves=true, unsigned int fidelity_levels=1) :
     T(T), _outdir(outdir), _adap_rate(adap_rate), _step_size(step_size),
     _max_iter(max_iter), _adaptive(adaptive),
-    _compatible_fraction_factor(compatible_fraction_factor) {
+    _compatible_fraction_factor(compatible_fraction_factor),
+    _surrogate_L(surrogate_L), _surrogate_max_iter(surrogate_max_iter),
+    _adaptive_moves(adaptive_moves), _fidelity_levels(fidelity_levels) {
     _acceptance_rate = 1.0 / p;
+    check_fidelity_levels();
   }
   
   ControlSA(const std::string& outdir, float acceptance_rate, float T=50.0,
             float adap_rate=0.3, unsigned int step_size=20,
             unsigned int max_iter=1000, bool adaptive=true,
-            float compatible_fraction_factor=0.05) :
+            float compatible_fraction_factor=0.05,
+            unsigned int surrogate_L=0, unsigned int surrogate_max_iter=10,
+            bool adaptive_moves=true, unsigned int fidelity_levels=1) :
     T(T), _outdir(outdir), _acceptance_rate(acceptance_rate),
     _adap_rate(adap_rate), _step_size(step_size), _max_iter(max_iter),
     _adaptive(adaptive),
-    _compatible_fraction_factor(compatible_fraction_factor) {}
+    _compatible_fraction_factor(compatible_fraction_factor),
+    _surrogate_L(surrogate_L), _surrogate_max_iter(surrogate_max_iter),
+    _adaptive_moves(adaptive_moves), _fidelity_levels(fidelity_levels) {
+    check_fidelity_levels();
+  }
 
   inline float get_adap_rate() const;
 
@@ -50,6 +67,14 @@ public:
   inline float get_compatible_fraction_factor() const;
   
   inline bool get_adaptive() const;
+
+  inline unsigned int get_surrogate_L() const;
+
+  inline unsigned int get_surrogate_max_iter() const;
+
+  inline bool get_adaptive_moves() const;
+
+  inline unsigned int get_fidelity_levels() const;
   
   inline const std::string& get_outdir() const;
 
@@ -61,6 +86,89 @@ protected:
   unsigned int _max_iter;
   bool _adaptive;
   float _compatible_fraction_factor;
+  unsigned int _surrogate_L;        // number of samples for the surrogate score (0: disabled)
+  unsigned int _surrogate_max_iter; // number of EM iterations for the surrogate score
+  bool _adaptive_moves;             // adapt the move-type proposal weights
+  unsigned int _fidelity_levels;    // number of fidelity levels (1: disabled)
+
+private:
+  void check_fidelity_levels() const {
+    if (_fidelity_levels < 1 || _fidelity_levels > MAX_FIDELITY_LEVELS)
+      throw std::runtime_error(
+          "ERROR: number of fidelity levels must be between 1 and " +
+          std::to_string(MAX_FIDELITY_LEVELS));
+  }
+};
+
+/* Class implementing a fidelity schedule for the likelihood evaluations of
+ * the simulated annealing. At fidelity level k (k = 0, ..., K - 1), the
+ * number of samples, L, and the maximum number of EM iterations are divided
+ * by 2^(K - 1 - k). The level is raised as the temperature decreases, or when
+ * the differences in log-likelihood between the current and the proposed
+ * posets shrink to half of the differences observed at the start of the level
+ */
+class FidelitySchedule {
+public:
+  FidelitySchedule(unsigned int num_levels, float T0, unsigned int L,
+                   const ControlEM& control_EM, double smoothing=0.05,
+                   unsigned int min_diffs=20) :
+    _num_levels(std::min(std::max(num_levels, 1u), MAX_FIDELITY_LEVELS)),
+    _level(0), _T0(T0), _L(L),
+    _control_EM(control_EM), _smoothing(smoothing), _min_diffs(min_diffs),
+    _mean_diff(0.0), _reference_diff(0.0), _num_diffs(0) {}
+
+  bool update(const float T, const double llhood_diff);
+
+  unsigned int get_L() const;
+
+  ControlEM get_control_EM() const;
+
+  inline unsigned int get_level() const;
+
+protected:
+  unsigned int _num_levels;
+  unsigned int _level;
+  float _T0;
+  unsigned int _L;
+  ControlEM _control_EM;
+  double _smoothing;          // smoothing factor of the average difference
+  unsigned int _min_diffs;    // differences observed before fixing the reference
+  double _mean_diff;          // average absolute difference in the current level
+  double _reference_diff;
+  unsigned int _num_diffs;
+};
+
+/* Class to select the type of move proposed in each step of the simulated
+ * annealing. Move types are weighted by their improvement in log-likelihood
+ * per CPU-second. The weights are updated with a step size which vanishes
+ * with the number of steps (diminishing adaptation), so that the proposal
+ * distribution converges.
+ */
+class MoveSelector {
+public:
+  MoveSelector(const std::vector<double>& weights, bool adaptive=true,
+               double decay=0.6, double min_weight=0.1) :
+    _weights(weights), _initial_weights(weights), _gain(weights.size(), 0.0),
+    _cpu_time(weights.size(), 0.0), _num_moves(weights.size(), 0),
+    _num_updates(0), _adaptive(adaptive), _decay(decay),
+    _min_weight(min_weight) {}
+
+  int draw(Context::rng_type& rng) const;
+
+  void update(const int move, const double gain, const double cpu_time);
+
+  inline const std::vector<double>& get_weights() const;
+
+protected:
+  std::vector<double> _weights;
+  std::vector<double> _initial_weights;  // move types with weight 0 are disabled
+  std::vector<double> _gain;             // accumulated improvement per move type
+  std::vector<double> _cpu_time;         // accumulated CPU time per move type
+  std::vector<unsigned int> _num_moves;
+  unsigned int _num_updates;
+  bool _adaptive;
+  double _decay;                         // step size 1/(n + 1)^decay
+  double _min_weight;                    // fraction of the initial weights kept
 };
 
 #endif
@@ -56,9 +56,7 @@ void neighbors(const unsigned int p, unsigned int k,
 void runif_std(const unsigned int N, std::vector<double>& output,
                Context::rng_type& rng) {
 
-  std::uniform_real_distribution<double> distribution(0, 1);
-  for (unsigned int i = 0; i < N; ++i)
-    output[i] = distribution(rng);
+  rng.fill_uniform(output.data(), N);
 }
 
 void coin_tossing(MatrixXb& output_mat, const double eps,
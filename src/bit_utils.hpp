@@ -0,0 +1,37 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Bit manipulation on 64-bit words
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef BIT_UTILS_HPP
+#define BIT_UTILS_HPP
+
+#include <cstdint>
+
+/* Number of bits set */
+static inline unsigned int popcount64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  unsigned int count = 0;
+  for (; x; x &= x - 1)
+    ++count;
+  return count;
+#endif
+}
+
+/* Number of trailing zero bits. x must not be 0 */
+static inline unsigned int ctz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  unsigned int count = 0;
+  for (; !(x & 1); x >>= 1)
+    ++count;
+  return count;
+#endif
+}
+
+#endif
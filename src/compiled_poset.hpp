@@ -0,0 +1,90 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *
+ *  This file is part of the mccbn package
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef COMPILED_POSET_HPP
+#define COMPILED_POSET_HPP
+
+#include <algorithm>
+#include <vector>
+#include <boost/graph/graph_traits.hpp>
+#include "mcem.hpp"
+
+/* Flat representation of a poset used by the sampling kernels. Events are
+ * indexed by their event ids, and the parents of event j are stored in
+ * parents[parents_offset[j]], ..., parents[parents_offset[j + 1] - 1].
+ * The depth of an event is the length of the longest path from an event
+ * without parents. Events in the topological order are sorted by depth, and
+ * the events of depth l, which do not depend on each other, are
+ * topo_order[level_offset[l]], ..., topo_order[level_offset[l + 1] - 1]
+ */
+class CompiledPoset {
+public:
+  std::vector<unsigned int> topo_order;     // events in topological order
+  std::vector<unsigned int> parents;
+  std::vector<unsigned int> parents_offset;
+  std::vector<unsigned int> level_offset;
+
+  CompiledPoset() {}
+
+  explicit CompiledPoset(const Model& model) {
+    const vertices_size_type p = model.size();
+    std::vector< std::vector<unsigned int> > parents_event(p);
+    topo_order.reserve(p);
+    /* Loop through nodes in topological order */
+    for (node_container::const_reverse_iterator v = model.topo_path.rbegin();
+         v != model.topo_path.rend(); ++v) {
+      const unsigned int j = model.poset[*v].event_id;
+      topo_order.push_back(j);
+      /* Loop through (direct) predecessors/parents of node v */
+      boost::graph_traits<Poset>::in_edge_iterator in_begin, in_end;
+      for (boost::tie(in_begin, in_end) = boost::in_edges(*v, model.poset);
+           in_begin != in_end; ++in_begin)
+        parents_event[j].push_back(
+          model.poset[source(*in_begin, model.poset)].event_id);
+    }
+    parents_offset.resize(p + 1);
+    parents_offset[0] = 0;
+    for (unsigned int j = 0; j < p; ++j) {
+      parents.insert(parents.end(), parents_event[j].begin(),
+                     parents_event[j].end());
+      parents_offset[j + 1] = parents.size();
+    }
+
+    /* Depths are computed in topological order, and events are then sorted
+     * by depth, which keeps the order topological
+     */
+    std::vector<unsigned int> depth(p, 0);
+    unsigned int num_levels = p > 0 ? 1 : 0;
+    for (unsigned int c = 0; c < p; ++c) {
+      const unsigned int j = topo_order[c];
+      for (unsigned int i = parents_offset[j]; i < parents_offset[j + 1]; ++i)
+        depth[j] = std::max(depth[j], depth[parents[i]] + 1);
+      num_levels = std::max(num_levels, depth[j] + 1);
+    }
+    std::stable_sort(topo_order.begin(), topo_order.end(),
+                     [&depth](const unsigned int a, const unsigned int b) {
+                       return depth[a] < depth[b];
+                     });
+    level_offset.assign(num_levels + 1, 0);
+    for (unsigned int j = 0; j < p; ++j)
+      ++level_offset[depth[j] + 1];
+    for (unsigned int l = 0; l < num_levels; ++l)
+      level_offset[l + 1] += level_offset[l];
+  }
+
+  inline unsigned int size() const {
+    return topo_order.size();
+  }
+
+  /* Number of levels, i.e. the length of the longest chain of events */
+  inline unsigned int num_levels() const {
+    return level_offset.empty() ? 0 : level_offset.size() - 1;
+  }
+};
+
+#endif
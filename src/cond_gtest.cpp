@@ -0,0 +1,586 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Conditional G-tests of independence for PC-based poset learning
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <boost/math/special_functions/gamma.hpp>
+#include "cond_gtest.hpp"
+#include "bit_utils.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+
+using Eigen::Vector2d;
+using Eigen::Matrix2d;
+
+/* Maximum number of Weibull fits per stratum. The error threshold on the
+ * expected number of occurrences increases with the number of fits
+ */
+static const unsigned int WEIBULL_MAX_FITS = 200;
+
+/* Maximum number of quasi-Newton iterations per fit */
+static const unsigned int WEIBULL_MAX_ITER = 100;
+
+/* Approximate memory held by a cache entry besides its key and value: the
+ * node of the hash map, its bucket and the string header
+ */
+static const std::size_t CACHE_ENTRY_OVERHEAD = 64;
+
+/* Largest step of the quasi-Newton iterations in log-parameter space */
+static const double WEIBULL_MAX_STEP = 5.0;
+
+//' Negative log-likelihood of a Weibull model of the occurrence of an event
+//' by the sampling time, and its gradient. Parameters are the logarithms of
+//' the shape, k, and the scale, l. With z = (t / l)^k, an event observed at
+//' time t contributes log(1 - exp(-z)) and an event not observed contributes
+//' -z
+//'
+//' @noRd
+static double weibull_nll(const std::vector<double>& log_times,
+                          const std::vector<bool>& occurred,
+                          const Vector2d& par, Vector2d& grad) {
+  const double shape = std::exp(par[0]);
+  double nll = 0.0;
+  grad.setZero();
+  for (unsigned int i = 0; i < log_times.size(); ++i) {
+    const double log_z = shape * (log_times[i] - par[1]);
+    const double z = std::exp(log_z);
+    double dll_dz;
+    if (occurred[i]) {
+      const double F = -std::expm1(-z);
+      if (F <= 0)
+        return std::numeric_limits<double>::infinity();
+      nll -= std::log(F);
+      dll_dz = 1.0 / std::expm1(z);
+    } else {
+      nll += z;
+      dll_dz = -1.0;
+    }
+    /* dz/dlog(k) = z log(z), dz/dlog(l) = -k z */
+    if (z > 0) {
+      grad[0] -= dll_dz * z * log_z;
+      grad[1] += dll_dz * shape * z;
+    }
+  }
+  if (!std::isfinite(nll) || !grad.allFinite())
+    return std::numeric_limits<double>::infinity();
+  return nll;
+}
+
+//' Maximize the Weibull likelihood by BFGS with a backtracking line search,
+//' starting at 'par'
+//'
+//' @noRd
+static void weibull_bfgs(const std::vector<double>& log_times,
+                         const std::vector<bool>& occurred, Vector2d& par) {
+  Vector2d grad, grad_new, par_new;
+  double nll = weibull_nll(log_times, occurred, par, grad);
+  if (!std::isfinite(nll))
+    return;
+  Matrix2d H = Matrix2d::Identity();
+  for (unsigned int iter = 0; iter < WEIBULL_MAX_ITER; ++iter) {
+    Vector2d direction = -H * grad;
+    if (direction.dot(grad) >= 0) {
+      H.setIdentity();
+      direction = -grad;
+    }
+    const double norm = direction.cwiseAbs().maxCoeff();
+    if (norm > WEIBULL_MAX_STEP)
+      direction *= WEIBULL_MAX_STEP / norm;
+
+    const double slope = direction.dot(grad);
+    double step = 1.0, nll_new = 0.0;
+    bool accepted = false;
+    for (unsigned int k = 0; k < 50 && !accepted; ++k, step *= 0.5) {
+      par_new = par + step * direction;
+      nll_new = weibull_nll(log_times, occurred, par_new, grad_new);
+      accepted = nll_new <= nll + 1e-4 * step * slope;
+    }
+    if (!accepted)
+      break;
+
+    const Vector2d s = par_new - par;
+    const Vector2d y = grad_new - grad;
+    par = par_new;
+    grad = grad_new;
+    const double decrease = nll - nll_new;
+    nll = nll_new;
+    if (grad.cwiseAbs().maxCoeff() < 1e-8 * (1.0 + std::abs(nll)) ||
+        decrease < 1e-12 * (1.0 + std::abs(nll)))
+      break;
+
+    const double sy = s.dot(y);
+    if (sy > 1e-12) {
+      const double rho = 1.0 / sy;
+      const Matrix2d V = Matrix2d::Identity() - rho * y * s.transpose();
+      H = V.transpose() * H * V + rho * s * s.transpose();
+    }
+  }
+}
+
+//' Maximum likelihood estimates of the shape and the scale of a Weibull
+//' distribution of the times themselves, as computed by fitdistr. The
+//' profile equation of the shape,
+//'   sum t^k log t / sum t^k - 1 / k - mean(log t) = 0,
+//' is increasing in k and is solved by bisection on log k
+//'
+//' @noRd
+//' @return returns false if the estimates do not exist, e.g., if some time is
+//' not positive or all times are equal
+static bool weibull_times_mle(const std::vector<double>& times,
+                              double& shape, double& scale) {
+  const unsigned int n = times.size();
+  if (n < 2)
+    return false;
+  std::vector<double> log_times(n);
+  double log_mean = 0.0;
+  for (unsigned int k = 0; k < n; ++k) {
+    if (!(times[k] > 0) || !std::isfinite(times[k]))
+      return false;
+    log_times[k] = std::log(times[k]);
+    log_mean += log_times[k];
+  }
+  log_mean /= n;
+  const double log_max = *std::max_element(log_times.begin(), log_times.end());
+  const double log_min = *std::min_element(log_times.begin(), log_times.end());
+  if (log_max - log_min < 1e-12)
+    return false;
+
+  /* Times are taken relative to the largest one, such that t^k <= 1 */
+  auto log_sum_pow = [&](const double k, double& weighted_log) {
+    double sum = 0.0;
+    weighted_log = 0.0;
+    for (unsigned int i = 0; i < n; ++i) {
+      const double w = std::exp(k * (log_times[i] - log_max));
+      sum += w;
+      weighted_log += w * log_times[i];
+    }
+    weighted_log /= sum;
+    return std::log(sum) + k * log_max;
+  };
+
+  double lower = -20.0, upper = 20.0, weighted_log;
+  for (unsigned int iter = 0; iter < 100; ++iter) {
+    const double mid = 0.5 * (lower + upper);
+    const double k = std::exp(mid);
+    log_sum_pow(k, weighted_log);
+    if (weighted_log - 1.0 / k - log_mean > 0)
+      upper = mid;
+    else
+      lower = mid;
+  }
+  shape = std::exp(0.5 * (lower + upper));
+  scale = std::exp((log_sum_pow(shape, weighted_log) - std::log(n)) / shape);
+  return std::isfinite(shape) && std::isfinite(scale) && shape > 0 &&
+    scale > 0;
+}
+
+CondGTestEngine::CondGTestEngine(
+  const MatrixXb& obs, const VectorXd& times, const double B,
+  const bool adapt_df, const double cache_memory, const int seed) :
+  _N(obs.rows()), _p(obs.cols()), _num_words((obs.rows() + 63) / 64),
+  _B(B), _adapt_df(adapt_df), _cache_size(0), _seed(seed), _num_tests(0),
+  _cache_hits(0) {
+
+  if (times.size() != _N)
+    throw std::runtime_error("ERROR: a sampling time per genotype is expected");
+
+  _bits.assign((std::size_t) _p * _num_words, 0);
+  for (unsigned int j = 0; j < _p; ++j)
+    for (unsigned int i = 0; i < _N; ++i)
+      if (obs(i, j))
+        _bits[(std::size_t) j * _num_words + i / 64] |= (uint64_t) 1 << (i % 64);
+
+  _times.resize(_N);
+  _log_times.resize(_N);
+  for (unsigned int i = 0; i < _N; ++i) {
+    _times[i] = times[i];
+    _log_times[i] = std::log(std::max(times[i],
+                                      std::numeric_limits<double>::min()));
+  }
+
+  _cache_capacity = std::max(cache_memory, 0.0) * 1048576;
+}
+
+void CondGTestEngine::clear_cache() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _fits.clear();
+  _tests.clear();
+  _cache_size = 0;
+}
+
+bool CondGTestEngine::reserve_cache(const std::size_t bytes) {
+  if (_cache_size + bytes > _cache_capacity)
+    return false;
+  _cache_size += bytes;
+  return true;
+}
+
+//' Bit masks of the observations in each non-empty stratum, i.e., each
+//' configuration of the events in S that is observed
+//'
+//' @noRd
+std::vector< std::vector<uint64_t> > CondGTestEngine::strata(
+    const std::vector<unsigned int>& S) const {
+  std::vector< std::vector<uint64_t> > masks(
+      1, std::vector<uint64_t>(_num_words, ~(uint64_t) 0));
+  if (_N % 64)
+    masks[0].back() = ((uint64_t) 1 << (_N % 64)) - 1;
+  if (_N == 0)
+    masks.clear();
+
+  std::vector< std::vector<uint64_t> > split;
+  std::vector<uint64_t> mask_on(_num_words), mask_off(_num_words);
+  for (unsigned int s : S) {
+    const uint64_t* bits = event_bits(s);
+    split.clear();
+    for (const std::vector<uint64_t>& mask : masks) {
+      unsigned int count_on = 0, count_off = 0;
+      for (unsigned int w = 0; w < _num_words; ++w) {
+        mask_on[w] = mask[w] & bits[w];
+        mask_off[w] = mask[w] & ~bits[w];
+        count_on += popcount64(mask_on[w]);
+        count_off += popcount64(mask_off[w]);
+      }
+      if (count_off)
+        split.push_back(mask_off);
+      if (count_on)
+        split.push_back(mask_on);
+    }
+    masks.swap(split);
+  }
+  return masks;
+}
+
+//' Fit the probability of occurrence of an event by the sampling time in a
+//' stratum. As in fit_weibull, the first fit starts at the Weibull estimates
+//' of the sampling times of the stratum, or at (mean(T) / 1000, 1e6) if
+//' these do not exist. As the likelihood may have several local optima,
+//' fits are restarted from random values around that starting point until
+//' the expected number of occurrences is within a threshold of the observed
+//' one. The threshold grows from 0.2 to B * n / 4 with the number of fits
+//'
+//' @noRd
+std::vector<double> CondGTestEngine::fit_weibull(
+    const std::vector<unsigned int>& idx, const std::vector<bool>& occurred,
+    Context::rng_type& rng) const {
+
+  const unsigned int n = idx.size();
+  unsigned int num_occurred = 0;
+  double time_mean = 0.0;
+  std::vector<double> times(n), log_times(n);
+  for (unsigned int k = 0; k < n; ++k) {
+    num_occurred += occurred[k];
+    times[k] = _times[idx[k]];
+    time_mean += times[k];
+    log_times[k] = _log_times[idx[k]];
+  }
+  time_mean /= n;
+  if (num_occurred == 0 || num_occurred == n)
+    return std::vector<double>(n, num_occurred ? 1.0 : 0.0);
+
+  /* Starting point (shape, scale) */
+  Vector2d init;
+  if (!weibull_times_mle(times, init[0], init[1]))
+    init << std::max(time_mean / 1000, std::numeric_limits<double>::min()),
+      1e6;
+  Vector2d par(std::log(init[0]), std::log(init[1]));
+  std::vector<double> prob(n), prob_best;
+  double err_min = n;
+  unsigned int num_fits = 0;
+  double err_thr = std::max(_B * (n / 4.0) / WEIBULL_MAX_FITS, 0.2);
+  while (num_fits < WEIBULL_MAX_FITS && err_min > err_thr) {
+    weibull_bfgs(log_times, occurred, par);
+    const double shape = std::exp(par[0]);
+    double expected = 0.0;
+    for (unsigned int k = 0; k < n; ++k) {
+      prob[k] = -std::expm1(-std::exp(shape * (log_times[k] - par[1])));
+      expected += prob[k];
+    }
+    const double err = std::abs(expected - num_occurred);
+    if (err < err_min) {
+      prob_best = prob;
+      err_min = err;
+    }
+    ++num_fits;
+    err_thr = std::max(_B * (n / 4.0) * (num_fits + 1) / WEIBULL_MAX_FITS,
+                       0.2);
+
+    par[0] = std::log(init[0] * (1.0 / 50 + rng.uniform() * (5 - 1.0 / 50)));
+    par[1] = std::log(init[1] * (1.0 / 10 + rng.uniform() * (5 - 1.0 / 10)));
+  }
+  if (prob_best.empty())
+    prob_best = prob;
+  return prob_best;
+}
+
+//' Fitted probabilities of occurrence of event j for all observations, given
+//' the strata of S
+//'
+//' @noRd
+std::shared_ptr< const std::vector<double> > CondGTestEngine::fit(
+    const unsigned int j, const std::vector<unsigned int>& S) {
+
+  std::vector<unsigned char> buffer;
+  append_uint32(buffer, j);
+  for (unsigned int s : S)
+    append_uint32(buffer, s);
+  const std::string key(buffer.begin(), buffer.end());
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _fits.find(key);
+    if (it != _fits.end())
+      return it->second;
+  }
+
+  Context::rng_type rng(chunk_seed(_seed, fnv1a(key)));
+  std::shared_ptr< std::vector<double> > prob(new std::vector<double>(_N));
+  const uint64_t* bits = event_bits(j);
+  std::vector<unsigned int> idx;
+  std::vector<bool> occurred;
+  for (const std::vector<uint64_t>& mask : strata(S)) {
+    idx.clear();
+    occurred.clear();
+    for (unsigned int w = 0; w < _num_words; ++w) {
+      for (uint64_t word = mask[w]; word; word &= word - 1) {
+        const unsigned int i = 64 * w + ctz64(word);
+        idx.push_back(i);
+        occurred.push_back(bits[w] >> (i % 64) & 1);
+      }
+    }
+    const std::vector<double> prob_stratum = fit_weibull(idx, occurred, rng);
+    for (unsigned int k = 0; k < idx.size(); ++k)
+      (*prob)[idx[k]] = prob_stratum[k];
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_fits.find(key) == _fits.end() &&
+      reserve_cache(key.size() + sizeof(double) * _N + CACHE_ENTRY_OVERHEAD))
+    _fits.insert(std::make_pair(key, prob));
+  return prob;
+}
+
+//' P-value of the conditional G-test of independence between events x and
+//' y given the events in S. The statistic is compared with a chi-squared
+//' distribution with 2^|S| degrees of freedom or, if 'adapt_df' is true,
+//' with as many degrees of freedom as non-empty strata
+//'
+//' @noRd
+double CondGTestEngine::p_value(const unsigned int x, const unsigned int y,
+                                const std::vector<unsigned int>& S) {
+  /* The test is symmetric in x and y */
+  std::vector<unsigned char> buffer;
+  append_uint32(buffer, std::min(x, y));
+  append_uint32(buffer, std::max(x, y));
+  for (unsigned int s : S)
+    append_uint32(buffer, s);
+  const std::string key(buffer.begin(), buffer.end());
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _tests.find(key);
+    if (it != _tests.end()) {
+      ++_cache_hits;
+      return it->second;
+    }
+  }
+
+  const std::vector< std::vector<uint64_t> > masks = strata(S);
+  std::shared_ptr< const std::vector<double> > prob_x = fit(x, S);
+  std::shared_ptr< const std::vector<double> > prob_y = fit(y, S);
+  const uint64_t* bits_x = event_bits(x);
+  const uint64_t* bits_y = event_bits(y);
+
+  double stat = 0.0;
+  for (const std::vector<uint64_t>& mask : masks) {
+    /* Cells (x, y) = (0, 0), (1, 0), (0, 1) and (1, 1) */
+    double observed[4] = {0.0, 0.0, 0.0, 0.0};
+    double expected[4] = {0.0, 0.0, 0.0, 0.0};
+    for (unsigned int w = 0; w < _num_words; ++w) {
+      observed[0] += popcount64(mask[w] & ~bits_x[w] & ~bits_y[w]);
+      observed[1] += popcount64(mask[w] & bits_x[w] & ~bits_y[w]);
+      observed[2] += popcount64(mask[w] & ~bits_x[w] & bits_y[w]);
+      observed[3] += popcount64(mask[w] & bits_x[w] & bits_y[w]);
+      for (uint64_t word = mask[w]; word; word &= word - 1) {
+        const unsigned int i = 64 * w + ctz64(word);
+        const double px = (*prob_x)[i];
+        const double py = (*prob_y)[i];
+        expected[0] += (1 - px) * (1 - py);
+        expected[1] += px * (1 - py);
+        expected[2] += (1 - px) * py;
+        expected[3] += px * py;
+      }
+    }
+    for (unsigned int c = 0; c < 4; ++c)
+      if (observed[c] > 0)
+        stat += 2 * observed[c] * std::log(observed[c] / expected[c]);
+  }
+
+  double df = 1.0;
+  if (_adapt_df)
+    df = masks.size();
+  else if (!S.empty())
+    df = std::ldexp(1.0, S.size());
+
+  double p_value;
+  if (!(stat > 0))
+    p_value = 1.0;
+  else if (!std::isfinite(stat))
+    p_value = 0.0;
+  else
+    p_value = boost::math::gamma_q(df / 2, stat / 2);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  ++_num_tests;
+  if (_tests.find(key) == _tests.end() &&
+      reserve_cache(key.size() + sizeof(double) + CACHE_ENTRY_OVERHEAD))
+    _tests.insert(std::make_pair(key, p_value));
+  return p_value;
+}
+
+//' Enumerate the subsets of size 'm' of the neighbours of x other than y, and
+//' test the independence of x and y given each of them until one is
+//' accepted
+//'
+//' @noRd
+//' @return returns true if x and y are independent given some subset
+static bool test_neighbors(CondGTestEngine& engine, const unsigned int x,
+                           const unsigned int y,
+                           const std::vector<unsigned int>& neighbors,
+                           const unsigned int m, const double alpha,
+                           double& p_max) {
+  std::vector<unsigned int> candidates;
+  for (unsigned int v : neighbors)
+    if (v != y)
+      candidates.push_back(v);
+  const unsigned int n = candidates.size();
+  if (n < m)
+    return false;
+
+  std::vector<unsigned int> subset(m), S(m);
+  for (unsigned int k = 0; k < m; ++k)
+    subset[k] = k;
+  while (true) {
+    for (unsigned int k = 0; k < m; ++k)
+      S[k] = candidates[subset[k]];
+    const double p_value = engine.p_value(x, y, S);
+    p_max = std::max(p_max, p_value);
+    if (p_value >= alpha)
+      return true;
+
+    /* Next subset in lexicographic order */
+    int k = m - 1;
+    while (k >= 0 && subset[k] == n - m + k)
+      --k;
+    if (k < 0)
+      return false;
+    ++subset[k];
+    for (unsigned int l = k + 1; l < m; ++l)
+      subset[l] = subset[l - 1] + 1;
+  }
+}
+
+//' Skeleton of the PC algorithm. Edges are removed if the p-value of some
+//' conditional test is at least 'alpha'. 'p_max' holds the largest p-value
+//' of the tests of each pair
+//'
+//' @noRd
+void pc_skeleton(CondGTestEngine& engine, const double alpha,
+                 const unsigned int m_max, MatrixXi& adjacency,
+                 MatrixXd& p_max, const unsigned int thrds,
+                 const bool verbose) {
+
+  const unsigned int p = engine.num_events();
+  adjacency = MatrixXi::Ones(p, p);
+  adjacency.diagonal().setZero();
+  p_max = MatrixXd::Constant(p, p, -std::numeric_limits<double>::infinity());
+
+  for (unsigned int m = 0; m <= m_max; ++m) {
+    /* Adjacencies are fixed for all tests of the level */
+    std::vector< std::vector<unsigned int> > neighbors(p);
+    bool testable = false;
+    for (unsigned int x = 0; x < p; ++x) {
+      for (unsigned int y = 0; y < p; ++y)
+        if (adjacency(x, y))
+          neighbors[x].push_back(y);
+      if (neighbors[x].size() > m)
+        testable = true;
+    }
+    if (!testable)
+      break;
+
+    std::vector< std::pair<unsigned int, unsigned int> > edges;
+    for (unsigned int x = 0; x < p; ++x)
+      for (unsigned int y = x + 1; y < p; ++y)
+        if (adjacency(x, y))
+          edges.push_back(std::make_pair(x, y));
+
+    const unsigned int num_edges = edges.size();
+    std::vector<char> removed(num_edges, 0);
+    std::vector<double> p_max_edge(num_edges,
+                                   -std::numeric_limits<double>::infinity());
+    parallel_for(num_edges, thrds, [&](const unsigned int e) {
+      const unsigned int x = edges[e].first;
+      const unsigned int y = edges[e].second;
+      removed[e] =
+        test_neighbors(engine, x, y, neighbors[x], m, alpha, p_max_edge[e]) ||
+        test_neighbors(engine, y, x, neighbors[y], m, alpha, p_max_edge[e]);
+    });
+
+    unsigned int num_removed = 0;
+    for (unsigned int e = 0; e < num_edges; ++e) {
+      const unsigned int x = edges[e].first;
+      const unsigned int y = edges[e].second;
+      p_max(x, y) = p_max(y, x) = std::max(p_max(x, y), p_max_edge[e]);
+      if (removed[e]) {
+        adjacency(x, y) = adjacency(y, x) = 0;
+        ++num_removed;
+      }
+    }
+    /* Fits and tests depend on the size of the conditioning sets */
+    engine.clear_cache();
+
+    if (verbose)
+      std::cout << "Order " << m << ": " << num_removed << " of " << num_edges
+                << " edges removed (" << engine.num_tests() << " tests, "
+                << engine.cache_hits() << " cache hits)" << std::endl;
+  }
+}
+
+RcppExport SEXP _pc_skeleton(
+    SEXP obsSEXP, SEXP timesSEXP, SEXP alphaSEXP, SEXP m_maxSEXP, SEXP BSEXP,
+    SEXP adapt_dfSEXP, SEXP cache_memorySEXP, SEXP thrdsSEXP,
+    SEXP verboseSEXP, SEXP seedSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    const MatrixXb& obs = as<MatrixXb>(obsSEXP);
+    const MapVecd times(as<MapVecd>(timesSEXP));
+    const double alpha = as<double>(alphaSEXP);
+    const unsigned int m_max = as<unsigned int>(m_maxSEXP);
+    const double B = as<double>(BSEXP);
+    const bool adapt_df = as<bool>(adapt_dfSEXP);
+    const double cache_memory = as<double>(cache_memorySEXP);
+    const int thrds = as<int>(thrdsSEXP);
+    const bool verbose = as<bool>(verboseSEXP);
+    const int seed = as<int>(seedSEXP);
+
+    /* Call the underlying C++ function */
+    CondGTestEngine engine(obs, times, B, adapt_df, cache_memory, seed);
+    MatrixXi adjacency;
+    MatrixXd p_max;
+    pc_skeleton(engine, alpha, m_max, adjacency, p_max, thrds, verbose);
+
+    /* Return the result as a SEXP */
+    return List::create(_["G"]=adjacency, _["pMax"]=p_max,
+                        _["num_tests"]=(double) engine.num_tests(),
+                        _["cache_hits"]=(double) engine.cache_hits());
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
@@ -0,0 +1,108 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Conditional G-tests of independence for PC-based poset learning
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef COND_GTEST_HPP
+#define COND_GTEST_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mcem.hpp"
+
+/* Conditional G-test of independence between two events X and Y given a set
+ * of events S. Observations are stratified by the configurations of S. In
+ * each stratum, the probability that an event has occurred by the sampling
+ * time is modelled by a Weibull distribution function, and the expected
+ * counts of the 2 x 2 table are obtained from the fitted probabilities of X
+ * and Y under independence.
+ *
+ * Events are stored bit-sliced, as one bit per observation, such that
+ * strata and observed counts are computed with bitwise operations and
+ * population counts. Fitted probabilities depend on the event and the
+ * conditioning set, but not on the other event of the test, so they are
+ * cached and shared by all tests of an event. Test results are cached as
+ * well, and both caches share one memory budget. Fits draw restarts from a
+ * random number stream derived from their key, such that results do not
+ * depend on the order of evaluation
+ */
+class CondGTestEngine {
+public:
+  CondGTestEngine(const MatrixXb& obs, const VectorXd& times, const double B,
+                  const bool adapt_df, const double cache_memory,
+                  const int seed);
+
+  double p_value(const unsigned int x, const unsigned int y,
+                 const std::vector<unsigned int>& S);
+
+  /* Remove the fitted probabilities and the test results from the cache,
+   * e.g., once all tests with conditioning sets of a given size are completed
+   */
+  void clear_cache();
+
+  inline unsigned int num_events() const {
+    return _p;
+  }
+
+  inline unsigned long long num_tests() const {
+    return _num_tests;
+  }
+
+  inline unsigned long long cache_hits() const {
+    return _cache_hits;
+  }
+
+protected:
+  unsigned int _N;
+  unsigned int _p;
+  unsigned int _num_words;
+  std::vector<uint64_t> _bits;  // event j in words [j * _num_words, ...)
+  std::vector<double> _times;
+  std::vector<double> _log_times;
+  double _B;
+  bool _adapt_df;
+  std::size_t _cache_capacity;  // memory budget of both caches in bytes
+  std::size_t _cache_size;      // approximate memory held by both caches
+  int _seed;
+
+  std::mutex _mutex;
+  std::unordered_map< std::string,
+                      std::shared_ptr< const std::vector<double> > > _fits;
+  std::unordered_map<std::string, double> _tests;
+  unsigned long long _num_tests;
+  unsigned long long _cache_hits;
+
+  /* Reserve 'bytes' of the cache budget. Must be called with _mutex held */
+  bool reserve_cache(const std::size_t bytes);
+
+  inline const uint64_t* event_bits(const unsigned int j) const {
+    return &_bits[(std::size_t) j * _num_words];
+  }
+
+  std::vector< std::vector<uint64_t> > strata(
+      const std::vector<unsigned int>& S) const;
+
+  std::shared_ptr< const std::vector<double> > fit(
+      const unsigned int j, const std::vector<unsigned int>& S);
+
+  std::vector<double> fit_weibull(const std::vector<unsigned int>& idx,
+                                  const std::vector<bool>& occurred,
+                                  Context::rng_type& rng) const;
+};
+
+/* Skeleton of the PC algorithm (order-independent variant). At each size of
+ * the conditioning sets, adjacencies are fixed at the start of the level and
+ * all remaining edges are tested in parallel
+ */
+void pc_skeleton(CondGTestEngine& engine, const double alpha,
+                 const unsigned int m_max, MatrixXi& adjacency,
+                 MatrixXd& p_max, const unsigned int thrds,
+                 const bool verbose);
+
+#endif
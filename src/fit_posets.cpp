@@ -0,0 +1,285 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Batched parameter estimation and likelihood evaluation of candidate posets
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <limits>
+#include <map>
+#include "fit_posets.hpp"
+#include "compiled_poset.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+#include "not_acyclic_exception.hpp"
+
+//' Collapse the observations into patterns of identical genotypes and
+//' sampling times
+//'
+//' @noRd
+ObservationPatterns::ObservationPatterns(
+    const MatrixXb& obs_all, const VectorXd& times_all,
+    const RowVectorXd& weights_all, const bool sampling_times_available) {
+  const unsigned int N = obs_all.rows();
+  const unsigned int p = obs_all.cols();
+  std::map<std::pair<std::vector<bool>, double>, unsigned int> idx;
+  std::vector<unsigned int> first;
+  std::vector<double> weights_sum;
+  std::vector<bool> key(p);
+  for (unsigned int i = 0; i < N; ++i) {
+    if (weights_all(i) <= 0)
+      continue;
+    for (unsigned int j = 0; j < p; ++j)
+      key[j] = obs_all(i, j);
+    auto it = idx.insert(std::make_pair(
+      std::make_pair(key, sampling_times_available ? times_all[i] : 0.0),
+      first.size()));
+    if (it.second) {
+      first.push_back(i);
+      weights_sum.push_back(weights_all(i));
+    } else {
+      weights_sum[it.first->second] += weights_all(i);
+    }
+  }
+  if (first.empty())
+    throw std::runtime_error("ERROR: no observation with nonzero weight");
+
+  const unsigned int n = first.size();
+  obs.resize(n, p);
+  times.resize(n);
+  weights.resize(n);
+  for (unsigned int k = 0; k < n; ++k) {
+    obs.row(k) = obs_all.row(first[k]);
+    times[k] = times_all[first[k]];
+    weights(k) = weights_sum[k];
+  }
+  if (p <= MAX_FIXED_SIZE) {
+    masks.resize(n);
+    for (unsigned int k = 0; k < n; ++k)
+      masks[k] = genotype_mask(obs.row(k));
+  }
+}
+
+//' Weighted fraction of the observations that are compatible with the poset.
+//' For posets of up to MAX_FIXED_SIZE events, the parents of each event are
+//' compared with the genotype masks of the patterns
+//'
+//' @noRd
+double compatible_fraction(const ObservationPatterns& patterns,
+                           const Model& model) {
+  const unsigned int p = model.size();
+  double compatible = 0.0;
+  if (p <= MAX_FIXED_SIZE) {
+    const CompiledPoset poset(model);
+    std::vector<uint64_t> parents(p, 0);
+    for (unsigned int j = 0; j < p; ++j)
+      for (unsigned int i = poset.parents_offset[j];
+           i < poset.parents_offset[j + 1]; ++i)
+        parents[j] |= (uint64_t) 1 << poset.parents[i];
+
+    for (unsigned int k = 0; k < patterns.size(); ++k) {
+      const uint64_t genotype = patterns.masks[k];
+      bool is_compatible = true;
+      for (unsigned int j = 0; j < p && is_compatible; ++j)
+        if ((genotype >> j & 1) && (parents[j] & ~genotype))
+          is_compatible = false;
+      if (is_compatible)
+        compatible += patterns.weights(k);
+    }
+  } else {
+    for (unsigned int k = 0; k < patterns.size(); ++k)
+      if (is_compatible(patterns.obs.row(k), model))
+        compatible += patterns.weights(k);
+  }
+  return compatible / patterns.weights.sum();
+}
+
+//' Fit or evaluate one candidate poset of fit_posets
+//'
+//' @noRd
+static void fit_poset(
+    Model& model, const MatrixXb& obs, const ObservationPatterns& patterns,
+    const MatrixXd& ilambda, const VectorXd& ieps, const bool fit,
+    const unsigned int L, const std::string& sampling,
+    const ControlEM& control_EM, const bool sampling_times_available,
+    const int seed, double& llhood, double& alpha, const unsigned int k,
+    const unsigned int thrds) {
+  const vertices_size_type p = model.size();
+  if (ilambda.rows() > 0)
+    model.update_lambda(ilambda.row(k).transpose(), control_EM.max_lambda);
+  else
+    initialize_lambda(model, obs, control_EM.max_lambda);
+  if (ieps.size() > 0)
+    model.set_epsilon(ieps[k]);
+  else
+    model.update_epsilon(
+      (double) num_incompatible_events(obs, model) / (obs.rows() * p),
+      std::numeric_limits<double>::epsilon());
+
+  alpha = compatible_fraction(patterns, model);
+
+  Context ctx_poset(seed);
+  if (fit)
+    llhood = MCEM_hcbn(
+      model, patterns.obs, patterns.times, patterns.weights, L, sampling,
+      control_EM, sampling_times_available, thrds, ctx_poset);
+  else
+    llhood = obs_log_likelihood(
+      patterns.obs, model, patterns.weights, patterns.times, L, sampling,
+      control_EM, ctx_poset, sampling_times_available, thrds);
+}
+
+//' Fit the rate parameters and the error rate of each candidate poset by
+//' MCEM, or only compute the observed log-likelihood at the given parameters.
+//' All posets share the same observation patterns. Posets are distributed
+//' over the threads, and the sampling of each poset runs on the same threads,
+//' such that both levels are balanced by the task runtime. Each poset draws
+//' from its own random number stream, so results do not depend on the
+//' scheduling or on the other posets of the batch
+//'
+//' @noRd
+//' @param ilambda initial rate parameters, one row per poset. If empty, they
+//' are derived from the observations
+//' @param ieps initial error rates, one per poset. If empty, they are derived
+//' from the number of incompatible events
+//' @param alpha weighted fraction of compatible observations per poset
+//' @param errors error messages per poset. Errors of a poset, e.g., if all
+//' samples have weight 0, are recorded here rather than discarding the
+//' results of the other posets. The log-likelihood of the poset is then -Inf
+//' and its parameters are undefined
+void fit_posets(
+    std::vector< std::unique_ptr<Model> >& models, const MatrixXb& obs,
+    const ObservationPatterns& patterns, const MatrixXd& ilambda,
+    const VectorXd& ieps, const bool fit, const unsigned int L,
+    const std::string& sampling, const ControlEM& control_EM,
+    const bool sampling_times_available, VectorXd& llhood, VectorXd& alpha,
+    std::vector<std::string>& errors, const unsigned int thrds, Context& ctx) {
+
+  const unsigned int K = models.size();
+  llhood.resize(K);
+  alpha.setConstant(K, std::numeric_limits<double>::quiet_NaN());
+  errors.assign(K, std::string());
+
+  const int seed = ctx.rng();
+  parallel_for(K, thrds, [&](const unsigned int k) {
+    try {
+      fit_poset(*models[k], obs, patterns, ilambda, ieps, fit, L, sampling,
+                control_EM, sampling_times_available, chunk_seed(seed, k),
+                llhood[k], alpha[k], k, thrds);
+    } catch (const std::exception& e) {
+      errors[k] = e.what();
+      llhood[k] = -std::numeric_limits<double>::infinity();
+    } catch (...) {
+      errors[k] = "c++ exception (unknown reason)";
+      llhood[k] = -std::numeric_limits<double>::infinity();
+    }
+  });
+
+  if (ctx.get_verbose()) {
+    std::cout << "Number of observation patterns: " << patterns.size()
+              << std::endl;
+    std::cout << "poset\tllhood\talpha\tepsilon" << std::endl;
+    for (unsigned int k = 0; k < K; ++k)
+      std::cout << k + 1 << "\t" << llhood[k] << "\t" << alpha[k] << "\t"
+                << models[k]->get_epsilon()
+                << (errors[k].empty() ? "" : "\t" + errors[k]) << std::endl;
+  }
+}
+
+RcppExport SEXP _fit_posets(
+    SEXP posetsSEXP, SEXP obsSEXP, SEXP timesSEXP, SEXP weightsSEXP,
+    SEXP ilambdaSEXP, SEXP epsSEXP, SEXP lambda_sSEXP, SEXP fitSEXP,
+    SEXP LSEXP, SEXP samplingSEXP, SEXP max_iterSEXP,
+    SEXP update_step_sizeSEXP, SEXP tolSEXP, SEXP max_lambdaSEXP,
+    SEXP neighborhood_distSEXP, SEXP pool_memorySEXP,
+    SEXP single_precisionSEXP, SEXP recycle_essSEXP,
+    SEXP sampling_times_availableSEXP, SEXP thrdsSEXP, SEXP verboseSEXP,
+    SEXP seedSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    const List posets(posetsSEXP);
+    const MatrixXb& obs = as<MatrixXb>(obsSEXP);
+    const MapVecd times(as<MapVecd>(timesSEXP));
+    const MapRowVecd weights(as<MapRowVecd>(weightsSEXP));
+    const MapMatd ilambda(as<MapMatd>(ilambdaSEXP));
+    const MapVecd eps(as<MapVecd>(epsSEXP));
+    const float lambda_s = as<float>(lambda_sSEXP);
+    const bool fit = as<bool>(fitSEXP);
+    const unsigned int L = as<unsigned int>(LSEXP);
+    const std::string& sampling = as<std::string>(samplingSEXP);
+    const unsigned int max_iter = as<unsigned int>(max_iterSEXP);
+    const unsigned int update_step_size = as<unsigned int>(update_step_sizeSEXP);
+    const double tol = as<double>(tolSEXP);
+    const float max_lambda = as<float>(max_lambdaSEXP);
+    const unsigned int neighborhood_dist = as<unsigned int>(neighborhood_distSEXP);
+    const double pool_memory = as<double>(pool_memorySEXP);
+    const bool single_precision = as<bool>(single_precisionSEXP);
+    const double recycle_ess = as<double>(recycle_essSEXP);
+    const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const int thrds = as<int>(thrdsSEXP);
+    const bool verbose = as<bool>(verboseSEXP);
+    const int seed = as<int>(seedSEXP);
+
+    const unsigned int K = posets.size();
+    const auto p = obs.cols(); // Number of mutations / events
+    if (ilambda.rows() > 0 && (ilambda.rows() != K || ilambda.cols() != p))
+      throw std::runtime_error(
+          "ERROR: initial rates do not match the number of posets and events");
+    if (eps.size() > 0 && eps.size() != K)
+      throw std::runtime_error(
+          "ERROR: initial error rates do not match the number of posets");
+
+    std::vector< std::unique_ptr<Model> > models(K);
+    for (unsigned int k = 0; k < K; ++k) {
+      const MapMati poset(as<MapMati>(posets[k]));
+      if (poset.rows() != p || poset.cols() != p)
+        throw std::runtime_error(
+            "ERROR: poset does not match the number of events");
+      edge_container edge_list = adjacency_mat2list(poset);
+      models[k].reset(new Model(edge_list, p, lambda_s));
+      models[k]->has_cycles();
+      if (models[k]->cycle)
+        throw not_acyclic_exception();
+      models[k]->topological_sort();
+    }
+
+    /* Observation patterns are built once for all posets */
+    ObservationPatterns patterns(obs, times, weights, sampling_times_available);
+
+    ControlEM control_EM(max_iter, update_step_size, tol, max_lambda,
+                         neighborhood_dist, pool_memory, single_precision,
+                         recycle_ess);
+
+    /* Call the underlying C++ function */
+    Context ctx(seed, verbose);
+    VectorXd llhood, alpha;
+    std::vector<std::string> errors;
+    fit_posets(models, obs, patterns, ilambda, eps, fit, L, sampling,
+               control_EM, sampling_times_available, llhood, alpha, errors,
+               thrds, ctx);
+
+    /* Return the result as a SEXP. Parameters of failed posets are NA */
+    MatrixXd lambda(K, p);
+    VectorXd eps_fit(K);
+    CharacterVector error(K);
+    for (unsigned int k = 0; k < K; ++k) {
+      if (errors[k].empty()) {
+        lambda.row(k) = models[k]->get_lambda().transpose();
+        eps_fit[k] = models[k]->get_epsilon();
+        error[k] = NA_STRING;
+      } else {
+        lambda.row(k).setConstant(NA_REAL);
+        eps_fit[k] = NA_REAL;
+        error[k] = errors[k];
+      }
+    }
+    return List::create(_["lambda"]=lambda, _["eps"]=eps_fit,
+                        _["llhood"]=llhood, _["alpha"]=alpha,
+                        _["error"]=error);
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
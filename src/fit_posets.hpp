@@ -0,0 +1,50 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Batched parameter estimation and likelihood evaluation of candidate posets
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef FIT_POSETS_HPP
+#define FIT_POSETS_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mcem.hpp"
+#include "fixed_size_kernels.hpp"
+
+/* Observations shared by all candidate posets. Observations with the same
+ * genotype (and the same sampling time, if sampling times are available) are
+ * collapsed into one pattern, whose weight is the sum of their weights.
+ * Observations with weight 0 are dropped
+ */
+class ObservationPatterns {
+public:
+  MatrixXb obs;
+  VectorXd times;
+  RowVectorXd weights;
+  std::vector<uint64_t> masks;  // genotypes as bit masks, if p <= MAX_FIXED_SIZE
+
+  ObservationPatterns(const MatrixXb& obs_all, const VectorXd& times_all,
+                      const RowVectorXd& weights_all,
+                      const bool sampling_times_available);
+
+  inline unsigned int size() const {
+    return obs.rows();
+  }
+};
+
+double compatible_fraction(const ObservationPatterns& patterns,
+                           const Model& model);
+
+void fit_posets(
+    std::vector< std::unique_ptr<Model> >& models, const MatrixXb& obs,
+    const ObservationPatterns& patterns, const MatrixXd& ilambda,
+    const VectorXd& ieps, const bool fit, const unsigned int L,
+    const std::string& sampling, const ControlEM& control_EM,
+    const bool sampling_times_available, VectorXd& llhood, VectorXd& alpha,
+    std::vector<std::string>& errors, const unsigned int thrds, Context& ctx);
+
+#endif
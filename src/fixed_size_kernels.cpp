@@ -0,0 +1,182 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Sampling kernels specialized at compile time for small posets
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <algorithm>
+#include <array>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "fixed_size_kernels.hpp"
+#include "bit_utils.hpp"
+#include "genotype_pool.hpp"
+
+/* Poset of at most P events. The topological order is padded with events
+ * p, ..., P - 1 without parents, such that traversals have a fixed length,
+ * and the parents of each event are stored as a bit mask
+ */
+template <unsigned int P>
+class FixedPoset {
+public:
+  std::array<unsigned char, P> order;
+  std::array<uint64_t, P> parents;
+
+  explicit FixedPoset(const CompiledPoset& poset) {
+    const unsigned int p = poset.size();
+    parents.fill(0);
+    for (unsigned int c = 0; c < P; ++c)
+      order[c] = c < p ? poset.topo_order[c] : c;
+    for (unsigned int j = 0; j < p; ++j)
+      for (unsigned int i = poset.parents_offset[j];
+           i < poset.parents_offset[j + 1]; ++i)
+        parents[j] |= (uint64_t) 1 << poset.parents[i];
+  }
+};
+
+/* Number of samples processed at once, such that the times of a tile stay in
+ * the L1 cache
+ */
+static const unsigned int SAMPLE_TILE = 64;
+
+template <unsigned int P, typename Scalar>
+static void cumulative_times_kernel(const CompiledPoset& poset,
+                                    const MatrixT<Scalar>& T_events,
+                                    MatrixT<Scalar>& T_events_sum) {
+  typedef Eigen::Array<Scalar, SAMPLE_TILE, 1> Tile;
+  const FixedPoset<P> fixed_poset(poset);
+  const unsigned int N = T_events.rows();
+  const unsigned int p = T_events.cols();
+  T_events_sum.resize(N, p);
+
+  /* Tiles of samples, vectorized over the samples */
+  unsigned int k = 0;
+  for (; k + SAMPLE_TILE <= N; k += SAMPLE_TILE) {
+    for (unsigned int c = 0; c < p; ++c) {
+      const unsigned int j = fixed_poset.order[c];
+      Tile T_max = Tile::Zero();
+      for (uint64_t parents = fixed_poset.parents[j]; parents;
+           parents &= parents - 1)
+        T_max = T_max.max(T_events_sum.col(ctz64(parents)).template
+                            segment<SAMPLE_TILE>(k).array());
+      T_events_sum.col(j).template segment<SAMPLE_TILE>(k) =
+        T_events.col(j).template segment<SAMPLE_TILE>(k) + T_max.matrix();
+    }
+  }
+
+  /* Remaining samples, one at a time */
+  std::array<Scalar, P> T_sum;
+  T_sum.fill(0);
+  for (; k < N; ++k) {
+    for (unsigned int c = 0; c < P; ++c) {
+      const unsigned int j = fixed_poset.order[c];
+      Scalar T_max = 0;
+      for (uint64_t parents = fixed_poset.parents[j]; parents;
+           parents &= parents - 1)
+        T_max = std::max(T_max, T_sum[ctz64(parents)]);
+      T_sum[j] = (j < p ? T_events(k, j) : 0) + T_max;
+    }
+    for (unsigned int j = 0; j < p; ++j)
+      T_events_sum(k, j) = T_sum[j];
+  }
+}
+
+template <typename Scalar>
+bool cumulative_times_fixed(const CompiledPoset& poset,
+                            const MatrixT<Scalar>& T_events,
+                            MatrixT<Scalar>& T_events_sum) {
+  const unsigned int p = poset.size();
+  if (p <= 8)
+    cumulative_times_kernel<8>(poset, T_events, T_events_sum);
+  else if (p <= 16)
+    cumulative_times_kernel<16>(poset, T_events, T_events_sum);
+  else if (p <= 32)
+    cumulative_times_kernel<32>(poset, T_events, T_events_sum);
+  else if (p <= MAX_FIXED_SIZE)
+    cumulative_times_kernel<64>(poset, T_events, T_events_sum);
+  else
+    return false;
+  return true;
+}
+
+template bool cumulative_times_fixed<double>(
+    const CompiledPoset&, const MatrixXd&, MatrixXd&);
+template bool cumulative_times_fixed<float>(
+    const CompiledPoset&, const MatrixXf&, MatrixXf&);
+
+/* Bit mask of the events of a sample that occurred before the sampling time,
+ * i.e. the genotype of the sample
+ */
+static inline uint64_t occurred_mask(const double* T, const unsigned int p,
+                                     const double T_sampling) {
+  uint64_t mask = 0;
+  unsigned int j = 0;
+#ifdef __SSE2__
+  const __m128d T_sampling_vec = _mm_set1_pd(T_sampling);
+  for (; j + 2 <= p; j += 2)
+    mask |= (uint64_t) _mm_movemask_pd(
+      _mm_cmple_pd(_mm_loadu_pd(T + j), T_sampling_vec)) << j;
+#endif
+  for (; j < p; ++j)
+    mask |= (uint64_t) (T[j] <= T_sampling) << j;
+  return mask;
+}
+
+static inline uint64_t occurred_mask(const float* T, const unsigned int p,
+                                     const double T_sampling) {
+  uint64_t mask = 0;
+  unsigned int j = 0;
+#ifdef __SSE2__
+  const __m128d T_sampling_vec = _mm_set1_pd(T_sampling);
+  for (; j + 4 <= p; j += 4) {
+    const __m128 T_vec = _mm_loadu_ps(T + j);
+    const int low = _mm_movemask_pd(
+      _mm_cmple_pd(_mm_cvtps_pd(T_vec), T_sampling_vec));
+    const int high = _mm_movemask_pd(
+      _mm_cmple_pd(_mm_cvtps_pd(_mm_movehl_ps(T_vec, T_vec)), T_sampling_vec));
+    mask |= (uint64_t) (low | (high << 2)) << j;
+  }
+#endif
+  for (; j < p; ++j)
+    mask |= (uint64_t) (T[j] <= T_sampling) << j;
+  return mask;
+}
+
+template <unsigned int P, typename TimeMatrix>
+static void hamming_dist_kernel(
+    const TimeMatrix& times, const uint64_t genotype, const unsigned int first,
+    const VectorXd& T_sampling, int* dist) {
+  const unsigned int n = T_sampling.size();
+  const unsigned int p = std::min((unsigned int) times.cols(), P);
+  for (unsigned int k = 0; k < n; ++k)
+    dist[k] = popcount64(
+      occurred_mask(&times(first + k, 0), p, T_sampling[k]) ^ genotype);
+}
+
+template <typename TimeMatrix>
+bool hamming_dist_fixed(const TimeMatrix& times, const RowVectorXb& genotype,
+                        const unsigned int first, const VectorXd& T_sampling,
+                        int* dist) {
+  const unsigned int p = genotype.size();
+  const uint64_t mask = p <= MAX_FIXED_SIZE ? genotype_mask(genotype) : 0;
+  if (p <= 8)
+    hamming_dist_kernel<8>(times, mask, first, T_sampling, dist);
+  else if (p <= 16)
+    hamming_dist_kernel<16>(times, mask, first, T_sampling, dist);
+  else if (p <= 32)
+    hamming_dist_kernel<32>(times, mask, first, T_sampling, dist);
+  else if (p <= MAX_FIXED_SIZE)
+    hamming_dist_kernel<64>(times, mask, first, T_sampling, dist);
+  else
+    return false;
+  return true;
+}
+
+template bool hamming_dist_fixed<RowMatrixXd>(
+    const RowMatrixXd&, const RowVectorXb&, const unsigned int,
+    const VectorXd&, int*);
+template bool hamming_dist_fixed<RowMatrixXf>(
+    const RowMatrixXf&, const RowVectorXb&, const unsigned int,
+    const VectorXd&, int*);
@@ -0,0 +1,50 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Sampling kernels specialized at compile time for small posets
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef FIXED_SIZE_KERNELS_HPP
+#define FIXED_SIZE_KERNELS_HPP
+
+#include <cstdint>
+#include "mcem.hpp"
+#include "compiled_poset.hpp"
+
+/* Posets are assigned to the smallest bucket of 8, 16, 32 or 64 events that
+ * holds them. Within a bucket, parents and genotypes are kept as bit masks,
+ * and times are processed in fixed-size tiles of samples without temporary
+ * allocations. Larger posets fall back to the generic kernels
+ */
+static const unsigned int MAX_FIXED_SIZE = 64;
+
+/* Cumulative occurrence times from the time differences,
+ * T_events_sum[, j] = T_events[, j] + max over parents u of T_events_sum[, u].
+ * Returns false, without touching 'T_events_sum', if the poset has more than
+ * MAX_FIXED_SIZE events
+ */
+template <typename Scalar>
+bool cumulative_times_fixed(const CompiledPoset& poset,
+                            const MatrixT<Scalar>& T_events,
+                            MatrixT<Scalar>& T_events_sum);
+
+/* Hamming distance between a genotype and the genotypes given by the rows
+ * first, ..., first + n - 1 of a matrix of cumulative times, where n is the
+ * length of 'T_sampling'. Returns false if the genotype has more than
+ * MAX_FIXED_SIZE events
+ */
+template <typename TimeMatrix>
+bool hamming_dist_fixed(const TimeMatrix& times, const RowVectorXb& genotype,
+                        const unsigned int first, const VectorXd& T_sampling,
+                        int* dist);
+
+/* Genotype as a bit mask, where bit j is set if event j occurred */
+inline uint64_t genotype_mask(const RowVectorXb& genotype) {
+  uint64_t mask = 0;
+  for (unsigned int j = 0; j < genotype.size(); ++j)
+    mask |= (uint64_t) genotype[j] << j;
+  return mask;
+}
+
+#endif
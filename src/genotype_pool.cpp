@@ -0,0 +1,185 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Pool of genotypes used by the "pool" sampling scheme
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <algorithm>
+#include "genotype_pool.hpp"
+#include "fixed_size_kernels.hpp"
+
+/* Number of cumulative times generated per chunk (about 1 MB in double
+ * precision), such that the time differences are never held for the whole
+ * pool
+ */
+static const unsigned int POOL_CHUNK_ELEMENTS = 131072;
+
+template <typename TimeMatrix>
+static void hamming_dist_pool(
+    const TimeMatrix& times, const RowVectorXb& genotype,
+    const unsigned int first, const VectorXd& T_sampling, int* dist) {
+
+  const unsigned int n = T_sampling.size();
+  const unsigned int p = times.cols();
+  for (unsigned int k = 0; k < n; ++k) {
+    int d = 0;
+    for (unsigned int j = 0; j < p; ++j)
+      d += ((times(first + k, j) <= T_sampling[k]) != genotype[j]);
+    dist[k] = d;
+  }
+}
+
+/* Both cumulative times are converted to double before subtracting them, so
+ * the subtraction itself is exact up to double rounding. The difference
+ * still carries the rounding error of the stored cumulative times, which is
+ * relative to the cumulative times rather than to their difference
+ */
+template <typename TimeMatrix, typename TdiffMatrix>
+static void time_differences_pool(
+    const TimeMatrix& times, const CompiledPoset& poset, const unsigned int k,
+    TdiffMatrix& Tdiff, const unsigned int row) {
+
+  const unsigned int p = times.cols();
+  for (unsigned int j = 0; j < p; ++j) {
+    double T_max = 0.0;
+    for (unsigned int i = poset.parents_offset[j];
+         i < poset.parents_offset[j + 1]; ++i)
+      T_max = std::max(T_max, (double) times(k, poset.parents[i]));
+    Tdiff(row, j) = (double) times(k, j) - T_max;
+  }
+}
+
+GenotypePool::GenotypePool(const Model& model, const unsigned int K,
+                           const bool single_precision) :
+  _K(K), _p(model.size()), _single_precision(single_precision),
+  _poset(model) {
+  if (_single_precision)
+    _times_single.resize(_K, _p);
+  else
+    _times.resize(_K, _p);
+}
+
+//' Draw the cumulative occurrence times of the pool for the current rate
+//' parameters. Times are generated in chunks of fixed size
+//'
+//' @noRd
+void GenotypePool::sample(const Model& model, Context::rng_type& rng) {
+  const unsigned int chunk_size =
+    std::max(POOL_CHUNK_ELEMENTS / std::max(_p, 1u), 1u);
+  for (unsigned int k = 0; k < _K; k += chunk_size) {
+    const unsigned int n = std::min(chunk_size, _K - k);
+    if (_single_precision) {
+      MatrixXf Tdiff_chunk(n, _p);
+      _times_single.middleRows(k, n) = sample_times(n, model, Tdiff_chunk, rng);
+    } else {
+      MatrixXd Tdiff_chunk(n, _p);
+      _times.middleRows(k, n) = sample_times(n, model, Tdiff_chunk, rng);
+    }
+  }
+}
+
+//' Fill the pool from the time differences of K genotypes
+//'
+//' @noRd
+void GenotypePool::set_time_differences(const MatrixXd& Tdiff) {
+  if (Tdiff.rows() != _K || Tdiff.cols() != _p)
+    throw std::runtime_error(
+        "ERROR: time differences do not match the size of the pool");
+
+  RowVectorXd T_sum(_p);
+  for (unsigned int k = 0; k < _K; ++k) {
+    for (std::vector<unsigned int>::const_iterator j = _poset.topo_order.begin();
+         j != _poset.topo_order.end(); ++j) {
+      double T_max = 0.0;
+      for (unsigned int i = _poset.parents_offset[*j];
+           i < _poset.parents_offset[*j + 1]; ++i)
+        T_max = std::max(T_max, T_sum[_poset.parents[i]]);
+      T_sum[*j] = Tdiff(k, *j) + T_max;
+    }
+    if (_single_precision)
+      _times_single.row(k) = T_sum.cast<float>();
+    else
+      _times.row(k) = T_sum;
+  }
+}
+
+//' Compute the Hamming distance between an observed genotype and the
+//' genotypes of the pool. The latter are obtained by comparing the
+//' cumulative times with the sampling time, which is drawn from the
+//' sampling-time distribution if not available
+//'
+//' @noRd
+VectorXi GenotypePool::hamming_dist(
+    const RowVectorXb& genotype, const Model& model, const double time,
+    Context::rng_type& rng, const bool sampling_times_available) const {
+
+  VectorXd T_sampling(_K);
+  if (sampling_times_available)
+    T_sampling.setConstant(time);
+  else
+    T_sampling = rexp(_K, model.get_lambda_s(), rng);
+
+  VectorXi dist(_K);
+  hamming_dist(genotype, 0, T_sampling, dist.data());
+  return dist;
+}
+
+//' Compute the Hamming distance between an observed genotype and the
+//' genotypes of the pool from row 'first' onwards, given one sampling time
+//' per row
+//'
+//' @noRd
+void GenotypePool::hamming_dist(
+    const RowVectorXb& genotype, const unsigned int first,
+    const VectorXd& T_sampling, int* dist) const {
+  if (_single_precision) {
+    if (!hamming_dist_fixed(_times_single, genotype, first, T_sampling, dist))
+      hamming_dist_pool(_times_single, genotype, first, T_sampling, dist);
+  } else {
+    if (!hamming_dist_fixed(_times, genotype, first, T_sampling, dist))
+      hamming_dist_pool(_times, genotype, first, T_sampling, dist);
+  }
+}
+
+//' Derive the time differences of the k-th genotype of the pool from the
+//' cumulative times of the event and of its parents
+//'
+//' @noRd
+void GenotypePool::time_differences(const unsigned int k, MatrixXd& Tdiff,
+                                    const unsigned int row) const {
+  if (_single_precision)
+    time_differences_pool(_times_single, _poset, k, Tdiff, row);
+  else
+    time_differences_pool(_times, _poset, k, Tdiff, row);
+}
+
+void GenotypePool::time_differences(const unsigned int k, MatrixXf& Tdiff,
+                                    const unsigned int row) const {
+  if (_single_precision)
+    time_differences_pool(_times_single, _poset, k, Tdiff, row);
+  else
+    time_differences_pool(_times, _poset, k, Tdiff, row);
+}
+
+std::size_t GenotypePool::memory() const {
+  return (std::size_t) _K * _p * (_single_precision ? sizeof(float) : sizeof(double));
+}
+
+//' Cap the size of the pool, such that the cumulative times fit into a memory
+//' budget (in MB). A budget of 0 means no cap
+//'
+//' @noRd
+unsigned int GenotypePool::capped_size(
+    const unsigned int K, const unsigned int p, const double memory_budget,
+    const bool single_precision) {
+  if (memory_budget <= 0 || p == 0)
+    return K;
+  const double row_bytes =
+    (double) p * (single_precision ? sizeof(float) : sizeof(double));
+  const double K_max = std::floor(memory_budget * 1024 * 1024 / row_bytes);
+  if (K_max < 1)
+    throw std::runtime_error(
+        "ERROR: memory budget is too small for the genotype pool");
+  return (unsigned int) std::min((double) K, K_max);
+}
@@ -0,0 +1,76 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Pool of genotypes used by the "pool" sampling scheme
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef GENOTYPE_POOL_HPP
+#define GENOTYPE_POOL_HPP
+
+#include <cstddef>
+#include <RcppEigen.h>
+#include "mcem.hpp"
+#include "compiled_poset.hpp"
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+  RowMatrixXd;
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+  RowMatrixXf;
+
+/* Pool of K genotypes. Only the cumulative occurrence times are stored,
+ * optionally in single precision. Time differences are derived on demand
+ * from the parents of each event, and genotypes are only compared to the
+ * observations through their Hamming distance, such that neither the time
+ * differences nor the genotypes are ever stored for the whole pool.
+ *
+ * Derived time differences inherit the rounding error of the cumulative
+ * times. In single precision, the absolute error is about 6e-8 times the
+ * cumulative time of the event, so time differences that are short compared
+ * to the cumulative times lose relative precision, unlike those of the
+ * sampling kernels, which are drawn without subtracting cumulative times
+ */
+class GenotypePool {
+public:
+  GenotypePool() : _K(0), _p(0), _single_precision(false) {}
+
+  GenotypePool(const Model& model, const unsigned int K,
+               const bool single_precision=false);
+
+  void sample(const Model& model, Context::rng_type& rng);
+
+  void set_time_differences(const MatrixXd& Tdiff);
+
+  VectorXi hamming_dist(const RowVectorXb& genotype, const Model& model,
+                        const double time, Context::rng_type& rng,
+                        const bool sampling_times_available=false) const;
+
+  void hamming_dist(const RowVectorXb& genotype, const unsigned int first,
+                    const VectorXd& T_sampling, int* dist) const;
+
+  void time_differences(const unsigned int k, MatrixXd& Tdiff,
+                        const unsigned int row) const;
+
+  void time_differences(const unsigned int k, MatrixXf& Tdiff,
+                        const unsigned int row) const;
+
+  inline unsigned int size() const {
+    return _K;
+  }
+
+  std::size_t memory() const;
+
+  static unsigned int capped_size(const unsigned int K, const unsigned int p,
+                                  const double memory_budget,
+                                  const bool single_precision=false);
+
+protected:
+  unsigned int _K;
+  unsigned int _p;
+  bool _single_precision;
+  CompiledPoset _poset;
+  RowMatrixXd _times;         // cumulative times (double precision)
+  RowMatrixXf _times_single;  // cumulative times (single precision)
+};
+
+#endif
@@ -0,0 +1,388 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Cached queries of genotype probabilities under a fitted model
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include "genotype_query.hpp"
+#include "add_remove.hpp"
+#include "bit_utils.hpp"
+#include "compiled_poset.hpp"
+#include "fixed_size_kernels.hpp"
+#include "genotype_pool.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+#include "not_acyclic_exception.hpp"
+
+/* Number of standard deviations of the Poisson number of jumps covered by
+ * the uniformization
+ */
+static const double POISSON_TAIL_SD = 10.0;
+
+GenotypeQueryEngine::GenotypeQueryEngine(
+  const Model& model, const bool sampling_times_available, const unsigned int L,
+  const std::string& sampling, const unsigned int max_lattice_size,
+  const double time_resolution, const unsigned int cache_size, const int seed) :
+  _model(model), _sampling_times_available(sampling_times_available), _L(L),
+  _sampling(sampling), _time_resolution(time_resolution),
+  _cache_size(cache_size), _seed(seed), _cache_hits(0), _cache_misses(0) {
+
+  const unsigned int p = _model.size();
+  _log_bernoulli.resize(p + 1);
+  for (unsigned int d = 0; d <= p; ++d)
+    _log_bernoulli[d] = log_bernoulli_process(d, _model.get_epsilon(), p);
+
+  if (build_lattice(max_lattice_size)) {
+    if (!_sampling_times_available) {
+      /* The chain is observed when sampling, at rate lambda_s, happens
+       * before the next mutation. Probabilities of reaching each state are
+       * pushed forward level by level
+       */
+      const double lambda_s = _model.get_lambda_s();
+      const unsigned int n = _states.size();
+      VectorXd reach = VectorXd::Zero(n);
+      _prob.resize(n);
+      reach[0] = 1.0;
+      for (unsigned int x = 0; x < n; ++x) {
+        const double total_rate = lambda_s + _exit_rate[x];
+        _prob[x] = reach[x] * lambda_s / total_rate;
+        for (unsigned int k = _trans_offset[x]; k < _trans_offset[x + 1]; ++k)
+          reach[_trans_target[k]] += reach[x] * _trans_rate[k] / total_rate;
+      }
+    }
+  } else {
+    if (_sampling == "pool")
+      throw std::runtime_error(
+          "ERROR: the \"pool\" proposal is not supported for queries");
+    if (_sampling == "add-remove") {
+      _scale_cumulative = scale_path_to_mutation(_model);
+      if (_model.get_update_node_idx())
+        _model.update_node_idx();
+    }
+  }
+}
+
+//' Enumerate the genotypes compatible with the poset, by breadth-first
+//' search from the wild type, together with the transitions between them
+//'
+//' @noRd
+//' @return returns false if the lattice has more than 'max_lattice_size'
+//' elements or the poset more than MAX_FIXED_SIZE events
+bool GenotypeQueryEngine::build_lattice(const unsigned int max_lattice_size) {
+  const unsigned int p = _model.size();
+  if (p > MAX_FIXED_SIZE || max_lattice_size == 0)
+    return false;
+
+  const CompiledPoset poset(_model);
+  std::vector<uint64_t> parents(p, 0);
+  for (unsigned int j = 0; j < p; ++j)
+    for (unsigned int i = poset.parents_offset[j];
+         i < poset.parents_offset[j + 1]; ++i)
+      parents[j] |= (uint64_t) 1 << poset.parents[i];
+  const VectorXd lambda = _model.get_lambda();
+
+  /* Transitions add one mutation, so the search visits the genotypes in
+   * order of increasing number of mutations
+   */
+  std::unordered_map<uint64_t, unsigned int> index;
+  std::vector<double> exit_rate;
+  _states.assign(1, 0);
+  index[0] = 0;
+  _trans_offset.assign(1, 0);
+  for (unsigned int x = 0; x < _states.size(); ++x) {
+    const uint64_t state = _states[x];
+    double rate = 0.0;
+    for (unsigned int j = 0; j < p; ++j) {
+      if ((state >> j & 1) || (parents[j] & ~state))
+        continue;
+      const uint64_t next = state | (uint64_t) 1 << j;
+      auto it = index.insert(std::make_pair(next, _states.size()));
+      if (it.second) {
+        if (_states.size() == max_lattice_size) {
+          _states.clear();
+          _trans_offset.clear();
+          _trans_target.clear();
+          _trans_rate.clear();
+          return false;
+        }
+        _states.push_back(next);
+      }
+      _trans_target.push_back(it.first->second);
+      _trans_rate.push_back(lambda[j]);
+      rate += lambda[j];
+    }
+    _trans_offset.push_back(_trans_target.size());
+    exit_rate.push_back(rate);
+  }
+  _exit_rate = Map<VectorXd>(exit_rate.data(), exit_rate.size());
+  return true;
+}
+
+//' Distribution of the hidden genotype at a given sampling time, computed by
+//' uniformization: the chain jumps at the times of a Poisson process with
+//' rate Lambda, the largest exit rate, and P(t) = sum_n Poisson(n; Lambda t)
+//' v_n, where v_n is the distribution after n jumps of the embedded chain
+//'
+//' @noRd
+VectorXd GenotypeQueryEngine::lattice_prob(const double time) const {
+  const unsigned int n = _states.size();
+  const double Lambda = _exit_rate.maxCoeff();
+  VectorXd v = VectorXd::Zero(n);
+  v[0] = 1.0;
+  if (Lambda <= 0 || time <= 0)
+    return v;
+
+  const double mean = Lambda * time;
+  const unsigned int num_jumps =
+    std::ceil(mean + POISSON_TAIL_SD * std::sqrt(mean) + 20);
+  const double log_mean = std::log(mean);
+  VectorXd prob = VectorXd::Zero(n);
+  VectorXd v_next(n);
+  double log_poisson = -mean;
+  for (unsigned int k = 0; k <= num_jumps; ++k) {
+    prob += std::exp(log_poisson) * v;
+    v_next = v.array() * (1.0 - _exit_rate.array() / Lambda);
+    for (unsigned int x = 0; x < n; ++x)
+      if (v[x] > 0)
+        for (unsigned int l = _trans_offset[x]; l < _trans_offset[x + 1]; ++l)
+          v_next[_trans_target[l]] += v[x] * _trans_rate[l] / Lambda;
+    v.swap(v_next);
+    log_poisson += log_mean - std::log(k + 1.0);
+  }
+  return prob;
+}
+
+//' Log-probability of an observed genotype, given the distribution of the
+//' hidden genotype over the lattice. Terms are scaled by the noise
+//' probability of the closest hidden genotype
+//'
+//' @noRd
+double GenotypeQueryEngine::exact_log_prob(const uint64_t genotype,
+                                           const VectorXd& prob) const {
+  const unsigned int n = _states.size();
+  std::vector<unsigned char> dist(n);
+  unsigned int dist_min = _model.size();
+  for (unsigned int x = 0; x < n; ++x) {
+    dist[x] = popcount64(_states[x] ^ genotype);
+    if (prob[x] > 0 && dist[x] < dist_min)
+      dist_min = dist[x];
+  }
+  double sum = 0.0;
+  for (unsigned int x = 0; x < n; ++x)
+    sum += prob[x] * std::exp(_log_bernoulli[dist[x]] -
+                              _log_bernoulli[dist_min]);
+  return _log_bernoulli[dist_min] + std::log(sum);
+}
+
+//' Log-probability of an observed genotype estimated by importance sampling.
+//' Samples are drawn from a random number stream derived from the key of the
+//' query
+//'
+//' @noRd
+double GenotypeQueryEngine::sampled_log_prob(
+    const RowVectorXb& genotype, const double time,
+    const std::string& key) const {
+  Context ctx(chunk_seed(_seed, fnv1a(key)));
+  GenotypePool pool;
+  std::vector<ImportanceSums> sums = importance_sums(
+    genotype, _L, _model, VectorXd::Constant(1, time), _sampling,
+    _scale_cumulative, pool, 1, _sampling_times_available, 1, ctx);
+  const unsigned int L_eff =
+    _sampling == "backward" ? sums[0].L_positive : sums[0].L;
+  if (sums[0].w <= 0)
+    return -std::numeric_limits<double>::infinity();
+  return sums[0].log_w() - std::log(L_eff);
+}
+
+//' Sampling-time bucket of a query, and the time at which it is evaluated
+//'
+//' @noRd
+double GenotypeQueryEngine::bucket_time(const double time,
+                                        int64_t& bucket) const {
+  if (!_sampling_times_available) {
+    bucket = 0;
+    return 0.0;
+  }
+  if (_time_resolution > 0) {
+    bucket = std::floor(time / _time_resolution);
+    return (bucket + 0.5) * _time_resolution;
+  }
+  std::memcpy(&bucket, &time, sizeof(double));
+  return time;
+}
+
+void GenotypeQueryEngine::cache_insert(const std::string& key,
+                                       const double value) {
+  if (_cache_size == 0)
+    return;
+  _cache.push_front(std::make_pair(key, value));
+  _cache_index[key] = _cache.begin();
+  if (_cache.size() > _cache_size) {
+    _cache_index.erase(_cache.back().first);
+    _cache.pop_back();
+  }
+}
+
+//' Log-probabilities of the observed genotypes. Cached scores are looked up
+//' first; the remaining distinct queries are evaluated in parallel and
+//' added to the cache. Exact queries with the same sampling time share the
+//' distribution of the hidden genotype
+//'
+//' @noRd
+VectorXd GenotypeQueryEngine::log_prob(const MatrixXb& obs,
+                                       const VectorXd& times,
+                                       const unsigned int thrds) {
+  const unsigned int N = obs.rows();
+  const unsigned int p = _model.size();
+  if (obs.cols() != p)
+    throw std::runtime_error(
+        "ERROR: genotypes do not match the number of events");
+  if (_sampling_times_available && times.size() != N)
+    throw std::runtime_error("ERROR: a sampling time per genotype is expected");
+
+  /* Keys: packed genotype followed by the sampling-time bucket */
+  const unsigned int num_bytes = (p + 7) / 8;
+  VectorXd result(N);
+  std::vector<std::string> keys;
+  std::vector<double> query_times;
+  std::vector<unsigned int> query_rows;
+  std::vector<int> query_of(N, -1);
+  std::unordered_map<std::string, unsigned int> pending;
+  std::string key(num_bytes + sizeof(int64_t), 0);
+  for (unsigned int i = 0; i < N; ++i) {
+    std::fill(key.begin(), key.end(), 0);
+    for (unsigned int j = 0; j < p; ++j)
+      if (obs(i, j))
+        key[j / 8] |= 1 << (j % 8);
+    int64_t bucket;
+    const double time = bucket_time(_sampling_times_available ? times[i] : 0.0,
+                                    bucket);
+    std::memcpy(&key[num_bytes], &bucket, sizeof(int64_t));
+
+    auto cached = _cache_index.find(key);
+    if (cached != _cache_index.end()) {
+      ++_cache_hits;
+      _cache.splice(_cache.begin(), _cache, cached->second);
+      result[i] = cached->second->second;
+      continue;
+    }
+    ++_cache_misses;
+    auto it = pending.insert(std::make_pair(key, keys.size()));
+    if (it.second) {
+      keys.push_back(key);
+      query_times.push_back(time);
+      query_rows.push_back(i);
+    }
+    query_of[i] = it.first->second;
+  }
+
+  const unsigned int num_queries = keys.size();
+  std::vector<double> values(num_queries);
+  if (exact()) {
+    /* Group the queries by sampling time */
+    std::map<double, std::vector<unsigned int> > groups;
+    for (unsigned int q = 0; q < num_queries; ++q)
+      groups[query_times[q]].push_back(q);
+    std::vector<const std::vector<unsigned int>*> group_queries;
+    std::vector<double> group_times;
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+      group_times.push_back(it->first);
+      group_queries.push_back(&it->second);
+    }
+    parallel_for(group_times.size(), thrds, [&](const unsigned int g) {
+      const VectorXd prob = _sampling_times_available ?
+        lattice_prob(group_times[g]) : _prob;
+      const std::vector<unsigned int>& queries = *group_queries[g];
+      parallel_for(queries.size(), thrds, [&](const unsigned int k) {
+        const unsigned int q = queries[k];
+        values[q] = exact_log_prob(genotype_mask(obs.row(query_rows[q])), prob);
+      });
+    });
+  } else {
+    parallel_for(num_queries, thrds, [&](const unsigned int q) {
+      values[q] = sampled_log_prob(obs.row(query_rows[q]), query_times[q],
+                                   keys[q]);
+    });
+  }
+
+  for (unsigned int q = 0; q < num_queries; ++q)
+    cache_insert(keys[q], values[q]);
+  for (unsigned int i = 0; i < N; ++i)
+    if (query_of[i] >= 0)
+      result[i] = values[query_of[i]];
+  return result;
+}
+
+RcppExport SEXP _genotype_query_engine(
+    SEXP posetSEXP, SEXP lambdaSEXP, SEXP epsSEXP, SEXP lambda_sSEXP,
+    SEXP sampling_times_availableSEXP, SEXP LSEXP, SEXP samplingSEXP,
+    SEXP max_lattice_sizeSEXP, SEXP time_resolutionSEXP, SEXP cache_sizeSEXP,
+    SEXP seedSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    const MapMati poset(as<MapMati>(posetSEXP));
+    const MapVecd lambda(as<MapVecd>(lambdaSEXP));
+    const double eps = as<double>(epsSEXP);
+    const float lambda_s = as<float>(lambda_sSEXP);
+    const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const unsigned int L = as<unsigned int>(LSEXP);
+    const std::string& sampling = as<std::string>(samplingSEXP);
+    const unsigned int max_lattice_size = as<unsigned int>(max_lattice_sizeSEXP);
+    const double time_resolution = as<double>(time_resolutionSEXP);
+    const unsigned int cache_size = as<unsigned int>(cache_sizeSEXP);
+    const int seed = as<int>(seedSEXP);
+
+    const auto p = poset.rows(); // Number of mutations / events
+    edge_container edge_list = adjacency_mat2list(poset);
+    Model M(edge_list, p, lambda_s);
+    M.set_lambda(lambda);
+    M.set_epsilon(eps);
+    M.has_cycles();
+    if (M.cycle)
+      throw not_acyclic_exception();
+    M.topological_sort();
+
+    /* Call the underlying C++ function */
+    XPtr<GenotypeQueryEngine> engine(new GenotypeQueryEngine(
+      M, sampling_times_available, L, sampling, max_lattice_size,
+      time_resolution, cache_size, seed), true);
+
+    /* Return the result as a SEXP */
+    return List::create(_["engine"]=engine, _["exact"]=engine->exact(),
+                        _["lattice_size"]=engine->lattice_size());
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
+
+RcppExport SEXP _query_genotypes(SEXP engineSEXP, SEXP obsSEXP,
+                                 SEXP timesSEXP, SEXP thrdsSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    XPtr<GenotypeQueryEngine> engine(engineSEXP);
+    const MatrixXb& obs = as<MatrixXb>(obsSEXP);
+    const MapVecd times(as<MapVecd>(timesSEXP));
+    const int thrds = as<int>(thrdsSEXP);
+
+    /* Call the underlying C++ function */
+    VectorXd log_prob = engine->log_prob(obs, times, thrds);
+
+    /* Return the result as a SEXP */
+    return List::create(_["log_prob"]=log_prob,
+                        _["cache_hits"]=(double) engine->cache_hits(),
+                        _["cache_misses"]=(double) engine->cache_misses());
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
@@ -0,0 +1,102 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Cached queries of genotype probabilities under a fitted model
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef GENOTYPE_QUERY_HPP
+#define GENOTYPE_QUERY_HPP
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mcem.hpp"
+
+/* Query engine for the log-probabilities of observed genotypes under a
+ * fitted model (poset, lambda, epsilon). If the lattice of genotypes
+ * compatible with the poset has at most 'max_lattice_size' elements (and
+ * the poset at most MAX_FIXED_SIZE events), probabilities are exact: the
+ * hidden genotype is the state of a continuous-time Markov chain on the
+ * lattice, observed at the sampling time. Otherwise, probabilities are
+ * estimated by importance sampling with L samples, where each query draws
+ * from a random number stream derived from its key, such that repeated
+ * queries give the same score.
+ *
+ * Scores are kept in an LRU cache of 'cache_size' entries, keyed by the
+ * packed genotype and the sampling-time bucket. If 'time_resolution' is
+ * positive, sampling times are rounded to the centre of buckets of that
+ * width; otherwise each sampling time is its own bucket
+ */
+class GenotypeQueryEngine {
+public:
+  GenotypeQueryEngine(const Model& model, const bool sampling_times_available,
+                      const unsigned int L, const std::string& sampling,
+                      const unsigned int max_lattice_size,
+                      const double time_resolution,
+                      const unsigned int cache_size, const int seed);
+
+  VectorXd log_prob(const MatrixXb& obs, const VectorXd& times,
+                    const unsigned int thrds);
+
+  inline bool exact() const {
+    return !_states.empty();
+  }
+
+  inline unsigned int lattice_size() const {
+    return _states.size();
+  }
+
+  inline unsigned long long cache_hits() const {
+    return _cache_hits;
+  }
+
+  inline unsigned long long cache_misses() const {
+    return _cache_misses;
+  }
+
+protected:
+  Model _model;
+  bool _sampling_times_available;
+  unsigned int _L;
+  std::string _sampling;
+  double _time_resolution;
+  unsigned int _cache_size;
+  int _seed;
+  VectorXd _log_bernoulli;      // log-probability of the noise per distance
+  VectorXd _scale_cumulative;   // used by the "add-remove" proposal
+
+  /* Lattice of compatible genotypes, in order of increasing number of
+   * mutations, with the transitions of the Markov chain in compressed rows
+   */
+  std::vector<uint64_t> _states;
+  std::vector<unsigned int> _trans_offset;
+  std::vector<unsigned int> _trans_target;
+  std::vector<double> _trans_rate;
+  VectorXd _exit_rate;
+  VectorXd _prob;               // P(X = x) if sampling times are unknown
+
+  /* LRU cache, most recently used entries first */
+  typedef std::list< std::pair<std::string, double> > cache_list;
+  cache_list _cache;
+  std::unordered_map<std::string, cache_list::iterator> _cache_index;
+  unsigned long long _cache_hits;
+  unsigned long long _cache_misses;
+
+  bool build_lattice(const unsigned int max_lattice_size);
+
+  VectorXd lattice_prob(const double time) const;
+
+  double exact_log_prob(const uint64_t genotype, const VectorXd& prob) const;
+
+  double sampled_log_prob(const RowVectorXb& genotype, const double time,
+                          const std::string& key) const;
+
+  double bucket_time(const double time, int64_t& bucket) const;
+
+  void cache_insert(const std::string& key, const double value);
+};
+
+#endif
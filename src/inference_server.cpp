@@ -0,0 +1,785 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Local inference server listening on a Unix domain socket
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <Rcpp.h>
+#include <RcppEigen.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "inference_server.hpp"
+#include "fit_posets.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+#include "not_acyclic_exception.hpp"
+
+#ifndef _WIN32
+
+static const std::uint32_t REQUEST_MAGIC = 0x5349434D;   // "MCIS"
+static const std::uint32_t RESPONSE_MAGIC = 0x5249434D;  // "MCIR"
+static const unsigned int HEADER_SIZE = 16;
+/* Requests with larger payloads are rejected and the connection is closed */
+static const std::uint32_t MAX_PAYLOAD = 1u << 30;
+/* Interval (in ms) at which user interrupts are checked while idle */
+static const int POLL_TIMEOUT = 100;
+/* Number of poll intervals granted to clients to read the last responses,
+ * e.g., the response to SHUTDOWN
+ */
+static const unsigned int SHUTDOWN_FLUSH_POLLS = 10;
+static const unsigned int RECV_BUFFER_SIZE = 65536;
+static const unsigned int SAMPLE_CHUNK_SIZE = 10000;
+/* Largest number of events of a poset or a dataset */
+static const std::uint32_t MAX_EVENTS = 16384;
+/* Largest number of observations of a dataset */
+static const std::uint32_t MAX_DATASET_SIZE = 10000000;
+/* Largest number of genotypes drawn by a SAMPLE request, and largest number
+ * of samples L per observation of a FIT or LOGLIK request
+ */
+static const std::uint32_t MAX_SAMPLE_SIZE = 1000000;
+/* Largest number of EM iterations of a FIT request */
+static const std::uint32_t MAX_EM_ITERATIONS = 100000;
+
+static const char* SAMPLING_SCHEMES[] = {
+  "forward", "add-remove", "backward", "bernoulli", "pool"
+};
+
+static inline std::uint32_t get_uint32(const unsigned char* data) {
+  std::uint32_t value = 0;
+  for (unsigned int b = 0; b < 4; ++b)
+    value |= (std::uint32_t) data[b] << (8 * b);
+  return value;
+}
+
+/* Reader of the values of a request payload */
+class PayloadReader {
+public:
+  PayloadReader(const std::vector<unsigned char>& payload) :
+    _payload(payload), _pos(0) {}
+
+  std::uint32_t read_uint32() {
+    require(4);
+    const std::uint32_t value = get_uint32(&_payload[_pos]);
+    _pos += 4;
+    return value;
+  }
+
+  double read_double() {
+    require(8);
+    std::uint64_t bits = 0;
+    for (unsigned int b = 0; b < 8; ++b)
+      bits |= (std::uint64_t) _payload[_pos + b] << (8 * b);
+    _pos += 8;
+    double value;
+    std::memcpy(&value, &bits, sizeof(double));
+    return value;
+  }
+
+  VectorXd read_doubles(const unsigned int n) {
+    require((std::size_t) n * sizeof(double));
+    VectorXd values(n);
+    for (unsigned int i = 0; i < n; ++i)
+      values[i] = read_double();
+    return values;
+  }
+
+  /* Rates must be finite and positive */
+  VectorXd read_rates(const unsigned int n) {
+    VectorXd lambda = read_doubles(n);
+    for (unsigned int j = 0; j < n; ++j)
+      if (!std::isfinite(lambda[j]) || !(lambda[j] > 0))
+        throw std::runtime_error("ERROR: rates must be finite and positive");
+    return lambda;
+  }
+
+  /* Error rates must be in [0, 1) */
+  double read_error_rate() {
+    const double eps = read_double();
+    if (!(eps >= 0 && eps < 1))
+      throw std::runtime_error("ERROR: error rate must be in [0, 1)");
+    return eps;
+  }
+
+  MatrixXb read_genotypes(const unsigned int N, const unsigned int p) {
+    const unsigned int num_bytes = (p + 7) / 8;
+    require((std::size_t) N * num_bytes);
+    MatrixXb obs(N, p);
+    for (unsigned int i = 0; i < N; ++i)
+      for (unsigned int j = 0; j < p; ++j)
+        obs(i, j) = _payload[_pos + i * num_bytes + j / 8] >> (j % 8) & 1;
+    _pos += (std::size_t) N * num_bytes;
+    return obs;
+  }
+
+  const std::string& read_sampling() {
+    const std::uint32_t scheme = read_uint32();
+    if (scheme >= sizeof(SAMPLING_SCHEMES) / sizeof(SAMPLING_SCHEMES[0]))
+      throw std::runtime_error("ERROR: unknown sampling scheme");
+    _sampling = SAMPLING_SCHEMES[scheme];
+    return _sampling;
+  }
+
+private:
+  void require(const std::size_t n) const {
+    if (_pos + n > _payload.size())
+      throw std::runtime_error("ERROR: request payload is too short");
+  }
+
+  const std::vector<unsigned char>& _payload;
+  std::size_t _pos;
+  std::string _sampling;
+};
+
+static void append_genotypes(std::vector<unsigned char>& buffer,
+                             const MatrixXb& obs) {
+  const unsigned int N = obs.rows();
+  const unsigned int p = obs.cols();
+  const unsigned int num_bytes = (p + 7) / 8;
+  const std::size_t offset = buffer.size();
+  buffer.resize(offset + (std::size_t) N * num_bytes, 0);
+  for (unsigned int j = 0; j < p; ++j)
+    for (unsigned int i = 0; i < N; ++i)
+      if (obs(i, j))
+        buffer[offset + i * num_bytes + j / 8] |= 1 << (j % 8);
+}
+
+struct Request {
+  unsigned int connection;
+  std::uint32_t opcode;
+  std::uint32_t id;
+  std::vector<unsigned char> payload;
+};
+
+struct Response {
+  std::uint32_t status;
+  std::vector<unsigned char> payload;
+
+  Response() : status(0) {}
+};
+
+/* Observations kept resident by the server */
+class Dataset {
+public:
+  MatrixXb obs;
+  ObservationPatterns patterns;
+  bool sampling_times_available;
+
+  Dataset(const MatrixXb& obs, const VectorXd& times,
+          const RowVectorXd& weights, const bool sampling_times_available) :
+    obs(obs), patterns(obs, times, weights, sampling_times_available),
+    sampling_times_available(sampling_times_available) {}
+};
+
+/* Datasets and posets kept resident by the server. They are only modified
+ * between the compute requests of a batch, which read them concurrently
+ */
+class ServerState {
+public:
+  std::map<std::uint32_t, std::unique_ptr<Dataset> > datasets;
+  std::map<std::uint32_t, std::unique_ptr<Model> > posets;
+  bool shutdown;
+
+  ServerState() : shutdown(false) {}
+
+  const Dataset& get_dataset(const std::uint32_t id) const {
+    auto it = datasets.find(id);
+    if (it == datasets.end())
+      throw std::runtime_error("ERROR: unknown dataset");
+    return *it->second;
+  }
+
+  const Model& get_poset(const std::uint32_t id, const unsigned int p) const {
+    auto it = posets.find(id);
+    if (it == posets.end())
+      throw std::runtime_error("ERROR: unknown poset");
+    if (it->second->size() != p)
+      throw std::runtime_error(
+          "ERROR: poset does not match the number of events");
+    return *it->second;
+  }
+};
+
+static void load_data(PayloadReader& reader, ServerState& state,
+                      Response& response) {
+  const std::uint32_t id = reader.read_uint32();
+  const unsigned int N = reader.read_uint32();
+  const unsigned int p = reader.read_uint32();
+  const bool sampling_times_available = reader.read_uint32() & 1;
+  if (N > MAX_DATASET_SIZE)
+    throw std::runtime_error("ERROR: datasets of at most " +
+                             std::to_string(MAX_DATASET_SIZE) +
+                             " observations are served");
+  if (p < 1 || p > MAX_EVENTS)
+    throw std::runtime_error("ERROR: number of events must be between 1 and " +
+                             std::to_string(MAX_EVENTS));
+  const MatrixXb obs = reader.read_genotypes(N, p);
+  const RowVectorXd weights = reader.read_doubles(N).transpose();
+  VectorXd times = VectorXd::Zero(N);
+  if (sampling_times_available)
+    times = reader.read_doubles(N);
+
+  std::unique_ptr<Dataset> dataset(
+    new Dataset(obs, times, weights, sampling_times_available));
+  append_uint32(response.payload, dataset->patterns.size());
+  state.datasets[id] = std::move(dataset);
+}
+
+static void load_poset(PayloadReader& reader, ServerState& state) {
+  const std::uint32_t id = reader.read_uint32();
+  const unsigned int p = reader.read_uint32();
+  const unsigned int num_relations = reader.read_uint32();
+  const double lambda_s = reader.read_double();
+  if (p < 1 || p > MAX_EVENTS)
+    throw std::runtime_error("ERROR: number of events must be between 1 and " +
+                             std::to_string(MAX_EVENTS));
+  /* The model stores the rate in single precision */
+  if (!std::isfinite((float) lambda_s) || !((float) lambda_s > 0))
+    throw std::runtime_error(
+        "ERROR: sampling rate must be finite and positive");
+  edge_container edge_list;
+  for (unsigned int r = 0; r < num_relations; ++r) {
+    const unsigned int u = reader.read_uint32();
+    const unsigned int v = reader.read_uint32();
+    if (u >= p || v >= p)
+      throw std::runtime_error("ERROR: cover relation out of range");
+    edge_list.push_back(Edge(u, v));
+  }
+
+  std::unique_ptr<Model> model(new Model(edge_list, p, lambda_s));
+  model->has_cycles();
+  if (model->cycle)
+    throw not_acyclic_exception();
+  model->topological_sort();
+  state.posets[id] = std::move(model);
+}
+
+static void unload(PayloadReader& reader, ServerState& state) {
+  const std::uint32_t kind = reader.read_uint32();
+  const std::uint32_t id = reader.read_uint32();
+  if (kind == 0)
+    state.datasets.erase(id);
+  else
+    state.posets.erase(id);
+}
+
+static void check_sample_size(const unsigned int L) {
+  if (L < 1 || L > MAX_SAMPLE_SIZE)
+    throw std::runtime_error("ERROR: number of samples must be between 1 and " +
+                             std::to_string(MAX_SAMPLE_SIZE));
+}
+
+static void fit(PayloadReader& reader, const ServerState& state,
+                const unsigned int thrds, const double pool_memory,
+                Response& response) {
+  const Dataset& dataset = state.get_dataset(reader.read_uint32());
+  const unsigned int p = dataset.obs.cols();
+  Model model(state.get_poset(reader.read_uint32(), p));
+  const unsigned int L = reader.read_uint32();
+  const std::string sampling = reader.read_sampling();
+  const unsigned int max_iter = reader.read_uint32();
+  unsigned int update_step_size = reader.read_uint32();
+  const unsigned int neighborhood_dist = reader.read_uint32();
+  const int seed = reader.read_uint32();
+  const bool initial_rates = reader.read_uint32() & 1;
+  const double tol = reader.read_double();
+  const float max_lambda = reader.read_double();
+  const double eps = reader.read_double();
+
+  check_sample_size(L);
+  if (max_iter < 1 || max_iter > MAX_EM_ITERATIONS)
+    throw std::runtime_error(
+        "ERROR: number of EM iterations must be between 1 and " +
+        std::to_string(MAX_EM_ITERATIONS));
+  if (!std::isfinite(tol) || !(tol > 0))
+    throw std::runtime_error("ERROR: tolerance must be finite and positive");
+  if (!std::isfinite(max_lambda) || !(max_lambda > 0))
+    throw std::runtime_error(
+        "ERROR: maximum rate must be finite and positive");
+  if (eps >= 1 || std::isnan(eps))
+    throw std::runtime_error("ERROR: error rate must be in [0, 1)");
+
+  if (initial_rates)
+    model.update_lambda(reader.read_rates(p), max_lambda);
+  else
+    initialize_lambda(model, dataset.obs, max_lambda);
+  if (eps >= 0)
+    model.set_epsilon(eps);
+  else
+    model.update_epsilon(
+      (double) num_incompatible_events(dataset.obs, model) /
+        (dataset.obs.rows() * p),
+      std::numeric_limits<double>::epsilon());
+
+  if (update_step_size == 0 || update_step_size > max_iter)
+    update_step_size = std::max(max_iter / 5, 1u);
+  ControlEM control_EM(max_iter, update_step_size, tol, max_lambda,
+                       neighborhood_dist, pool_memory);
+  Context ctx(seed);
+  const double llhood = MCEM_hcbn(
+    model, dataset.patterns.obs, dataset.patterns.times,
+    dataset.patterns.weights, L, sampling, control_EM,
+    dataset.sampling_times_available, thrds, ctx);
+
+  append_double(response.payload, llhood);
+  append_double(response.payload, model.get_epsilon());
+  for (unsigned int j = 0; j < p; ++j)
+    append_double(response.payload, model.get_lambda(j));
+}
+
+static void loglik(PayloadReader& reader, const ServerState& state,
+                   const unsigned int thrds, const double pool_memory,
+                   Response& response) {
+  const Dataset& dataset = state.get_dataset(reader.read_uint32());
+  const unsigned int p = dataset.obs.cols();
+  Model model(state.get_poset(reader.read_uint32(), p));
+  const unsigned int L = reader.read_uint32();
+  const std::string sampling = reader.read_sampling();
+  const unsigned int neighborhood_dist = reader.read_uint32();
+  const int seed = reader.read_uint32();
+  check_sample_size(L);
+  model.set_epsilon(reader.read_error_rate());
+  model.set_lambda(reader.read_rates(p));
+
+  ControlEM control_EM;
+  control_EM.neighborhood_dist = neighborhood_dist;
+  control_EM.pool_memory = pool_memory;
+  Context ctx(seed);
+  const double llhood = obs_log_likelihood(
+    dataset.patterns.obs, model, dataset.patterns.weights,
+    dataset.patterns.times, L, sampling, control_EM, ctx,
+    dataset.sampling_times_available, thrds);
+  append_double(response.payload, llhood);
+}
+
+static void sample(PayloadReader& reader, const ServerState& state,
+                   const unsigned int thrds, Response& response) {
+  const std::uint32_t id = reader.read_uint32();
+  auto it = state.posets.find(id);
+  if (it == state.posets.end())
+    throw std::runtime_error("ERROR: unknown poset");
+  Model model(*it->second);
+  const unsigned int N = reader.read_uint32();
+  const int seed = reader.read_uint32();
+  model.set_lambda(reader.read_rates(model.size()));
+
+  /* The response must fit into a frame */
+  const std::size_t genotype_size = (model.size() + 7) / 8 + sizeof(double);
+  if (N > MAX_SAMPLE_SIZE || 4 + (std::size_t) N * genotype_size > MAX_PAYLOAD)
+    throw std::runtime_error("ERROR: too many genotypes requested, at most " +
+                             std::to_string(MAX_SAMPLE_SIZE) + " are served");
+
+  MatrixXb obs;
+  MatrixXd T_events, T_events_sum;
+  VectorXd T_sampling;
+  SamplingTimeDistribution dist("expo", 1.0 / model.get_lambda_s());
+  sample_genotypes_chunked(N, model, dist, SAMPLE_CHUNK_SIZE, seed, thrds,
+                           obs, T_events, T_events_sum, T_sampling);
+
+  append_uint32(response.payload, N);
+  append_genotypes(response.payload, obs);
+  for (unsigned int i = 0; i < N; ++i)
+    append_double(response.payload, T_sampling[i]);
+}
+
+static inline bool is_compute_request(const Request& request) {
+  return request.opcode == OP_FIT || request.opcode == OP_LOGLIK ||
+    request.opcode == OP_SAMPLE;
+}
+
+//' Execute a request. Errors are reported to the client instead of stopping
+//' the server
+//'
+//' @noRd
+//' @param pool_memory memory budget (in MB) of the genotype pool of a FIT or
+//' LOGLIK request
+static void execute(const Request& request, ServerState& state,
+                    const unsigned int thrds, const double pool_memory,
+                    Response& response) {
+  try {
+    PayloadReader reader(request.payload);
+    switch (request.opcode) {
+    case OP_LOAD_DATA:
+      load_data(reader, state, response);
+      break;
+    case OP_LOAD_POSET:
+      load_poset(reader, state);
+      break;
+    case OP_FIT:
+      fit(reader, state, thrds, pool_memory, response);
+      break;
+    case OP_LOGLIK:
+      loglik(reader, state, thrds, pool_memory, response);
+      break;
+    case OP_SAMPLE:
+      sample(reader, state, thrds, response);
+      break;
+    case OP_UNLOAD:
+      unload(reader, state);
+      break;
+    case OP_SHUTDOWN:
+      state.shutdown = true;
+      break;
+    default:
+      throw std::runtime_error("ERROR: unknown request");
+    }
+  } catch (const std::exception& ex) {
+    response.status = 1;
+    response.payload.assign(ex.what(), ex.what() + std::strlen(ex.what()));
+  }
+}
+
+//' Execute a batch of requests. Runs of FIT, LOGLIK and SAMPLE requests are
+//' distributed over the threads, and the sampling within each request runs
+//' on the same threads. Other requests modify the resident state and are
+//' executed one at a time, in their order of arrival
+//'
+//' @noRd
+//' @param pool_memory memory budget (in MB) of the genotype pools of all
+//' requests. It is split evenly among the FIT and LOGLIK requests of a run
+//' that may execute at the same time, i.e., at most one per thread
+static void execute_batch(const std::vector<Request>& requests,
+                          ServerState& state, const unsigned int thrds,
+                          const double pool_memory,
+                          std::vector<Response>& responses) {
+  const unsigned int n = requests.size();
+  responses.assign(n, Response());
+  unsigned int first = 0;
+  while (first < n) {
+    if (!is_compute_request(requests[first])) {
+      execute(requests[first], state, thrds, pool_memory, responses[first]);
+      ++first;
+      continue;
+    }
+    unsigned int last = first;
+    unsigned int num_pools = 0;
+    for (; last < n && is_compute_request(requests[last]); ++last)
+      if (requests[last].opcode != OP_SAMPLE)
+        ++num_pools;
+    const double request_pool_memory =
+      pool_memory / std::max(std::min(num_pools, thrds), 1u);
+    parallel_for(last - first, thrds, [&](const unsigned int k) {
+      execute(requests[first + k], state, thrds, request_pool_memory,
+              responses[first + k]);
+    });
+    first = last;
+  }
+}
+
+static inline bool would_block() {
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/* Put a socket into non-blocking mode, such that a client that stops
+ * reading cannot stall the server
+ */
+static bool set_nonblocking(const int fd) {
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Client connection with the bytes received but not yet parsed, and the
+ * bytes of the responses not yet sent
+ */
+class Connection {
+public:
+  int fd;
+  std::vector<unsigned char> buffer;
+  std::vector<unsigned char> output;
+  std::size_t output_pos;
+  bool closed;
+
+  explicit Connection(int fd) : fd(fd), output_pos(0), closed(false) {}
+
+  ~Connection() {
+    ::close(fd);
+  }
+
+  /* Extract the complete requests from the buffer. Returns false if the
+   * client sent a malformed frame
+   */
+  bool extract_requests(const unsigned int connection,
+                        std::vector<Request>& requests) {
+    std::size_t pos = 0;
+    while (buffer.size() - pos >= HEADER_SIZE) {
+      const unsigned char* header = &buffer[pos];
+      const std::uint32_t length = get_uint32(header + 12);
+      if (get_uint32(header) != REQUEST_MAGIC || length > MAX_PAYLOAD)
+        return false;
+      if (buffer.size() - pos - HEADER_SIZE < length)
+        break;
+      Request request;
+      request.connection = connection;
+      request.opcode = get_uint32(header + 4);
+      request.id = get_uint32(header + 8);
+      request.payload.assign(header + HEADER_SIZE,
+                             header + HEADER_SIZE + length);
+      requests.push_back(std::move(request));
+      pos += HEADER_SIZE + length;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + pos);
+    return true;
+  }
+
+  /* Append a response to the output buffer */
+  void queue_response(const std::uint32_t id, const Response& response) {
+    output.reserve(output.size() + HEADER_SIZE + response.payload.size());
+    append_uint32(output, RESPONSE_MAGIC);
+    append_uint32(output, response.status);
+    append_uint32(output, id);
+    append_uint32(output, response.payload.size());
+    output.insert(output.end(), response.payload.begin(),
+                  response.payload.end());
+  }
+
+  inline bool pending_output() const {
+    return output_pos < output.size();
+  }
+
+  /* Send as much of the output buffer as the socket accepts without
+   * blocking. Returns false if the client is gone
+   */
+  bool flush() {
+    while (pending_output()) {
+#ifdef MSG_NOSIGNAL
+      const ssize_t n = ::send(fd, output.data() + output_pos,
+                               output.size() - output_pos, MSG_NOSIGNAL);
+#else
+      const ssize_t n = ::send(fd, output.data() + output_pos,
+                               output.size() - output_pos, 0);
+#endif
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && would_block())
+        return true;
+      if (n <= 0)
+        return false;
+      output_pos += n;
+    }
+    output.clear();
+    output_pos = 0;
+    return true;
+  }
+};
+
+/* Listening socket, which is removed from the file system on destruction */
+class ServerSocket {
+public:
+  int fd;
+
+  explicit ServerSocket(const std::string& path) : fd(-1), _path(path) {
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+      throw std::runtime_error("ERROR: invalid socket path '" + path + "'");
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw std::runtime_error("ERROR: cannot create socket");
+
+    /* Remove the socket of a server that is no longer running */
+    if (::access(path.c_str(), F_OK) == 0) {
+      const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      const bool in_use = probe >= 0 && ::connect(
+        probe, (struct sockaddr*) &address, sizeof(address)) == 0;
+      if (probe >= 0)
+        ::close(probe);
+      if (in_use) {
+        ::close(fd);
+        throw std::runtime_error("ERROR: socket '" + path + "' is in use");
+      }
+      ::unlink(path.c_str());
+    }
+
+    if (::bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0 || !set_nonblocking(fd)) {
+      ::close(fd);
+      throw std::runtime_error("ERROR: cannot listen on socket '" + path + "'");
+    }
+  }
+
+  ~ServerSocket() {
+    ::close(fd);
+    ::unlink(_path.c_str());
+  }
+
+private:
+  std::string _path;
+};
+
+void run_inference_server(const std::string& socket_path,
+                          const unsigned int thrds, const double pool_memory,
+                          const bool verbose) {
+
+  ServerSocket server(socket_path);
+  ServerState state;
+  std::vector< std::unique_ptr<Connection> > connections;
+  std::vector<unsigned char> recv_buffer(RECV_BUFFER_SIZE);
+  std::vector<Request> requests;
+  std::vector<Response> responses;
+
+  if (verbose)
+    std::cout << "Listening on " << socket_path << std::endl;
+
+  while (!state.shutdown) {
+    std::vector<struct pollfd> fds(connections.size() + 1);
+    fds[0].fd = server.fd;
+    fds[0].events = POLLIN;
+    for (unsigned int c = 0; c < connections.size(); ++c) {
+      fds[c + 1].fd = connections[c]->fd;
+      fds[c + 1].events = POLLIN;
+      if (connections[c]->pending_output())
+        fds[c + 1].events |= POLLOUT;
+    }
+
+    const int ready = ::poll(fds.data(), fds.size(), POLL_TIMEOUT);
+    Rcpp::checkUserInterrupt();
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("ERROR: waiting for requests failed");
+    }
+
+    /* Send the pending responses of all clients that are ready */
+    for (unsigned int c = 0; c < connections.size(); ++c)
+      if ((fds[c + 1].revents & POLLOUT) && !connections[c]->flush())
+        connections[c]->closed = true;
+
+    /* Read the requests of all clients that are ready */
+    requests.clear();
+    for (unsigned int c = 0; c < connections.size(); ++c) {
+      if (!(fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      Connection& connection = *connections[c];
+      if (connection.closed)
+        continue;
+      const ssize_t n = ::recv(connection.fd, recv_buffer.data(),
+                               recv_buffer.size(), 0);
+      if (n < 0 && (errno == EINTR || would_block()))
+        continue;
+      if (n <= 0) {
+        connection.closed = true;
+        continue;
+      }
+      connection.buffer.insert(connection.buffer.end(), recv_buffer.begin(),
+                               recv_buffer.begin() + n);
+      if (!connection.extract_requests(c, requests))
+        connection.closed = true;
+    }
+
+    if (!requests.empty()) {
+      execute_batch(requests, state, thrds, pool_memory, responses);
+      for (unsigned int r = 0; r < requests.size(); ++r) {
+        Connection& connection = *connections[requests[r].connection];
+        if (!connection.closed)
+          connection.queue_response(requests[r].id, responses[r]);
+      }
+      /* Responses that do not fit into the socket buffers are sent as the
+       * clients become ready to read
+       */
+      for (unsigned int c = 0; c < connections.size(); ++c)
+        if (!connections[c]->closed && !connections[c]->flush())
+          connections[c]->closed = true;
+      if (verbose)
+        std::cout << "Executed a batch of " << requests.size()
+                  << " request(s)" << std::endl;
+    }
+
+    /* Close connections after the batch, since requests refer to them by
+     * position
+     */
+    for (unsigned int c = connections.size(); c-- > 0; )
+      if (connections[c]->closed)
+        connections.erase(connections.begin() + c);
+
+    if (fds[0].revents & POLLIN) {
+      const int fd = ::accept(server.fd, NULL, NULL);
+      if (fd >= 0) {
+        if (set_nonblocking(fd))
+          connections.push_back(
+            std::unique_ptr<Connection>(new Connection(fd)));
+        else
+          ::close(fd);
+      }
+    }
+  }
+
+  for (unsigned int k = 0; k < SHUTDOWN_FLUSH_POLLS; ++k) {
+    std::vector<struct pollfd> fds;
+    std::vector<Connection*> pending;
+    for (const std::unique_ptr<Connection>& connection : connections) {
+      if (connection->closed || !connection->pending_output())
+        continue;
+      struct pollfd pfd;
+      pfd.fd = connection->fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      fds.push_back(pfd);
+      pending.push_back(connection.get());
+    }
+    if (pending.empty())
+      break;
+    if (::poll(fds.data(), fds.size(), POLL_TIMEOUT) < 0 && errno != EINTR)
+      break;
+    for (unsigned int c = 0; c < pending.size(); ++c)
+      if ((fds[c].revents & (POLLOUT | POLLHUP | POLLERR)) &&
+          !pending[c]->flush())
+        pending[c]->closed = true;
+  }
+}
+
+#else
+
+void run_inference_server(const std::string& socket_path,
+                          const unsigned int thrds, const double pool_memory,
+                          const bool verbose) {
+  throw std::runtime_error(
+      "ERROR: the inference server requires Unix domain sockets");
+}
+
+#endif
+
+RcppExport SEXP _inference_server(SEXP socketSEXP, SEXP thrdsSEXP,
+                                  SEXP pool_memorySEXP, SEXP verboseSEXP) {
+
+  using namespace Rcpp;
+  bool interrupted = false;
+  try {
+    /* Convert input to C++ types */
+    const std::string& socket_path = as<std::string>(socketSEXP);
+    const int thrds = as<int>(thrdsSEXP);
+    const double pool_memory = as<double>(pool_memorySEXP);
+    const bool verbose = as<bool>(verboseSEXP);
+    if (!std::isfinite(pool_memory) || !(pool_memory > 0))
+      throw std::runtime_error(
+          "ERROR: memory budget must be finite and positive");
+
+    /* Call the underlying C++ function */
+    run_inference_server(socket_path, thrds, pool_memory, verbose);
+  } catch (const Rcpp::internal::InterruptedException&) {
+    /* Raised by checkUserInterrupt. It is passed on to R once the sockets
+     * are closed, rather than reported as an unknown exception
+     */
+    interrupted = true;
+  } catch  (...) {
+    handle_exceptions();
+  }
+  if (interrupted)
+    Rf_onintr();
+  return R_NilValue;
+}
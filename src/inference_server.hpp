@@ -0,0 +1,75 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Local inference server listening on a Unix domain socket
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef INFERENCE_SERVER_HPP
+#define INFERENCE_SERVER_HPP
+
+#include <string>
+
+/* Binary protocol of the inference server. Requests and responses are
+ * frames starting with a header of four 32-bit integers:
+ *  - the magic number "MCIS" (requests) or "MCIR" (responses),
+ *  - the opcode (requests) or the status (responses, 0: success, 1: error),
+ *  - a request id, chosen by the client and copied to the response, and
+ *  - the length of the payload in bytes,
+ * followed by the payload. The payload of an error response is the error
+ * message. Integers are 32-bit, times and parameters are doubles, and
+ * genotypes are packed as in the binary genotype format, i.e., ceiling(p / 8)
+ * bytes per genotype. All values are little-endian. Rates must be finite and
+ * positive.
+ *
+ * Requests and the payloads of their requests (->) and responses (<-):
+ *  - LOAD_DATA: -> dataset id, N (at most 10^7), p (at most 16384), flags
+ *    (1: sampling times), N genotypes, N weights and, if flag 1 is set, N
+ *    sampling times
+ *    <- number of distinct observations
+ *  - LOAD_POSET: -> poset id, p (at most 16384), number of cover relations
+ *    R, lambda_s (finite and positive), R pairs (u, v) of events (0-based)
+ *    <- empty
+ *  - FIT: -> dataset id, poset id, L (between 1 and 10^6), sampling scheme,
+ *    max_iter (between 1 and 10^5), update_step_size, neighborhood_dist,
+ *    seed, flags (1: initial rates), tol (finite and positive), max_lambda
+ *    (finite and positive), initial error rate (if negative, it is derived
+ *    from the incompatible events, otherwise it must be below 1) and, if
+ *    flag 1 is set, p initial rates
+ *    <- log-likelihood, error rate and p rates
+ *  - LOGLIK: -> dataset id, poset id, L (between 1 and 10^6), sampling
+ *    scheme, neighborhood_dist, seed, error rate in [0, 1) and p rates
+ *    <- log-likelihood
+ *  - SAMPLE: -> poset id, N (at most 10^6, and such that the response fits
+ *    into a frame), seed and p rates
+ *    <- N, N genotypes and N sampling times drawn from Exp(lambda_s)
+ *  - UNLOAD: -> kind (0: dataset, 1: poset) and id
+ *    <- empty
+ *  - SHUTDOWN: -> empty
+ *    <- empty
+ * Sampling schemes are numbered as "forward" (0), "add-remove" (1),
+ * "backward" (2), "bernoulli" (3) and "pool" (4). The genotype pools of the
+ * "pool" scheme share the memory budget of the server: the budget is split
+ * evenly among the FIT and LOGLIK requests of a batch that may run at the
+ * same time, i.e., at most one per thread.
+ */
+enum ServerOpcode {
+  OP_LOAD_DATA = 1,
+  OP_LOAD_POSET = 2,
+  OP_FIT = 3,
+  OP_LOGLIK = 4,
+  OP_SAMPLE = 5,
+  OP_UNLOAD = 6,
+  OP_SHUTDOWN = 7
+};
+
+/* Serve requests until a SHUTDOWN request is received. Requests that arrive
+ * together are executed as one batch: loading and unloading requests in
+ * their order of arrival, while the FIT, LOGLIK and SAMPLE requests between
+ * them share the threads and the memory budget (in MB) of the genotype pools
+ */
+void run_inference_server(const std::string& socket_path,
+                          const unsigned int thrds, const double pool_memory,
+                          const bool verbose);
+
+#endif
@@ -32,6 +32,14 @@ typedef Map<VectorXi> MapVeci;
 typedef Map<MatrixXi> MapMati;
 typedef Map<MatrixXd> MapMatd;
 typedef Map<RowVectorXd> MapRowVecd;
+using Eigen::MatrixXf;
+using Eigen::VectorXf;
+
+/* Sample matrices and vectors of event times in double or single precision */
+template <typename Scalar>
+using MatrixT = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+template <typename Scalar>
+using VectorT = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
 
 struct Event {
   unsigned int event_id;
@@ -197,18 +205,91 @@ protected:
   vertices_size_type _size;
 };
 
-class DataImportanceSampling {
+/* Importance weights, Hamming distances and time differences of the samples.
+ * Time differences are stored in the precision of the sampling kernels, while
+ * weights are always kept in double precision. Weights are relative to
+ * exp(log_scale), which is -Inf if all of them are 0
+ */
+template <typename Scalar>
+class DataImportanceSamplingT {
 public:
   VectorXd w;
   VectorXi dist;
-  MatrixXd Tdiff;
+  MatrixT<Scalar> Tdiff;
+  double log_scale;
 
   /*Parametrized Constructor */
-  DataImportanceSampling(unsigned int L, unsigned int p) : w(L), dist(L),
-    Tdiff(L, p) {}
+  DataImportanceSamplingT(unsigned int L, unsigned int p) : w(L), dist(L),
+    Tdiff(L, p), log_scale(0.0) {}
+
+};
+
+typedef DataImportanceSamplingT<double> DataImportanceSampling;
+
+/* Partial sums of the importance weights of an observation. Sums over
+ * blocks of samples are merged to obtain the sums over all samples. As in
+ * log-sum-exp, sums are kept relative to the largest weight seen so far,
+ * exp(log_scale) (w_sqrt relative to exp(2 log_scale))
+ */
+class ImportanceSums {
+public:
+  double w;                 // sum of the importance weights
+  double w_sqrt;            // sum of the squared importance weights
+  double w_dist;            // weighted sum of the Hamming distances
+  VectorXd w_Tdiff;         // weighted sum of the time differences
+  double log_scale;         // log of the scale of the sums
+  unsigned int L;           // number of samples
+  unsigned int L_positive;  // number of samples with positive weight
+
+  ImportanceSums(unsigned int p=0) : w(0.0), w_sqrt(0.0), w_dist(0.0),
+    w_Tdiff(VectorXd::Zero(p)), log_scale(0.0), L(0), L_positive(0) {}
+
+  template <typename Scalar>
+  void add(const DataImportanceSamplingT<Scalar>& importance_sampling);
+
+  void merge(const ImportanceSums& other);
+
+  /* Logarithm of the sum of the importance weights */
+  double log_w() const {
+    return std::log(w) + log_scale;
+  }
+
+private:
+  /* Move the sums to the larger of both scales, and return the factor that
+   * converts weights relative to exp(log_scale_other) to that scale
+   */
+  double rescale(const double log_scale_other);
+};
+
+/* Samples of an observation that are recycled across EM iterations. Log
+ * proposal densities are kept, such that samples can be reweighted when the
+ * parameters change. Time differences are stored in the precision of the
+ * sampling kernels
+ */
+template <typename Scalar>
+class RecycledSamplesT {
+public:
+  DataImportanceSamplingT<Scalar> data;
+  VectorXd log_proposal;
+  double ess_min;           // effective sample size below which to redraw
+
+  RecycledSamplesT() : data(0, 0), ess_min(0.0) {}
+
+  inline bool empty() const {
+    return log_proposal.size() == 0;
+  }
 
+  /* Memory (in bytes) held by the L samples of an observation */
+  static inline double memory(const unsigned int L, const unsigned int p) {
+    return (double) L *
+      (p * sizeof(Scalar) + 2 * sizeof(double) + sizeof(int));
+  }
 };
 
+typedef RecycledSamplesT<double> RecycledSamples;
+
+class GenotypePool;
+
 /* Class containing customisable options for the EM algorithm */
 class ControlEM {
 public:
@@ -217,12 +298,18 @@ public:
   double tol;                    // convergence tolerance
   float max_lambda;
   unsigned int neighborhood_dist;
+  double pool_memory;            // memory budget of the genotype pool or the recycled samples in MB (0: no budget)
+  bool single_precision;         // sample event times in single precision
+  double recycle_ess;            // relative effective sample size below which recycled samples are redrawn (0: no recycling)
 
   ControlEM(unsigned int max_iter=100, unsigned int update_step_size=20,
             double tol=0.001, float max_lambda=1e6,
-            unsigned int neighborhood_dist=1) :
+            unsigned int neighborhood_dist=1, double pool_memory=0.0,
+            bool single_precision=false, double recycle_ess=0.0) :
     max_iter(max_iter), update_step_size(update_step_size), tol(tol),
-    max_lambda(max_lambda), neighborhood_dist(neighborhood_dist) {}
+    max_lambda(max_lambda), neighborhood_dist(neighborhood_dist),
+    pool_memory(pool_memory), single_precision(single_precision),
+    recycle_ess(recycle_ess) {}
 };
 
 vertices_size_type Model::size() const {
@@ -270,19 +357,60 @@ bool Model::get_update_node_idx() const {
   return _update_node_idx;
 }
 
-DataImportanceSampling importance_weight(
+template <typename Scalar=double>
+DataImportanceSamplingT<Scalar> importance_weight(
     const RowVectorXb& genotype, unsigned int L, const Model& model,
     const double time, const std::string& sampling,
     const VectorXd& scale_cumulative, const VectorXi& dist_pool,
-    const MatrixXd& Tdiff_pool, const unsigned int neighborhood_dist,
+    const GenotypePool& pool, const unsigned int neighborhood_dist,
     Context::rng_type& rng, const bool sampling_times_available=false);
 
+unsigned int num_sample_blocks(const unsigned int N, const unsigned int L,
+                               const unsigned int thrds);
+
+std::vector<ImportanceSums> importance_sums(
+    const MatrixXb& obs, const unsigned int L, const Model& model,
+    const VectorXd& times, const std::string& sampling,
+    const VectorXd& scale_cumulative, const GenotypePool& pool,
+    const unsigned int neighborhood_dist, const bool sampling_times_available,
+    const unsigned int thrds, Context& ctx, const bool single_precision=false);
+
+template <typename Scalar>
+std::vector<ImportanceSums> recycled_importance_sums(
+    const MatrixXb& obs, const unsigned int L, const Model& model,
+    const VectorXd& times, const std::string& sampling,
+    const VectorXd& scale_cumulative, const unsigned int neighborhood_dist,
+    const bool sampling_times_available, const double recycle_ess,
+    const double memory_budget,
+    std::vector< RecycledSamplesT<Scalar> >& samples,
+    const unsigned int thrds, Context& ctx);
+
 VectorXi hamming_dist_mat(const MatrixXb &x, const RowVectorXb &y);
 
+double log_bernoulli_process(const unsigned int dist, const double eps,
+                             const unsigned int p);
+
 double complete_log_likelihood(
     const VectorXd &lambda, const double eps, const MatrixXd &Tdiff,
     const VectorXd &dist, const float W, const bool internal=true);
 
+template <typename Scalar>
+MatrixT<Scalar> sample_times(
+    const unsigned int N, const Model& model, MatrixT<Scalar>& T_events,
+    Context::rng_type& rng, const unsigned int thrds=1);
+
+template <typename Scalar>
+MatrixXb generate_genotypes(
+    const MatrixT<Scalar>& T_events_sum, const Model& model,
+    VectorT<Scalar>& T_sampling, Context::rng_type& rng,
+    const bool sampling_times_available=false);
+
+double obs_log_likelihood(
+    const MatrixXb& obs, Model& model, const RowVectorXd& weights,
+    const VectorXd& times, const unsigned int L, const std::string& sampling,
+    const ControlEM& control_EM, Context& ctx,
+    const bool sampling_times_available=false, const unsigned int thrds=1);
+
 double MCEM_hcbn(
     Model& model, const MatrixXb& obs, const VectorXd& times,
     const RowVectorXd& weights, const unsigned int L,
@@ -309,9 +437,14 @@ int num_compatible_observations(const MatrixXb& obs, const Model& poset,
 
 int num_incompatible_events(const MatrixXb& genotype, const Model& poset);
 
+void initialize_lambda(Model& model, const MatrixXb& obs, const float max_lambda);
+
 std::vector<int> rdiscrete_std(const unsigned int N, const VectorXd& weights,
                                Context::rng_type& rng);
 
+std::vector<int> rmultinom_std(const unsigned int N, const VectorXd& weights,
+                               Context::rng_type& rng);
+
 void handle_exceptions();
 
 Rcpp::NumericMatrix generateMutationTimes(
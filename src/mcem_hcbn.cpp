@@ -5,21 +5,29 @@
  * @email susana.posada@bsse.ethz.ch
  */
 
+#define USE_FC_LEN_T
 #include <Rcpp.h>
 #include <RcppEigen.h>
+#include <R_ext/BLAS.h>
+#ifndef FCONE
+# define FCONE
+#endif
 #include "mcem.hpp"
 #include "add_remove.hpp"
+#include "simulation.hpp"
+#include "alias_table.hpp"
+#include "genotype_pool.hpp"
+#include "fixed_size_kernels.hpp"
+#include "task_runtime.hpp"
+#include "vector_math.hpp"
 #include "not_acyclic_exception.hpp"
 #include <boost/graph/graph_traits.hpp>
 #include <random>
+#include <unordered_map>
 #include <vector>
 
 // #include "debugging_helper.hpp"
 
-#ifdef _OPENMP
-  #include <omp.h>
-#endif
-
 class Initializer {
 public:
   Initializer() {
@@ -43,13 +51,63 @@ void handle_exceptions() {
 //' @param N number of samples to be drawn
 std::vector<int> rdiscrete_std(const unsigned int N, const VectorXd& weights,
                                Context::rng_type& rng) {
-  std::discrete_distribution<int> distribution(weights.data(),
-                                               weights.data() + weights.size());
-  std::vector<int> ret(N);
+  AliasTable table(weights);
+  return table.sample(N, rng);
+}
 
-  for (unsigned int i = 0; i < N; ++i)
-    ret[i] = distribution(rng);
+//' Draw the number of occurrences of each category in N trials
+//'
+//' @noRd
+//' @param N number of trials
+std::vector<int> rmultinom_std(const unsigned int N, const VectorXd& weights,
+                               Context::rng_type& rng) {
+  std::vector<int> counts(weights.size(), 0);
+  int last = weights.size() - 1;
+  while (last >= 0 && weights[last] <= 0)
+    --last;
+  if (last < 0)
+    return counts;
+
+  double weights_sum = weights.sum();
+  int remaining = N;
+  for (int k = 0; k < last && remaining > 0; ++k) {
+    if (weights[k] <= 0)
+      continue;
+    std::binomial_distribution<int> distribution(
+        remaining, std::min(weights[k] / weights_sum, 1.0));
+    counts[k] = distribution(rng);
+    remaining -= counts[k];
+    weights_sum -= weights[k];
+  }
+  counts[last] += remaining;
+  return counts;
+}
 
+//' Collapse identical rows of a matrix, keeping the order of first occurrence
+//'
+//' @noRd
+//' @return returns the distinct rows and their multiplicities
+MatrixXb unique_rows(const MatrixXb& x, std::vector<int>& counts) {
+  const unsigned int N = x.rows();
+  const unsigned int p = x.cols();
+  std::unordered_map<std::vector<bool>, unsigned int> idx;
+  std::vector<unsigned int> first;
+  std::vector<bool> key(p);
+  counts.clear();
+  for (unsigned int i = 0; i < N; ++i) {
+    for (unsigned int j = 0; j < p; ++j)
+      key[j] = x(i, j);
+    auto it = idx.insert(std::make_pair(key, counts.size()));
+    if (it.second) {
+      first.push_back(i);
+      counts.push_back(1);
+    } else {
+      ++counts[it.first->second];
+    }
+  }
+  MatrixXb ret(first.size(), p);
+  for (unsigned int k = 0; k < first.size(); ++k)
+    ret.row(k) = x.row(first[k]);
   return ret;
 }
 
@@ -81,6 +139,18 @@ VectorXd log_bernoulli_process(const VectorXd& dist, const double eps,
   return log_prob;
 }
 
+//' Probability of observing a genotype at Hamming distance d from the
+//' hidden genotype, eps^d (1 - eps)^(p - d), for d = 0, ..., p. Weights
+//' that only depend on the distance are looked up in this table
+//'
+//' @noRd
+VectorXd bernoulli_table(const double eps, const unsigned int p) {
+  VectorXd table(p + 1);
+  for (unsigned int d = 0; d <= p; ++d)
+    table[d] = std::pow(eps, d) * std::pow(1 - eps, p - d);
+  return table;
+}
+
 double log_bernoulli_process(const unsigned int dist, const double eps,
                              const unsigned int p) {
   double log_prob = 0.0;
@@ -130,49 +200,86 @@ double complete_log_likelihood(const VectorXd& lambda, const double eps,
   return llhood;
 }
 
+/* Number of rows of the occurrence times processed at once by the generic
+ * cumulative-time kernel. Blocks are distributed over the threads
+ */
+static const unsigned int CUMULATIVE_BLOCK_ROWS = 1024;
+
+//' Cumulative occurrence times from the time differences. Small posets are
+//' handled by the specialized kernels. Otherwise, rows are split into blocks,
+//' which are processed in parallel, and the events of a block are processed
+//' level by level: the maxima over the parents of all events of a level are
+//' computed first, and the times of the level are then added at once.
+//' Posets without cover relations amount to a copy
+//'
+//' @noRd
+template <typename Scalar>
+static void cumulative_times(const CompiledPoset& poset,
+                             const MatrixT<Scalar>& T_events,
+                             MatrixT<Scalar>& T_events_sum,
+                             const unsigned int thrds=1) {
+  if (poset.num_levels() <= 1) {
+    T_events_sum = T_events;
+    return;
+  }
+  if (cumulative_times_fixed(poset, T_events, T_events_sum))
+    return;
+
+  const unsigned int N = T_events.rows();
+  T_events_sum.resize(N, T_events.cols());
+  const unsigned int num_blocks =
+    (N + CUMULATIVE_BLOCK_ROWS - 1) / CUMULATIVE_BLOCK_ROWS;
+  parallel_for(num_blocks, thrds, [&](const unsigned int b) {
+    const unsigned int first = b * CUMULATIVE_BLOCK_ROWS;
+    const unsigned int n = std::min(CUMULATIVE_BLOCK_ROWS, N - first);
+    MatrixT<Scalar> T_max;
+    for (unsigned int l = 0; l < poset.num_levels(); ++l) {
+      const unsigned int offset = poset.level_offset[l];
+      const unsigned int m = poset.level_offset[l + 1] - offset;
+      T_max.setZero(n, m);
+      for (unsigned int c = 0; c < m; ++c) {
+        const unsigned int j = poset.topo_order[offset + c];
+        for (unsigned int i = poset.parents_offset[j];
+             i < poset.parents_offset[j + 1]; ++i)
+          T_max.col(c) = T_max.col(c).cwiseMax(
+            T_events_sum.col(poset.parents[i]).segment(first, n));
+      }
+      for (unsigned int c = 0; c < m; ++c) {
+        const unsigned int j = poset.topo_order[offset + c];
+        T_events_sum.col(j).segment(first, n) =
+          T_events.col(j).segment(first, n) + T_max.col(c);
+      }
+    }
+  });
+}
+
 //' Generate observations from a given poset and given rates
 //'
 //' @noRd
 //' @param N number of samples
 //' @return returns matrix containing observations
+template <typename Scalar>
 MatrixXb sample_genotypes(
-    const unsigned int N, const Model& model, MatrixXd& T_events,
-    VectorXd& T_sampling, Context::rng_type& rng,
+    const unsigned int N, const Model& model, MatrixT<Scalar>& T_events,
+    VectorT<Scalar>& T_sampling, Context::rng_type& rng,
     const bool sampling_times_available=false) {
 
   /* Initialization and instantiation of variables */
   const vertices_size_type p = model.size();  // Number of mutations / events
-  MatrixXd T_events_sum;
+  MatrixT<Scalar> T_events_sum;
   MatrixXb obs;
-  T_events_sum.setZero(N, p);
-  obs.setConstant(N, p, false);
-  auto id = boost::get(&Event::event_id, model.poset);
 
   /* Generate occurence times T_events_{j} ~ Exp(lambda_{j}) */
   for (unsigned int j = 0; j < p; ++j)
-    T_events.col(j) = rexp(N, model.get_lambda(j), rng);
+    T_events.col(j) = rexp<Scalar>(N, model.get_lambda(j), rng);
 
 
   /* Use sampling times when available */
   if (!sampling_times_available)
-    T_sampling = rexp(N, model.get_lambda_s(), rng);
+    T_sampling = rexp<Scalar>(N, model.get_lambda_s(), rng);
 
-  VectorXd T_max = VectorXd::Zero(N);
-  /* Loop through nodes in topological order */
-  for (node_container::const_reverse_iterator v = model.topo_path.rbegin();
-       v != model.topo_path.rend(); ++v) {
-    T_max = VectorXd::Zero(N);
-    /* Loop through parents of node v */
-    boost::graph_traits<Poset>::in_edge_iterator in_begin, in_end;
-    for (boost::tie(in_begin, in_end) = boost::in_edges(*v, model.poset);
-         in_begin != in_end; ++in_begin) {
-      Node u = boost::get(id, source(*in_begin, model.poset));
-      T_max = (T_events_sum.col(u).array() > T_max.array()).select(T_events_sum.col(u), T_max);
-    }
-    T_events_sum.col(model.poset[*v].event_id) = T_events.col(model.poset[*v].event_id) + T_max;
-    obs.col(model.poset[*v].event_id) =
-      (T_events_sum.col(model.poset[*v].event_id).array() <= T_sampling.array()).select(true, obs.col(model.poset[*v].event_id));
-  }
+  cumulative_times(CompiledPoset(model), T_events, T_events_sum);
+  obs = (T_events_sum.array() <= T_sampling.replicate(1, p).array()).matrix();
   return obs;
 }
 
@@ -180,42 +287,37 @@ MatrixXb sample_genotypes(
 //'
 //' @noRd
 //' @param N number of samples
+//' @param thrds number of threads for the cumulative times
 //' @return returns matrix containing occurrence times
-MatrixXd sample_times(
-    const unsigned int N, const Model& model, MatrixXd& T_events,
-    Context::rng_type& rng) {
+template <typename Scalar>
+MatrixT<Scalar> sample_times(
+    const unsigned int N, const Model& model, MatrixT<Scalar>& T_events,
+    Context::rng_type& rng, const unsigned int thrds) {
 
   /* Initialization and instantiation of variables */
   const vertices_size_type p = model.size();  // Number of mutations / events
-  MatrixXd T_events_sum;
-  T_events_sum.setZero(N, p);
-  auto id = boost::get(&Event::event_id, model.poset);
+  MatrixT<Scalar> T_events_sum;
 
   /* Generate occurence times T_events_{j} ~ Exp(lambda_{j}) */
   for (unsigned int j = 0; j < p; ++j)
-    T_events.col(j) = rexp(N, model.get_lambda(j), rng);
+    T_events.col(j) = rexp<Scalar>(N, model.get_lambda(j), rng);
 
-  VectorXd T_max = VectorXd::Zero(N);
-  /* Loop through nodes in topological order */
-  for (node_container::const_reverse_iterator v = model.topo_path.rbegin();
-       v != model.topo_path.rend(); ++v) {
-    T_max = VectorXd::Zero(N);
-    /* Loop through parents of node v */
-    boost::graph_traits<Poset>::in_edge_iterator in_begin, in_end;
-    for (boost::tie(in_begin, in_end) = boost::in_edges(*v, model.poset);
-         in_begin != in_end; ++in_begin) {
-      Node u = boost::get(id, source(*in_begin, model.poset));
-      T_max = (T_events_sum.col(u).array() > T_max.array()).select(T_events_sum.col(u), T_max);
-    }
-    T_events_sum.col(model.poset[*v].event_id) = T_events.col(model.poset[*v].event_id) + T_max;
-  }
+  cumulative_times(CompiledPoset(model), T_events, T_events_sum, thrds);
   return T_events_sum;
 }
 
+template MatrixXd sample_times<double>(
+    const unsigned int, const Model&, MatrixXd&, Context::rng_type&,
+    const unsigned int);
+template MatrixXf sample_times<float>(
+    const unsigned int, const Model&, MatrixXf&, Context::rng_type&,
+    const unsigned int);
+
+template <typename Scalar>
 MatrixXb generate_genotypes(
-    const MatrixXd& T_events_sum, const Model& model,
-    VectorXd& T_sampling, Context::rng_type& rng,
-    const bool sampling_times_available=false) {
+    const MatrixT<Scalar>& T_events_sum, const Model& model,
+    VectorT<Scalar>& T_sampling, Context::rng_type& rng,
+    const bool sampling_times_available) {
 
   /* Initialization and instantiation of variables */
   const unsigned int N = T_events_sum.rows(); // Number of genotypes to be drawn
@@ -224,7 +326,7 @@ MatrixXb generate_genotypes(
   obs.setConstant(N, p, false);
 
   if (!sampling_times_available)
-    T_sampling = rexp(N, model.get_lambda_s(), rng);
+    T_sampling = rexp<Scalar>(N, model.get_lambda_s(), rng);
 
   /* Loop through nodes in topological order */
   for (node_container::const_reverse_iterator v = model.topo_path.rbegin();
@@ -235,80 +337,80 @@ MatrixXb generate_genotypes(
   return obs;
 }
 
+template MatrixXb generate_genotypes<double>(
+    const MatrixXd&, const Model&, VectorXd&, Context::rng_type&, const bool);
+template MatrixXb generate_genotypes<float>(
+    const MatrixXf&, const Model&, VectorXf&, Context::rng_type&, const bool);
+
+//' Compute observed log-likelihood of a model whose parameters are set. The
+//' pool of genotypes is sized and stored as in the E-step, following
+//' control_EM
+//'
+//' @noRd
+double obs_log_likelihood(
+    const MatrixXb& obs, Model& model, const RowVectorXd& weights,
+    const VectorXd& times, const unsigned int L, const std::string& sampling,
+    const ControlEM& control_EM, Context& ctx,
+    const bool sampling_times_available, const unsigned int thrds) {
+
+  const vertices_size_type p = model.size(); // Number of mutations / events
+  const unsigned int N = obs.rows();         // Number of observations / genotypes
+  double llhood = 0.0;
+
+  VectorXd scale_cumulative;
+  GenotypePool pool;
+  if (sampling == "add-remove") {
+    scale_cumulative.resize(p);
+    scale_cumulative = scale_path_to_mutation(model);
+    if (model.get_update_node_idx())
+      model.update_node_idx();
+  } else if (sampling == "pool") {
+    const unsigned int K = GenotypePool::capped_size(
+      p * L, p, control_EM.pool_memory, control_EM.single_precision);
+    pool = GenotypePool(model, K, control_EM.single_precision);
+    pool.sample(model, ctx.rng);
+  }
+
+  std::vector<ImportanceSums> sums = importance_sums(
+    obs, L, model, times, sampling, scale_cumulative, pool,
+    control_EM.neighborhood_dist, sampling_times_available, thrds, ctx,
+    control_EM.single_precision);
+
+  for (unsigned int i = 0; i < N; ++i) {
+    if (sums[i].w > 0) {
+      int L_eff = sums[i].L;
+      if (sampling == "backward")
+        L_eff = sums[i].L_positive;
+      llhood += weights(i) * (sums[i].log_w() - std::log(L_eff));
+    } else {
+        throw std::runtime_error(
+            "ERROR: all samples have weight 0. Consider increasing L");
+    }
+  }
+  return llhood;
+}
+
 //' Compute observed log-likelihood
 double obs_log_likelihood(
     const MatrixXb& obs, const MatrixXi& poset, const VectorXd& lambda,
     const double eps, const RowVectorXd& weights, const VectorXd& times,
     const unsigned int L, const std::string& sampling,
-    const unsigned int neighborhood_dist, Context& ctx, const float lambda_s=1.0,
+    const ControlEM& control_EM, Context& ctx, const float lambda_s=1.0,
     const bool sampling_times_available=false, const unsigned int thrds=1) {
 
   const auto p = poset.rows(); // Number of mutations / events
-  const auto N = obs.rows();   // Number of observations / genotypes
-  double llhood = 0.0;
 
   edge_container edge_list = adjacency_mat2list(poset);
   Model model(edge_list, p, lambda_s);
   model.set_lambda(lambda);
   model.set_epsilon(eps);
   model.has_cycles();
-  if (model.cycle) {
+  if (model.cycle)
     throw not_acyclic_exception();
-  } else {
-    model.topological_sort();
-
-    unsigned int K = 0;
-    VectorXd scale_cumulative;
-    MatrixXd Tdiff_pool;
-    MatrixXd T_pool;
-    if (sampling == "add-remove") {
-      scale_cumulative.resize(p);
-      scale_cumulative = scale_path_to_mutation(model);
-      if (model.get_update_node_idx())
-        model.update_node_idx();
-    } else if (sampling == "pool") {
-      K = p * L;
-      Tdiff_pool.resize(K, p);
-      T_pool.resize(K, p);
-      T_pool = sample_times(K, model, Tdiff_pool, ctx.rng);
-    }
-
-    #ifdef _OPENMP
-    omp_set_num_threads(thrds);
-    #endif
-    auto rngs = ctx.get_auxiliary_rngs(thrds);
-
-    #pragma omp parallel for reduction(+:llhood) schedule(static)
-    for (unsigned int i = 0; i < N; ++i) {
-      VectorXi d_pool;
-      if (sampling == "pool") {
-        VectorXd T_sampling(K);
-        if (sampling_times_available)
-          T_sampling.setConstant(times[i]);
-
-        MatrixXb genotype_pool = 
-          generate_genotypes(T_pool, model, T_sampling, (*rngs)[omp_get_thread_num()],
-                             sampling_times_available);
-        d_pool = hamming_dist_mat(genotype_pool, obs.row(i));
-      }
-      DataImportanceSampling importance_sampling = importance_weight(
-        obs.row(i), L, model, times[i], sampling, scale_cumulative, d_pool,
-        Tdiff_pool, neighborhood_dist, (*rngs)[omp_get_thread_num()],
-        sampling_times_available);
+  model.topological_sort();
 
-      double aux = importance_sampling.w.sum();
-      if (aux > 0) {
-        int L_eff = L;
-        if (sampling == "backward")
-          L_eff = (importance_sampling.w.array() > 0).count();
-        llhood += weights(i) * std::log(aux / L_eff);
-      } else {
-          throw std::runtime_error(
-              "ERROR: all samples have weight 0. Consider increasing L");
-      }
-    }
-  }
-  return llhood;
+  return obs_log_likelihood(obs, model, weights, times, L, sampling,
+                            control_EM, ctx, sampling_times_available, thrds);
 }
 
 //' Compute Hamming distance between two vectors
@@ -329,6 +431,25 @@ VectorXi hamming_dist_mat(const MatrixXb& x, const RowVectorXb& y) {
   // return (x.rowwise() - y).array().abs().rowwise().sum();
 }
 
+//' Exponentiate log-weights in place, relative to their maximum. Samples with
+//' log-weight -Inf get weight 0
+//'
+//' @noRd
+//' @return returns the maximum log-weight, or -Inf if all weights are 0
+static double exp_relative(VectorXd& w) {
+  double log_scale = -std::numeric_limits<double>::infinity();
+  for (unsigned int l = 0; l < w.size(); ++l)
+    if (w[l] > log_scale)
+      log_scale = w[l];
+  if (log_scale == -std::numeric_limits<double>::infinity()) {
+    w.setZero();
+    return log_scale;
+  }
+  w.array() -= log_scale;
+  vexp(w.size(), w.data(), w.data());
+  return log_scale;
+}
+
 //' Compute importance weights and (expected) sufficient statistics by
 //' importance sampling
 //'
@@ -340,11 +461,12 @@ VectorXi hamming_dist_mat(const MatrixXb& x, const RowVectorXb& y) {
 //' @param time sampling time
 //' @param sampling variable indicating which proposal to use
 //' @return returns importance weights and (expected) sufficient statistics
-DataImportanceSampling importance_weight(
+template <typename Scalar>
+DataImportanceSamplingT<Scalar> importance_weight(
     const RowVectorXb& genotype, unsigned int L, const Model& model,
     const double time, const std::string& sampling,
     const VectorXd& scale_cumulative, const VectorXi& dist_pool,
-    const MatrixXd& Tdiff_pool, const unsigned int neighborhood_dist,
+    const GenotypePool& pool, const unsigned int neighborhood_dist,
     Context::rng_type& rng, const bool sampling_times_available) {
 
   /* Initialization and instantiation of variables */
@@ -366,7 +488,7 @@ DataImportanceSampling importance_weight(
     L_aux = std::max(L / reps, L_aux);
     L = reps * L_aux;
   }
-  DataImportanceSampling importance_sampling(L, p);
+  DataImportanceSamplingT<Scalar> importance_sampling(L, p);
 
   if (sampling == "forward") {
     /* Generate L samples from poset with parameters lambda and lambda_s.
@@ -374,18 +496,19 @@ DataImportanceSampling importance_weight(
      * generate samples of X (true genotype)
      */
     MatrixXb samples(L, p);
-    VectorXd T_sampling(L);
+    VectorT<Scalar> T_sampling(L);
     if (sampling_times_available)
       T_sampling.setConstant(time);
 
     samples = sample_genotypes(L, model, importance_sampling.Tdiff, T_sampling,
                                rng, sampling_times_available);
     importance_sampling.dist = hamming_dist_mat(samples, genotype);
-    // importance_sampling.w = pow(model.get_epsilon(), importance_sampling.dist.array()) *
-    //   pow(1 - model.get_epsilon(), p - importance_sampling.dist.array());
-    VectorXd d = importance_sampling.dist.cast<double>();
-    importance_sampling.w = pow(model.get_epsilon(), d.array()) *
-      pow(1 - model.get_epsilon(), p - d.array());
+    VectorXd log_q_dist(p + 1);
+    for (unsigned int d = 0; d <= p; ++d)
+      log_q_dist[d] = log_bernoulli_process(d, model.get_epsilon(), p);
+    for (unsigned int l = 0; l < L; ++l)
+      importance_sampling.w[l] = log_q_dist[importance_sampling.dist[l]];
+    importance_sampling.log_scale = exp_relative(importance_sampling.w);
   } else if (sampling == "add-remove") {
     MatrixXb samples(L, p);
     VectorXd log_prob_Y_X(L);
@@ -404,45 +527,74 @@ DataImportanceSampling importance_weight(
     unsigned int mutations = genotype.count();
     bool wild_type = (mutations == 0);
     bool resistant_type = (mutations == p);
-    std::vector<int> move(L);
+    Eigen::Vector3d move_prob;
     if (compatible) {
-      if (wild_type) {
+      if (wild_type)
         /* possible moves: add (move 0) or stand-still (move 2) */
-        Eigen::Vector3d weights(0.5, 0.0, 0.5);
-        move = rdiscrete_std(L, weights, rng);
-        log_proposal.setConstant(std::log(0.5));
-      } else if (resistant_type) {
+        move_prob << 0.5, 0.0, 0.5;
+      else if (resistant_type)
         /* possible moves: remove (move 1) or stand-still (move 2) */
-        Eigen::Vector3d weights(0.0, 0.5, 0.5);
-        move = rdiscrete_std(L, weights, rng);
-        log_proposal.setConstant(std::log(0.5));
-      } else {
-        Eigen::Vector3d weights = Eigen::Vector3d::Ones();
-        move = rdiscrete_std(L, weights, rng);
-        log_proposal.setConstant(-std::log(3));
-      }
+        move_prob << 0.0, 0.5, 0.5;
+      else
+        move_prob.setConstant(1.0 / 3);
     } else {
       /* possible moves: add (move 0) or remove (move 1) */
-      Eigen::Vector2d weights = Eigen::Vector2d::Constant(0.5);
-      move = rdiscrete_std(L, weights, rng);
-      log_proposal.setConstant(std::log(0.5));
+      move_prob << 0.5, 0.5, 0.0;
     }
-    double q_choice;
     VectorXd remove_weight = genotype.select(scale_cumulative.transpose(), 0);
     VectorXd add_weight = scale_cumulative.array().inverse();
     add_weight = genotype.select(0, add_weight.transpose());
-    std::vector<int> idx_remove = rdiscrete_std(L, remove_weight, rng);
-    std::vector<int> idx_add = rdiscrete_std(L, add_weight, rng);
 
-    for (unsigned int l = 0; l < L; ++l) {
-      samples.row(l) = draw_sample(genotype, model, move[l], remove_weight,
-                                   add_weight, q_choice, idx_remove[l],
-                                   idx_add[l], compatible);
-      log_proposal[l] += std::log(q_choice);
+    /* There are at most 2p + 1 distinct proposals: add one event, remove one
+     * event or stand still. Draw their multiplicities, such that the closure
+     * and the densities are computed once per distinct proposal
+     */
+    std::vector<int> candidate_move;
+    std::vector<int> candidate_idx;
+    std::vector<double> candidate_prob;
+    for (unsigned int m = 0; m < 3; ++m) {
+      if (move_prob[m] == 0)
+        continue;
+      if (m == 2) {
+        candidate_move.push_back(m);
+        candidate_idx.push_back(-1);
+        candidate_prob.push_back(move_prob[m]);
+        continue;
+      }
+      const VectorXd& event_weight = (m == 0) ? add_weight : remove_weight;
+      const double event_weight_sum = event_weight.sum();
+      for (unsigned int j = 0; j < p; ++j) {
+        if (event_weight[j] > 0) {
+          candidate_move.push_back(m);
+          candidate_idx.push_back(j);
+          candidate_prob.push_back(
+            move_prob[m] * event_weight[j] / event_weight_sum);
+        }
+      }
+    }
+    std::vector<int> counts = rmultinom_std(
+      L, Map<VectorXd>(candidate_prob.data(), candidate_prob.size()), rng);
+
+    double q_choice;
+    unsigned int row = 0;
+    for (unsigned int c = 0; c < counts.size(); ++c) {
+      if (counts[c] == 0)
+        continue;
+      RowVectorXb sample =
+        draw_sample(genotype, model, candidate_move[c], remove_weight,
+                    add_weight, q_choice, candidate_idx[c], candidate_idx[c],
+                    compatible);
+      const unsigned int dist = (sample.array() != genotype.array()).count();
+      samples.middleRows(row, counts[c]) = sample.replicate(counts[c], 1);
+      importance_sampling.dist.segment(row, counts[c]).setConstant(dist);
+      log_prob_Y_X.segment(row, counts[c]).setConstant(
+        log_bernoulli_process(dist, model.get_epsilon(), p));
+      log_proposal.segment(row, counts[c]).setConstant(
+        std::log(move_prob[candidate_move[c]]) + std::log(q_choice));
+      row += counts[c];
     }
-    importance_sampling.dist = hamming_dist_mat(samples, genotype);
 
-    VectorXd T_sampling(L);
+    VectorT<Scalar> T_sampling(L);
     if (sampling_times_available)
       T_sampling.setConstant(time);
 
@@ -450,19 +602,16 @@ DataImportanceSampling importance_weight(
     importance_sampling.Tdiff =
       generate_mutation_times(samples, model, log_proposal, T_sampling, rng,
                               sampling_times_available);
-    log_prob_Y_X =
-      log_bernoulli_process(importance_sampling.dist.cast<double>(),
-                            model.get_epsilon(), p);
     log_prob_X = cbn_density_log(importance_sampling.Tdiff, model.get_lambda());
 
-    importance_sampling.w =
-      (log_prob_Y_X + log_prob_X - log_proposal).array().exp();
+    importance_sampling.w = log_prob_Y_X + log_prob_X - log_proposal;
+    importance_sampling.log_scale = exp_relative(importance_sampling.w);
   } else if (sampling == "pool") {
-    // VectorXd q_prob = pow(model.get_epsilon(), dist_pool.array()) *
-    //   pow(1 - model.get_epsilon(), p - dist_pool.array());
-    VectorXd d_pool = dist_pool.cast<double>();
-    VectorXd q_prob = pow(model.get_epsilon(), d_pool.array()) *
-      pow(1 - model.get_epsilon(), p - d_pool.array());
+    const unsigned int K = dist_pool.size();
+    VectorXd q_dist = bernoulli_table(model.get_epsilon(), p);
+    VectorXd q_prob(K);
+    for (unsigned int k = 0; k < K; ++k)
+      q_prob[k] = q_dist[dist_pool[k]];
     /* In the unlikely event that q_prob is 0 for all samples, default to
      * random sampling
      */
@@ -474,21 +623,29 @@ DataImportanceSampling importance_weight(
     double q_prob_sum = q_prob.sum();
     q_prob /= q_prob_sum;
 
-    /* Draw L samples with replacement and with weights q_prob */
-    std::vector<int> idxs_sample = rdiscrete_std(L, q_prob, rng);
+    /* Draw L samples with replacement and with weights q_prob. The alias
+     * table is kept per thread, so its storage is reused across observations
+     */
+    static thread_local AliasTable table;
+    static thread_local std::vector<int> idxs_sample;
+    table.set_weights(q_prob);
+    idxs_sample.resize(L);
+    table.sample(L, idxs_sample.data(), rng);
     int idx;
     for (unsigned int l = 0; l < L; ++l) {
       idx = idxs_sample[l];
       importance_sampling.dist(l) = dist_pool(idx);
-      importance_sampling.Tdiff.row(l) = Tdiff_pool.row(idx);
+      pool.time_differences(idx, importance_sampling.Tdiff, l);
     }
 
-    if (random)
+    if (random) {
       importance_sampling.w =
-        log_bernoulli_process(importance_sampling.dist.cast<double>(),
-                              model.get_epsilon(), p).array().exp();
-    else
+        log_bernoulli_process(importance_sampling.dist.template cast<double>(),
+                              model.get_epsilon(), p);
+      importance_sampling.log_scale = exp_relative(importance_sampling.w);
+    } else {
       importance_sampling.w.setConstant(q_prob_sum / dist_pool.size());
+    }
   } else if (sampling == "backward") {
     VectorXd log_prob_Y_X(L);
     VectorXd log_prob_X(L);
@@ -512,7 +669,7 @@ DataImportanceSampling importance_weight(
     importance_sampling.dist = dist.replicate(reps, 1);
     log_prob_Y_X = log_prob_Y_X_aux.replicate(reps, 1);
 
-    VectorXd T_sampling(L);
+    VectorT<Scalar> T_sampling(L);
     if (sampling_times_available)
       T_sampling.setConstant(time);
 
@@ -526,45 +683,498 @@ DataImportanceSampling importance_weight(
 
     log_prob_X = cbn_density_log(importance_sampling.Tdiff, model.get_lambda());
 
-    importance_sampling.w =
-      (log_prob_Y_X + log_prob_X - log_proposal).array().exp();
+    importance_sampling.w = log_prob_Y_X + log_prob_X - log_proposal;
     /* Downweight samples that are not feasible / incompatible with current poset */
-    importance_sampling.w = incompatible_samples.select(0, importance_sampling.w);
+    importance_sampling.w = incompatible_samples.select(
+      -std::numeric_limits<double>::infinity(), importance_sampling.w);
+    importance_sampling.log_scale = exp_relative(importance_sampling.w);
+    /* Their time differences can be infinite, notably in single precision,
+     * and they are reset such that they do not contribute to weighted sums
+     */
+    for (unsigned int l = 0; l < L; ++l)
+      if (incompatible_samples[l])
+        importance_sampling.Tdiff.row(l).setZero();
   } else if (sampling == "bernoulli") {
-    VectorXd log_prob_Y_X(L);
     VectorXd log_prob_X(L);
     VectorXd log_proposal = VectorXd::Zero(L);
 
     MatrixXb samples = genotype.replicate(L_aux, 1);
     coin_tossing(samples, model.get_epsilon(), rng);
 
-    VectorXi dist = VectorXi::Zero(L_aux);
-    VectorXd log_prob_Y_X_aux = VectorXd::Zero(L_aux);
-    dist = hamming_dist_mat(samples, genotype);
-
-    MatrixXb samples_rep = samples.replicate(reps, 1);
-    importance_sampling.dist = dist.replicate(reps, 1);
+    /* With small error rates most samples are duplicates. Distances and
+     * compatibility are computed once per distinct sample, and mutation times
+     * are only generated for compatible samples. Incompatible samples are
+     * placed last and get weight 0
+     */
+    std::vector<int> counts;
+    MatrixXb distinct = unique_rows(samples, counts);
+    std::vector<unsigned int> order;
+    std::vector<unsigned int> order_incompatible;
+    for (unsigned int k = 0; k < distinct.rows(); ++k) {
+      if (is_compatible(distinct.row(k), model))
+        order.push_back(k);
+      else
+        order_incompatible.push_back(k);
+    }
+    const unsigned int num_compatible = order.size();
+    order.insert(order.end(), order_incompatible.begin(),
+                 order_incompatible.end());
+
+    VectorXi dist = hamming_dist_mat(distinct, genotype);
+    MatrixXb samples_rep(L, p);
+    unsigned int L_compatible = 0;
+    for (unsigned int c = 0, row = 0; c < order.size(); ++c) {
+      const unsigned int k = order[c];
+      const unsigned int n = counts[k] * reps;
+      samples_rep.middleRows(row, n) = distinct.row(k).replicate(n, 1);
+      importance_sampling.dist.segment(row, n).setConstant(dist[k]);
+      row += n;
+      if (c < num_compatible)
+        L_compatible = row;
+    }
 
-    VectorXd T_sampling(L);
+    VectorT<Scalar> T_sampling(L);
     if (sampling_times_available)
       T_sampling.setConstant(time);
 
     /* Generate mutation times based on samples */
-    importance_sampling.Tdiff =
-      generate_mutation_times(samples_rep, model, log_proposal, T_sampling, rng,
-                              sampling_times_available);
+    importance_sampling.Tdiff.setZero();
+    if (L_compatible > 0) {
+      VectorT<Scalar> T_sampling_compatible = T_sampling.head(L_compatible);
+      VectorXd log_proposal_compatible = VectorXd::Zero(L_compatible);
+      importance_sampling.Tdiff.topRows(L_compatible) =
+        generate_mutation_times(samples_rep.topRows(L_compatible), model,
+                                log_proposal_compatible, T_sampling_compatible,
+                                rng, sampling_times_available);
+      log_proposal.head(L_compatible) = log_proposal_compatible;
+    }
 
     log_prob_X = cbn_density_log(importance_sampling.Tdiff, model.get_lambda());
 
-    importance_sampling.w = (log_prob_X - log_proposal).array().exp();
-    /* Account for incompatible samples and downweight them */
-    Eigen::Matrix<bool, Eigen::Dynamic, 1> incompatible_samples = (importance_sampling.Tdiff.array() < 0.0).rowwise().any();
-    importance_sampling.w = incompatible_samples.select(0, importance_sampling.w);
+    importance_sampling.w = log_prob_X - log_proposal;
+    /* Downweight samples that are incompatible with the current poset */
+    importance_sampling.w.tail(L - L_compatible).setConstant(
+      -std::numeric_limits<double>::infinity());
+    importance_sampling.log_scale = exp_relative(importance_sampling.w);
   }
 
   return importance_sampling;
 }
 
+template DataImportanceSamplingT<double> importance_weight<double>(
+    const RowVectorXb&, unsigned int, const Model&, const double,
+    const std::string&, const VectorXd&, const VectorXi&, const GenotypePool&,
+    const unsigned int, Context::rng_type&, const bool);
+template DataImportanceSamplingT<float> importance_weight<float>(
+    const RowVectorXb&, unsigned int, const Model&, const double,
+    const std::string&, const VectorXd&, const VectorXi&, const GenotypePool&,
+    const unsigned int, Context::rng_type&, const bool);
+
+double ImportanceSums::rescale(const double log_scale_other) {
+  if (w == 0) {
+    log_scale = log_scale_other;
+    return 1.0;
+  }
+  if (log_scale_other > log_scale) {
+    const double factor = std::exp(log_scale - log_scale_other);
+    w *= factor;
+    w_sqrt *= factor * factor;
+    w_dist *= factor;
+    w_Tdiff *= factor;
+    log_scale = log_scale_other;
+    return 1.0;
+  }
+  return std::exp(log_scale_other - log_scale);
+}
+
+/* Sums are accumulated in double precision, regardless of the precision of
+ * the time differences
+ */
+template <typename Scalar>
+void ImportanceSums::add(
+    const DataImportanceSamplingT<Scalar>& importance_sampling) {
+  L += importance_sampling.w.size();
+  L_positive += (importance_sampling.w.array() > 0).count();
+  if (importance_sampling.log_scale == -std::numeric_limits<double>::infinity())
+    return;
+
+  const double factor = rescale(importance_sampling.log_scale);
+  if (factor == 0)
+    return;
+  w += factor * importance_sampling.w.sum();
+  w_sqrt += factor * factor *
+    importance_sampling.w.dot(importance_sampling.w);
+  w_dist += factor *
+    importance_sampling.w.dot(importance_sampling.dist.template cast<double>());
+  w_Tdiff += factor * (importance_sampling.Tdiff.transpose().template cast<double>() *
+    importance_sampling.w);
+}
+
+template void ImportanceSums::add<double>(const DataImportanceSampling&);
+template void ImportanceSums::add<float>(
+    const DataImportanceSamplingT<float>&);
+
+void ImportanceSums::merge(const ImportanceSums& other) {
+  L += other.L;
+  L_positive += other.L_positive;
+  if (other.w == 0)
+    return;
+
+  const double factor = rescale(other.log_scale);
+  w += factor * other.w;
+  w_sqrt += factor * factor * other.w_sqrt;
+  w_dist += factor * other.w_dist;
+  w_Tdiff += factor * other.w_Tdiff;
+}
+
+/* Maximum number of entries of the matrix of proposal probabilities and of
+ * the matrix of time differences held for a block of the pool (8 MB each)
+ */
+static const unsigned int POOL_GEMM_ELEMENTS = 1048576;
+
+//' C += A * B, computed by the BLAS library the package is linked against
+//'
+//' @noRd
+static void gemm_accumulate(const MatrixXd& A, const MatrixXd& B,
+                            MatrixXd& C) {
+  const int m = A.rows();
+  const int n = B.cols();
+  const int k = A.cols();
+  if (m == 0 || n == 0 || k == 0)
+    return;
+  const double one = 1.0;
+  F77_CALL(dgemm)("N", "N", &m, &n, &k, &one, A.data(), &m, B.data(), &k,
+                  &one, C.data(), &m FCONE FCONE);
+}
+
+//' Rao-Blackwellized estimator for the pool scheme. Rather than resampling L
+//' genotypes of the pool with probabilities proportional to
+//' q_k = eps^d_k (1 - eps)^(p - d_k), the sums of the importance weights are
+//' replaced by their expectation over the pool. For all observations at once,
+//' the weighted sums of the time differences amount to the product of the
+//' N x K matrix of q_k and the K x p matrix of time differences, which is
+//' computed in blocks of the pool. The q_k are computed in log space and
+//' taken relative to the largest weight seen for each observation, such that
+//' the sums remain finite if eps is 0 or no genotype of the pool is close to
+//' an observation
+//'
+//' @noRd
+static std::vector<ImportanceSums> pool_importance_sums(
+    const MatrixXb& obs, const unsigned int L, const Model& model,
+    const VectorXd& times, const GenotypePool& pool,
+    const bool sampling_times_available, const unsigned int thrds,
+    Context& ctx) {
+
+  const vertices_size_type p = model.size();
+  const unsigned int N = obs.rows();
+  const unsigned int K = pool.size();
+
+  /* log q_k only depends on the Hamming distance */
+  VectorXd log_q_dist(p + 1);
+  for (unsigned int d = 0; d <= p; ++d)
+    log_q_dist[d] = log_bernoulli_process(d, model.get_epsilon(), p);
+
+  const unsigned int block_size = std::max(
+    std::min(K, POOL_GEMM_ELEMENTS / std::max({N, (unsigned int) p, 1u})), 1u);
+  const unsigned int num_ranges = std::max(std::min(N, 4 * thrds), 1u);
+  auto rngs = ctx.get_auxiliary_rngs(num_ranges);
+
+  VectorXd q_sum = VectorXd::Zero(N);
+  VectorXd q_dist_sum = VectorXd::Zero(N);
+  VectorXd log_scale =
+    VectorXd::Constant(N, -std::numeric_limits<double>::infinity());
+  MatrixXd q_Tdiff = MatrixXd::Zero(N, p);
+  MatrixXd Q;
+  MatrixXd Tdiff_block;
+  for (unsigned int first = 0; first < K; first += block_size) {
+    const unsigned int n = std::min(block_size, K - first);
+
+    /* Proposal probabilities of the block for every observation.
+     * Observations are split into contiguous ranges, each of them with its
+     * own random number stream for the sampling times
+     */
+    Q.resize(N, n);
+    parallel_for(num_ranges, thrds, [&](const unsigned int r) {
+      const unsigned int first_obs = (unsigned long long) r * N / num_ranges;
+      const unsigned int last_obs = (unsigned long long) (r + 1) * N / num_ranges;
+      VectorXd T_sampling(n);
+      std::vector<int> dist(n);
+      for (unsigned int i = first_obs; i < last_obs; ++i) {
+        if (sampling_times_available)
+          T_sampling.setConstant(times[i]);
+        else
+          T_sampling = rexp(n, model.get_lambda_s(), (*rngs)[r]);
+        pool.hamming_dist(obs.row(i), first, T_sampling, dist.data());
+        /* Move the running sums of the observation to the largest weight of
+         * the block, if it exceeds the current scale. Row i of q_Tdiff is
+         * only touched by this range until the product below
+         */
+        double log_scale_block = log_scale[i];
+        for (unsigned int k = 0; k < n; ++k)
+          log_scale_block = std::max(log_scale_block, log_q_dist[dist[k]]);
+        if (log_scale_block > log_scale[i]) {
+          const double factor = std::exp(log_scale[i] - log_scale_block);
+          q_sum[i] *= factor;
+          q_dist_sum[i] *= factor;
+          q_Tdiff.row(i) *= factor;
+          log_scale[i] = log_scale_block;
+        }
+        for (unsigned int k = 0; k < n; ++k) {
+          const double q = std::exp(log_q_dist[dist[k]] - log_scale[i]);
+          Q(i, k) = q;
+          q_sum[i] += q;
+          q_dist_sum[i] += q * dist[k];
+        }
+      }
+    });
+
+    Tdiff_block.resize(n, p);
+    for (unsigned int k = 0; k < n; ++k)
+      pool.time_differences(first + k, Tdiff_block, k);
+    gemm_accumulate(Q, Tdiff_block, q_Tdiff);
+  }
+
+  /* Each of the L samples has the importance weight q_sum / K, and it is
+   * drawn with probability q_k / q_sum. Weights are relative to
+   * exp(log_scale)
+   */
+  std::vector<ImportanceSums> sums(N, ImportanceSums(p));
+  const double scale = (double) L / K;
+  for (unsigned int i = 0; i < N; ++i) {
+    sums[i].w = scale * q_sum[i];
+    sums[i].w_sqrt = L * std::pow(q_sum[i] / K, 2);
+    sums[i].w_dist = scale * q_dist_sum[i];
+    sums[i].w_Tdiff = scale * q_Tdiff.row(i).transpose();
+    sums[i].log_scale = q_sum[i] > 0 ? log_scale[i] : 0.0;
+    sums[i].L = L;
+    sums[i].L_positive = q_sum[i] > 0 ? L : 0;
+  }
+  return sums;
+}
+
+/* Minimum number of samples per block */
+static const unsigned int MIN_SAMPLE_BLOCK = 256;
+
+/* Number of samples generated at once within a block. Samples are folded
+ * into the running sums chunk by chunk, such that at most one chunk of
+ * time differences is held per thread
+ */
+static const unsigned int SAMPLE_CHUNK = 512;
+
+//' Number of blocks in which the samples of an observation are split, such
+//' that observations x blocks provide enough tasks to keep all threads busy
+//'
+//' @noRd
+unsigned int num_sample_blocks(const unsigned int N, const unsigned int L,
+                               const unsigned int thrds) {
+  const unsigned int num_tasks = 4 * thrds;
+  if (thrds <= 1 || N >= num_tasks)
+    return 1;
+  const unsigned int num_blocks = (num_tasks + N - 1) / N;
+  return std::max(std::min(num_blocks, L / MIN_SAMPLE_BLOCK), 1u);
+}
+
+//' Compute the partial sums of the importance weights for all observations.
+//' If there are fewer observations than threads, the samples of each
+//' observation are split into blocks, and the work is distributed over
+//' observations x blocks. Blocks are drawn from their own random number
+//' streams and merged in a fixed order, such that results do not depend on
+//' the scheduling of the threads. Within a block, samples are generated and
+//' accumulated in chunks of SAMPLE_CHUNK samples
+//'
+//' @noRd
+std::vector<ImportanceSums> importance_sums(
+    const MatrixXb& obs, const unsigned int L, const Model& model,
+    const VectorXd& times, const std::string& sampling,
+    const VectorXd& scale_cumulative, const GenotypePool& pool,
+    const unsigned int neighborhood_dist, const bool sampling_times_available,
+    const unsigned int thrds, Context& ctx, const bool single_precision) {
+
+  if (sampling == "pool")
+    return pool_importance_sums(obs, L, model, times, pool,
+                                sampling_times_available, thrds, ctx);
+
+  const vertices_size_type p = model.size();
+  const unsigned int N = obs.rows();
+  /* Backward sampling enumerates the neighborhood of the observation */
+  unsigned int num_blocks = 1;
+  if (sampling != "backward")
+    num_blocks = num_sample_blocks(N, L, thrds);
+  std::vector<ImportanceSums> partial_sums(N * num_blocks, ImportanceSums(p));
+
+  /* Backward sampling uses L / |neighborhood| copies of the neighborhood, so
+   * chunks hold whole copies
+   */
+  unsigned int neighborhood_size = 1;
+  if (sampling == "backward") {
+    neighborhood_size = 0;
+    for (unsigned int d = 0; d <= neighborhood_dist; ++d)
+      neighborhood_size += n_choose_k(p, d);
+  }
+  const unsigned int chunk_size =
+    std::max(SAMPLE_CHUNK / neighborhood_size, 1u) * neighborhood_size;
+
+  auto block_sums = [&](const unsigned int t, Context::rng_type& rng) {
+    const unsigned int i = t / num_blocks;
+    const unsigned int b = t % num_blocks;
+    unsigned int L_block = L / num_blocks + (b < L % num_blocks);
+    if (L_block >= neighborhood_size)
+      L_block -= L_block % neighborhood_size;
+    VectorXi d_pool;
+    for (unsigned int l = 0; l < L_block; l += chunk_size) {
+      const unsigned int L_chunk = std::min(chunk_size, L_block - l);
+      if (single_precision)
+        partial_sums[t].add(importance_weight<float>(
+          obs.row(i), L_chunk, model, times[i], sampling, scale_cumulative,
+          d_pool, pool, neighborhood_dist, rng, sampling_times_available));
+      else
+        partial_sums[t].add(importance_weight<double>(
+          obs.row(i), L_chunk, model, times[i], sampling, scale_cumulative,
+          d_pool, pool, neighborhood_dist, rng, sampling_times_available));
+    }
+  };
+
+  if (num_blocks == 1) {
+    /* Observations are split into contiguous ranges, each of them with its
+     * own random number stream
+     */
+    const unsigned int num_ranges = std::max(std::min(N, 4 * thrds), 1u);
+    auto rngs = ctx.get_auxiliary_rngs(num_ranges);
+    parallel_for(num_ranges, thrds, [&](const unsigned int r) {
+      const unsigned int first = (unsigned long long) r * N / num_ranges;
+      const unsigned int last = (unsigned long long) (r + 1) * N / num_ranges;
+      for (unsigned int i = first; i < last; ++i)
+        block_sums(i, (*rngs)[r]);
+    });
+    return partial_sums;
+  }
+
+  const int seed = ctx.rng();
+  parallel_for(N * num_blocks, thrds, [&](const unsigned int t) {
+    Context::rng_type rng(chunk_seed(seed, t));
+    block_sums(t, rng);
+  });
+
+  /* Merge blocks in order */
+  std::vector<ImportanceSums> sums(N, ImportanceSums(p));
+  for (unsigned int i = 0; i < N; ++i)
+    for (unsigned int b = 0; b < num_blocks; ++b)
+      sums[i].merge(partial_sums[i * num_blocks + b]);
+  return sums;
+}
+
+//' Log complete-data density of the samples, log P(Y | X, eps) +
+//' log f(T | lambda)
+//'
+//' @noRd
+template <typename Scalar>
+static VectorXd complete_log_density(
+    const DataImportanceSamplingT<Scalar>& data, const Model& model) {
+  return log_bernoulli_process(data.dist.template cast<double>(),
+                               model.get_epsilon(), model.size()) +
+    cbn_density_log<Scalar>(data.Tdiff, model.get_lambda());
+}
+
+//' Effective sample size, (sum w)^2 / sum w^2
+//'
+//' @noRd
+static double effective_sample_size(const VectorXd& w) {
+  const double w_sqrt = w.squaredNorm();
+  if (w_sqrt == 0)
+    return 0.0;
+  return std::pow(w.sum(), 2) / w_sqrt;
+}
+
+//' Compute the partial sums of the importance weights for all observations,
+//' recycling the samples of previous EM iterations. The proposal densities of
+//' the samples do not depend on the current parameters, such that the weights
+//' are updated by the ratio of complete-data densities. Samples of an
+//' observation are redrawn when their effective sample size drops below
+//' 'recycle_ess' times their effective sample size at the time they were
+//' drawn. Proposals with a high variance of the weights thus recycle their
+//' samples as well. Recycled samples are kept in the precision of the
+//' sampling kernels
+//'
+//' @noRd
+//' @param memory_budget memory budget (in MB) of the recycled samples
+//' (0: no budget). Samples are only kept for as many observations as fit into
+//' the budget, while the samples of the remaining observations are redrawn in
+//' every iteration
+template <typename Scalar>
+std::vector<ImportanceSums> recycled_importance_sums(
+    const MatrixXb& obs, const unsigned int L, const Model& model,
+    const VectorXd& times, const std::string& sampling,
+    const VectorXd& scale_cumulative, const unsigned int neighborhood_dist,
+    const bool sampling_times_available, const double recycle_ess,
+    const double memory_budget,
+    std::vector< RecycledSamplesT<Scalar> >& samples,
+    const unsigned int thrds, Context& ctx) {
+
+  const vertices_size_type p = model.size();
+  const unsigned int N = obs.rows();
+  std::vector<ImportanceSums> sums(N, ImportanceSums(p));
+  unsigned int N_recycled = N;
+  if (memory_budget > 0)
+    N_recycled = (unsigned int) std::min((double) N, std::floor(
+      memory_budget * 1024 * 1024 / RecycledSamplesT<Scalar>::memory(L, p)));
+  samples.resize(N_recycled);
+
+  /* Observations are split into contiguous ranges, each of them with its own
+   * random number stream
+   */
+  const unsigned int num_ranges = std::max(std::min(N, 4 * thrds), 1u);
+  auto rngs = ctx.get_auxiliary_rngs(num_ranges);
+  parallel_for(num_ranges, thrds, [&](const unsigned int r) {
+    const unsigned int first = (unsigned long long) r * N / num_ranges;
+    const unsigned int last = (unsigned long long) (r + 1) * N / num_ranges;
+    VectorXi d_pool;
+    GenotypePool pool;
+    for (unsigned int i = first; i < last; ++i) {
+      if (i >= N_recycled) {
+        sums[i].add(importance_weight<Scalar>(
+          obs.row(i), L, model, times[i], sampling, scale_cumulative, d_pool,
+          pool, neighborhood_dist, (*rngs)[r], sampling_times_available));
+        continue;
+      }
+
+      RecycledSamplesT<Scalar>& recycled = samples[i];
+      bool redraw = recycled.empty();
+      if (!redraw) {
+        recycled.data.w =
+          complete_log_density(recycled.data, model) - recycled.log_proposal;
+        recycled.data.log_scale = exp_relative(recycled.data.w);
+        redraw = effective_sample_size(recycled.data.w) < recycled.ess_min;
+      }
+
+      if (redraw) {
+        recycled.data = importance_weight<Scalar>(
+          obs.row(i), L, model, times[i], sampling, scale_cumulative, d_pool,
+          pool, neighborhood_dist, (*rngs)[r], sampling_times_available);
+        /* log w = log p(X, Y) - log q(X). Samples with weight 0 get an
+         * infinite log proposal density and keep weight 0
+         */
+        recycled.log_proposal = complete_log_density(recycled.data, model) -
+          (recycled.data.w.array().log() + recycled.data.log_scale).matrix();
+        recycled.ess_min =
+          recycle_ess * effective_sample_size(recycled.data.w);
+      }
+      sums[i].add(recycled.data);
+    }
+  });
+  return sums;
+}
+
+template std::vector<ImportanceSums> recycled_importance_sums<double>(
+    const MatrixXb&, const unsigned int, const Model&, const VectorXd&,
+    const std::string&, const VectorXd&, const unsigned int, const bool,
+    const double, const double, std::vector<RecycledSamples>&,
+    const unsigned int, Context&);
+template std::vector<ImportanceSums> recycled_importance_sums<float>(
+    const MatrixXb&, const unsigned int, const Model&, const VectorXd&,
+    const std::string&, const VectorXd&, const unsigned int, const bool,
+    const double, const double, std::vector< RecycledSamplesT<float> >&,
+    const unsigned int, Context&);
+
 //' Compute importance weights and sufficient statistics by sampling
 //'
 //' @noRd
@@ -588,8 +1198,12 @@ double MCEM_hcbn(
   double expected_dist = 0.0;
   MatrixXd expected_Tdiff = MatrixXd::Zero(N, p);
   VectorXd Tdiff_colsum(p);
-  MatrixXd Tdiff_pool;
+  GenotypePool pool;
   VectorXd scale_cumulative;
+  /* The pool scheme already shares its samples across observations */
+  const bool recycle = control_EM.recycle_ess > 0 && sampling != "pool";
+  std::vector<RecycledSamples> recycled;
+  std::vector< RecycledSamplesT<float> > recycled_single;
 
   if (sampling == "add-remove") {
     scale_cumulative.resize(p);
@@ -603,10 +1217,12 @@ double MCEM_hcbn(
     //   K = p * L;
     // }
     /* Number of samples for weighted/pool sampling */
-    K = p * L;
-    Tdiff_pool.resize(K, p);
+    K = GenotypePool::capped_size(p * L, p, control_EM.pool_memory,
+                                  control_EM.single_precision);
+    pool = GenotypePool(model, K, control_EM.single_precision);
     if (ctx.get_verbose())
-      std::cout << "Size of the genotype pool: " << K << std::endl;
+      std::cout << "Size of the genotype pool: " << K << " ("
+                << pool.memory() / (1024.0 * 1024.0) << " MB)" << std::endl;
   }
 
   if (ctx.get_verbose()) {
@@ -618,7 +1234,6 @@ double MCEM_hcbn(
 
   for (unsigned int iter = 0; iter < control_EM.max_iter; ++iter) {
 
-    MatrixXd T_pool;
     if (iter == update_step_size) {
       avg_lambda_current /= control_EM.update_step_size;
       avg_eps_current /= control_EM.update_step_size;
@@ -649,49 +1264,43 @@ double MCEM_hcbn(
       scale_cumulative = scale_path_to_mutation(model);
     } else if (sampling == "pool") {
       /* All threads share the same pool of mutation times */
-      T_pool.resize(K, p);
-      T_pool = sample_times(K, model, Tdiff_pool, ctx.rng);
+      pool.sample(model, ctx.rng);
     }
 
     N_eff = 0;
     obs_llhood = 0.0;
     expected_dist = 0.0;
 
-    #ifdef _OPENMP
-      omp_set_num_threads(thrds);
-    #endif
-    auto rngs = ctx.get_auxiliary_rngs(thrds);
+    std::vector<ImportanceSums> sums;
+    if (recycle && control_EM.single_precision)
+      sums = recycled_importance_sums<float>(
+        obs, L, model, times, sampling, scale_cumulative,
+        control_EM.neighborhood_dist, sampling_times_available,
+        control_EM.recycle_ess, control_EM.pool_memory, recycled_single,
+        thrds, ctx);
+    else if (recycle)
+      sums = recycled_importance_sums<double>(
+        obs, L, model, times, sampling, scale_cumulative,
+        control_EM.neighborhood_dist, sampling_times_available,
+        control_EM.recycle_ess, control_EM.pool_memory, recycled, thrds,
+        ctx);
+    else
+      sums = importance_sums(
+        obs, L, model, times, sampling, scale_cumulative, pool,
+        control_EM.neighborhood_dist, sampling_times_available, thrds, ctx,
+        control_EM.single_precision);
 
-    #pragma omp parallel for reduction(+:obs_llhood) reduction(+:expected_dist) reduction(+:N_eff) schedule(static)
     for (unsigned int i = 0; i < N; ++i) {
-      VectorXi d_pool;
-      if (sampling == "pool") {
-        VectorXd T_sampling(K);
-        if (sampling_times_available)
-          T_sampling.setConstant(times(i));
-
-        MatrixXb genotype_pool =
-          generate_genotypes(T_pool, model, T_sampling, (*rngs)[omp_get_thread_num()],
-                             sampling_times_available);
-        d_pool = hamming_dist_mat(genotype_pool, obs.row(i));
-      }
-      DataImportanceSampling importance_sampling = importance_weight(
-        obs.row(i), L, model, times(i), sampling, scale_cumulative, d_pool,
-        Tdiff_pool, control_EM.neighborhood_dist, (*rngs)[omp_get_thread_num()],
-        sampling_times_available);
-
-      double aux = importance_sampling.w.sum();
+      double aux = sums[i].w;
       if (aux > 0) {
         /* Only consider observations with at least one feasible sample */
         N_eff += weights(i);
-        int L_eff = L;
+        int L_eff = sums[i].L;
         if (sampling == "backward")
-          L_eff = (importance_sampling.w.array() > 0).count();
-        obs_llhood += weights(i) * std::log(aux / L_eff);
-        expected_dist += weights(i) *
-          importance_sampling.w.dot(importance_sampling.dist.cast<double>()) / aux;
-        expected_Tdiff.row(i) =
-          (importance_sampling.Tdiff.transpose() * importance_sampling.w) / aux;
+          L_eff = sums[i].L_positive;
+        obs_llhood += weights(i) * (sums[i].log_w() - std::log(L_eff));
+        expected_dist += weights(i) * sums[i].w_dist / aux;
+        expected_Tdiff.row(i) = sums[i].w_Tdiff / aux;
       } else {
           /* Alternative: add a large negative number to obs_llhood? */
           throw std::runtime_error(
@@ -762,8 +1371,9 @@ RcppExport SEXP _complete_log_likelihood(
 RcppExport SEXP _obs_log_likelihood(
     SEXP obsSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP epsSEXP,
     SEXP weightsSEXP, SEXP timesSEXP, SEXP LSEXP, SEXP samplingSEXP,
-    SEXP neighborhood_distSEXP, SEXP lambda_sSEXP,
-    SEXP sampling_times_availableSEXP, SEXP thrdsSEXP, SEXP seedSEXP) {
+    SEXP neighborhood_distSEXP, SEXP lambda_sSEXP, SEXP pool_memorySEXP,
+    SEXP single_precisionSEXP, SEXP sampling_times_availableSEXP,
+    SEXP thrdsSEXP, SEXP seedSEXP) {
 
   using namespace Rcpp;
   try {
@@ -778,15 +1388,22 @@ RcppExport SEXP _obs_log_likelihood(
     const std::string& sampling = as<std::string>(samplingSEXP);
     const unsigned int neighborhood_dist = as<unsigned int>(neighborhood_distSEXP);
     const float lambda_s = as<float>(lambda_sSEXP);
+    const double pool_memory = as<double>(pool_memorySEXP);
+    const bool single_precision = as<bool>(single_precisionSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
     const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
 
+    ControlEM control_EM;
+    control_EM.neighborhood_dist = neighborhood_dist;
+    control_EM.pool_memory = pool_memory;
+    control_EM.single_precision = single_precision;
+
     // Call the underlying C++ function
     Context ctx(seed);
     double llhood = obs_log_likelihood(
-      obs, poset, lambda, eps, weights, times, L, sampling, neighborhood_dist,
-      ctx, lambda_s, sampling_times_available, thrds);
+      obs, poset, lambda, eps, weights, times, L, sampling, control_EM, ctx,
+      lambda_s, sampling_times_available, thrds);
 
     // Return the result as a SEXP
     return wrap( llhood );
@@ -806,6 +1423,7 @@ RcppExport SEXP _MCEM_hcbn(
     SEXP lambda_sSEXP, SEXP epsSEXP, SEXP weightsSEXP, SEXP LSEXP,
     SEXP samplingSEXP, SEXP max_iterSEXP, SEXP update_step_sizeSEXP,
     SEXP tolSEXP, SEXP max_lambdaSEXP, SEXP neighborhood_distSEXP,
+    SEXP pool_memorySEXP, SEXP single_precisionSEXP, SEXP recycle_essSEXP,
     SEXP sampling_times_availableSEXP, SEXP thrdsSEXP, SEXP verboseSEXP,
     SEXP seedSEXP) {
 
@@ -826,6 +1444,9 @@ RcppExport SEXP _MCEM_hcbn(
     const double tol = as<double>(tolSEXP);
     const float max_lambda = as<float>(max_lambdaSEXP);
     const unsigned int neighborhood_dist = as<unsigned int>(neighborhood_distSEXP);
+    const double pool_memory = as<double>(pool_memorySEXP);
+    const bool single_precision = as<bool>(single_precisionSEXP);
+    const double recycle_ess = as<double>(recycle_essSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
     const int thrds = as<int>(thrdsSEXP);
     const bool verbose = as<bool>(verboseSEXP);
@@ -845,8 +1466,9 @@ RcppExport SEXP _MCEM_hcbn(
       throw not_acyclic_exception();
     M.topological_sort();
 
-    ControlEM control_EM(max_iter, update_step_size, tol, max_lambda, 
-                         neighborhood_dist);
+    ControlEM control_EM(max_iter, update_step_size, tol, max_lambda,
+                         neighborhood_dist, pool_memory, single_precision,
+                         recycle_ess);
 
     /* Call the underlying C++ function */
     Context ctx(seed, verbose);
@@ -867,7 +1489,8 @@ RcppExport SEXP _importance_weight_genotype(
     SEXP genotypeSEXP, SEXP LSEXP, SEXP posetSEXP, SEXP lambdaSEXP,
     SEXP epsSEXP, SEXP timeSEXP, SEXP samplingSEXP, SEXP scale_cumulativeSEXP,
     SEXP d_poolSEXP, SEXP Tdiff_poolSEXP, SEXP neighborhood_distSEXP,
-    SEXP lambda_sSEXP, SEXP sampling_times_availableSEXP, SEXP seedSEXP) {
+    SEXP lambda_sSEXP, SEXP sampling_times_availableSEXP, SEXP thrdsSEXP,
+    SEXP seedSEXP) {
 
   using namespace Rcpp;
   try {
@@ -885,6 +1508,7 @@ RcppExport SEXP _importance_weight_genotype(
     const unsigned int neighborhood_dist = as<unsigned int>(neighborhood_distSEXP);
     const float lambda_s = as<float>(lambda_sSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
 
     const auto p = poset.rows(); // Number of mutations / events
@@ -897,11 +1521,43 @@ RcppExport SEXP _importance_weight_genotype(
       throw not_acyclic_exception();
     M.topological_sort();
 
-    /* Call the underlying C++ function */
+    GenotypePool pool;
+    if (sampling == "pool") {
+      pool = GenotypePool(M, Tdiff_pool.rows());
+      pool.set_time_differences(Tdiff_pool);
+    }
+
+    /* Split the samples into blocks, which are drawn in parallel from their
+     * own random number streams and concatenated in order
+     */
     Context ctx(seed);
-    DataImportanceSampling w = importance_weight(
-      genotype, L, M, time, sampling, scale_cumulative, d_pool, Tdiff_pool,
-      neighborhood_dist, ctx.rng, sampling_times_available);
+    unsigned int num_blocks = 1;
+    if (sampling != "backward")
+      num_blocks = num_sample_blocks(1, L, thrds);
+    std::vector<DataImportanceSampling> blocks(num_blocks,
+                                               DataImportanceSampling(0, p));
+    const int block_seed = ctx.rng();
+
+    parallel_for(num_blocks, thrds, [&](const unsigned int b) {
+      Context::rng_type rng(chunk_seed(block_seed, b));
+      const unsigned int L_block = L / num_blocks + (b < L % num_blocks);
+      /* Call the underlying C++ function */
+      blocks[b] = importance_weight(
+        genotype, L_block, M, time, sampling, scale_cumulative, d_pool, pool,
+        neighborhood_dist, rng, sampling_times_available);
+    });
+
+    unsigned int L_total = 0;
+    for (unsigned int b = 0; b < num_blocks; ++b)
+      L_total += blocks[b].w.size();
+    DataImportanceSampling w(L_total, p);
+    for (unsigned int b = 0, l = 0; b < num_blocks; ++b) {
+      const unsigned int L_block = blocks[b].w.size();
+      w.w.segment(l, L_block) = blocks[b].w * std::exp(blocks[b].log_scale);
+      w.dist.segment(l, L_block) = blocks[b].dist;
+      w.Tdiff.middleRows(l, L_block) = blocks[b].Tdiff;
+      l += L_block;
+    }
 
     /* Return the result as a SEXP */
     return List::create(_["w"]=w.w, _["dist"]=w.dist, _["Tdiff"]=w.Tdiff);
@@ -914,8 +1570,8 @@ RcppExport SEXP _importance_weight_genotype(
 RcppExport SEXP _importance_weight(
     SEXP obsSEXP, SEXP LSEXP, SEXP posetSEXP, SEXP lambdaSEXP,
     SEXP epsSEXP, SEXP timesSEXP, SEXP samplingSEXP, SEXP neighborhood_distSEXP,
-    SEXP lambda_sSEXP, SEXP sampling_times_availableSEXP, SEXP thrdsSEXP,
-    SEXP seedSEXP) {
+    SEXP lambda_sSEXP, SEXP pool_memorySEXP, SEXP single_precisionSEXP,
+    SEXP sampling_times_availableSEXP, SEXP thrdsSEXP, SEXP seedSEXP) {
 
   using namespace Rcpp;
   try {
@@ -929,6 +1585,8 @@ RcppExport SEXP _importance_weight(
     const std::string& sampling = as<std::string>(samplingSEXP);
     const unsigned int neighborhood_dist = as<unsigned int>(neighborhood_distSEXP);
     const float lambda_s = as<float>(lambda_sSEXP);
+    const double pool_memory = as<double>(pool_memorySEXP);
+    const bool single_precision = as<bool>(single_precisionSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
     const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
@@ -950,50 +1608,30 @@ RcppExport SEXP _importance_weight(
     M.topological_sort();
 
     Context ctx(seed);
-    unsigned int K = 0;
-    MatrixXd Tdiff_pool;
-    MatrixXd T_pool;
+    GenotypePool pool;
     std::vector<int> L_eff(N);
     if (sampling == "add-remove") {
       scale_cumulative.resize(p);
       scale_cumulative = scale_path_to_mutation(M);
     } else if (sampling == "pool") {
-      K = p * L;
-      Tdiff_pool.resize(K, p);
-      T_pool.resize(K, p);
-      T_pool = sample_times(K, M, Tdiff_pool, ctx.rng);
+      const unsigned int K = GenotypePool::capped_size(
+        p * L, p, pool_memory, single_precision);
+      pool = GenotypePool(M, K, single_precision);
+      pool.sample(M, ctx.rng);
     }
 
-    #ifdef _OPENMP
-    omp_set_num_threads(thrds);
-    #endif
-    auto rngs = ctx.get_auxiliary_rngs(thrds);
+    /* Call the underlying C++ function */
+    std::vector<ImportanceSums> sums = importance_sums(
+      obs, L, M, times, sampling, scale_cumulative, pool, neighborhood_dist,
+      sampling_times_available, thrds, ctx, single_precision);
 
-    #pragma omp parallel for schedule(static)
     for (unsigned int i = 0; i < N; ++i) {
-      VectorXi d_pool;
-      if (sampling == "pool") {
-        VectorXd T_sampling(K);
-        if (sampling_times_available)
-          T_sampling.setConstant(times[i]);
-
-        MatrixXb genotype_pool =
-          generate_genotypes(T_pool, M, T_sampling, (*rngs)[omp_get_thread_num()],
-                             sampling_times_available);
-        d_pool = hamming_dist_mat(genotype_pool, obs.row(i));
-      }
-      /* Call the underlying C++ function */
-      DataImportanceSampling w = importance_weight(
-        obs.row(i), L, M, times(i), sampling, scale_cumulative, d_pool,
-        Tdiff_pool, neighborhood_dist, (*rngs)[omp_get_thread_num()],
-        sampling_times_available);
-
       if (sampling == "backward" || sampling == "bernoulli")
-        L_eff[i] = (w.w.array() > 0).count();
-      w_sum[i] = w.w.sum();
-      w_sum_sqrt[i] = w.w.dot(w.w);
-      expected_dist[i] = w.w.dot(w.dist.cast<double>()) / w_sum[i];
-      expected_Tdiff.row(i) = (w.Tdiff.transpose() * w.w) / w_sum[i];
+        L_eff[i] = sums[i].L_positive;
+      w_sum[i] = sums[i].w * std::exp(sums[i].log_scale);
+      w_sum_sqrt[i] = sums[i].w_sqrt * std::exp(2 * sums[i].log_scale);
+      expected_dist[i] = sums[i].w_dist / sums[i].w;
+      expected_Tdiff.row(i) = sums[i].w_Tdiff / sums[i].w;
     }
 
     /* Return the result as a SEXP */
@@ -1010,8 +1648,9 @@ RcppExport SEXP _importance_weight(
 }
 
 RcppExport SEXP _sample_genotypes(
-    SEXP NSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP T_eventsSEXP,
-    SEXP T_samplingSEXP, SEXP lambda_sSEXP, SEXP sampling_times_availableSEXP,
+    SEXP NSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP T_samplingSEXP,
+    SEXP sampling_times_availableSEXP, SEXP samplingSEXP,
+    SEXP sampling_paramSEXP, SEXP chunk_sizeSEXP, SEXP thrdsSEXP,
     SEXP seedSEXP) {
 
   using namespace Rcpp;
@@ -1020,28 +1659,38 @@ RcppExport SEXP _sample_genotypes(
     const unsigned int N = as<unsigned int>(NSEXP);
     const MapMati poset(as<MapMati>(posetSEXP));
     const MapVecd lambda(as<MapVecd>(lambdaSEXP));
-    MatrixXd T_events = as<MapMatd>(T_eventsSEXP);
     VectorXd T_sampling = as<MapVecd>(T_samplingSEXP);
-    const float lambda_s = as<float>(lambda_sSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const std::string& sampling = as<std::string>(samplingSEXP);
+    const double sampling_param = as<double>(sampling_paramSEXP);
+    const int chunk_size = as<int>(chunk_sizeSEXP);
+    const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
 
+    if (chunk_size < 1)
+      throw std::runtime_error("ERROR: chunk size must be at least one");
+
     const auto p = poset.rows(); // Number of mutations / events
     edge_container edge_list = adjacency_mat2list(poset);
-    Model M(edge_list, p, lambda_s);
+    Model M(edge_list, p);
     M.set_lambda(lambda);
     M.has_cycles();
     if (M.cycle)
       throw not_acyclic_exception();
     M.topological_sort();
 
+    SamplingTimeDistribution dist(sampling, sampling_param);
+
     /* Call the underlying C++ function */
-    Context ctx(seed);
-    MatrixXb samples = sample_genotypes(N, M, T_events, T_sampling, ctx.rng,
-                                        sampling_times_available);
+    MatrixXb samples;
+    MatrixXd T_events, T_events_sum;
+    sample_genotypes_chunked(N, M, dist, chunk_size, seed, thrds, samples,
+                             T_events, T_events_sum, T_sampling,
+                             sampling_times_available);
 
     /* Return the result as a SEXP*/
     return List::create(_["samples"]=samples, _["Tdiff"]=T_events,
+                        _["mutation_times"]=T_events_sum,
                         _["sampling_time"]=T_sampling);
   } catch  (...) {
     handle_exceptions();
@@ -1050,8 +1699,8 @@ RcppExport SEXP _sample_genotypes(
 }
 
 RcppExport SEXP _sample_times(
-    SEXP NSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP T_eventsSEXP,
-    SEXP seedSEXP) {
+    SEXP NSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP chunk_sizeSEXP,
+    SEXP thrdsSEXP, SEXP seedSEXP) {
 
   using namespace Rcpp;
   try {
@@ -1059,9 +1708,13 @@ RcppExport SEXP _sample_times(
     const unsigned int N = as<unsigned int>(NSEXP);
     const MapMati poset(as<MapMati>(posetSEXP));
     const MapVecd lambda(as<MapVecd>(lambdaSEXP));
-    MatrixXd T_events = as<MapMatd>(T_eventsSEXP);
+    const int chunk_size = as<int>(chunk_sizeSEXP);
+    const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
 
+    if (chunk_size < 1)
+      throw std::runtime_error("ERROR: chunk size must be at least one");
+
     const auto p = poset.rows(); // Number of mutations / events
     edge_container edge_list = adjacency_mat2list(poset);
     Model M(edge_list, p);
@@ -1072,8 +1725,8 @@ RcppExport SEXP _sample_times(
     M.topological_sort();
 
     /* Call the underlying C++ function */
-    Context ctx(seed);
-    MatrixXd times = sample_times(N, M, T_events, ctx.rng);
+    MatrixXd T_events, times;
+    sample_times_chunked(N, M, chunk_size, seed, thrds, T_events, times);
 
     /* Return the result as a SEXP */
     return List::create(_["mutation_times"]=times, _["Tdiff"]=T_events);
@@ -1085,7 +1738,9 @@ RcppExport SEXP _sample_times(
 
 RcppExport SEXP _generate_genotypes(
     SEXP T_events_sumSEXP, SEXP posetSEXP, SEXP T_samplingSEXP,
-    SEXP lambda_sSEXP, SEXP sampling_times_availableSEXP, SEXP seedSEXP) {
+    SEXP sampling_times_availableSEXP, SEXP samplingSEXP,
+    SEXP sampling_paramSEXP, SEXP chunk_sizeSEXP, SEXP thrdsSEXP,
+    SEXP seedSEXP) {
 
   using namespace Rcpp;
   try {
@@ -1093,23 +1748,30 @@ RcppExport SEXP _generate_genotypes(
     const MapMatd T_events_sum(as<MapMatd>(T_events_sumSEXP));
     const MapMati poset(as<MapMati>(posetSEXP));
     VectorXd T_sampling = as<MapVecd>(T_samplingSEXP);
-    const float lambda_s = as<float>(lambda_sSEXP);
     const bool sampling_times_available = as<bool>(sampling_times_availableSEXP);
+    const std::string& sampling = as<std::string>(samplingSEXP);
+    const double sampling_param = as<double>(sampling_paramSEXP);
+    const int chunk_size = as<int>(chunk_sizeSEXP);
+    const int thrds = as<int>(thrdsSEXP);
     const int seed = as<int>(seedSEXP);
 
+    if (chunk_size < 1)
+      throw std::runtime_error("ERROR: chunk size must be at least one");
+
     const auto p = poset.rows(); // Number of mutations / events
     edge_container edge_list = adjacency_mat2list(poset);
-    Model M(edge_list, p, lambda_s);
+    Model M(edge_list, p);
     M.has_cycles();
     if (M.cycle)
       throw not_acyclic_exception();
     M.topological_sort();
 
-    Context ctx(seed);
+    SamplingTimeDistribution dist(sampling, sampling_param);
 
     /* Call the underlying C++ function */
-    MatrixXb samples = generate_genotypes(T_events_sum, M, T_sampling, ctx.rng,
-                                          sampling_times_available);
+    MatrixXb samples = generate_genotypes_chunked(
+      T_events_sum, M, dist, chunk_size, seed, thrds, T_sampling,
+      sampling_times_available);
 
     /* Return the result as a SEXP */
     return List::create(_["samples"]=samples, _["sampling_time"]=T_sampling);
@@ -0,0 +1,199 @@
+/** 
+ * Feasible moves for the network learning using simulated annealing
+ *
+ * This file is part of the mccbn package
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <boost/graph/adjacency_list.hpp>
+#include <boost/graph/graph_traits.hpp>
+#include <vector>
+#include "mcem.hpp"
+#include "move_table.hpp"
+
+//' @description Recompute the set of successors of node u from the successors
+//' of its (direct) children
+void MoveTable::update_row(const Model& model, const Node u) {
+  _closure[u].reset();
+  /* Loop through (direct) successor/children of node u */
+  boost::graph_traits<Poset>::out_edge_iterator out_begin, out_end;
+  for (boost::tie(out_begin, out_end) = out_edges(u, model.poset);
+       out_begin != out_end; ++out_begin) {
+    Node v = target(*out_begin, model.poset);
+    _closure[u].set(v);
+    _closure[u] |= _closure[v];
+  }
+}
+
+//' @description Compute the transitive closure of the poset
+void MoveTable::rebuild(const Model& model) {
+  const vertices_size_type p = model.size();
+  _closure.assign(p, Bitset(p));
+  /* Loop through nodes in reverse topological order */
+  for (node_container::const_iterator it = model.topo_path.begin();
+       it != model.topo_path.end(); ++it)
+    update_row(model, *it);
+}
+
+//' @description Update the transitive closure after a move that modified the
+//' edges incident to node u (e.g., edge u -> v was added or removed). Only the
+//' successors of u and of its predecessors can change. The topological
+//' ordering of the model is expected to be valid for the modified poset
+void MoveTable::update(const Model& model, const Node u) {
+  const vertices_size_type p = model.size();
+  Bitset affected(p);
+  node_container stack(1, u);
+  affected.set(u);
+  /* Collect all predecessors of node u */
+  while (!stack.empty()) {
+    Node v = stack.back();
+    stack.pop_back();
+    boost::graph_traits<Poset>::in_edge_iterator in_begin, in_end;
+    for (boost::tie(in_begin, in_end) = boost::in_edges(v, model.poset);
+         in_begin != in_end; ++in_begin) {
+      Node w = source(*in_begin, model.poset);
+      if (!affected[w]) {
+        affected.set(w);
+        stack.push_back(w);
+      }
+    }
+  }
+  /* Loop through nodes in reverse topological order */
+  for (node_container::const_iterator it = model.topo_path.begin();
+       it != model.topo_path.end(); ++it)
+    if (affected[*it])
+      update_row(model, *it);
+}
+
+//' @description Obtain all predecessors per node
+std::vector<Bitset> MoveTable::ancestors() const {
+  const vertices_size_type p = _closure.size();
+  std::vector<Bitset> anc(p, Bitset(p));
+  for (vertices_size_type u = 0; u < p; ++u)
+    for (Bitset::size_type v = _closure[u].find_first(); v != Bitset::npos;
+         v = _closure[u].find_next(v))
+      anc[v].set(u);
+  return anc;
+}
+
+//' @description List all moves of a given type that yield a valid poset
+//' @param move 0: add/remove edge, 1: swap edge, 2: add/remove cover relation
+//' while preserving the remaining cover relations, and 3: swap node labels
+//' @return returns pairs of nodes (v1, v2) in row-major order, or the edges
+//' v1 -> v2 in the order of the edge iterator for edge swaps
+edge_container MoveTable::feasible_moves(const Model& model,
+                                         const int move) const {
+  const vertices_size_type p = model.size();
+  edge_container moves;
+
+  /* Direct successors/children per node */
+  std::vector<Bitset> children(p, Bitset(p));
+  boost::graph_traits<Poset>::edge_iterator ei, ei_end;
+  for (boost::tie(ei, ei_end) = boost::edges(model.poset); ei != ei_end; ++ei)
+    children[source(*ei, model.poset)].set(target(*ei, model.poset));
+  /* Predecessors per node. Computed on demand */
+  std::vector<Bitset> anc;
+
+  switch(move) {
+  case 0: {
+    /* Removing an edge always yields a valid poset. Adding edge u -> v yields
+     * a valid poset if v is not reachable from u (otherwise the new edge is
+     * redundant), u is not reachable from v (otherwise there is a cycle) and
+     * no existing edge a -> b becomes redundant. The latter happens if a is u
+     * or a predecessor of u, and if b is v or a successor of v.
+     */
+    anc = ancestors();
+    /* redundant[a]: nodes v for which an edge from a to a successor of v
+     * exists
+     */
+    std::vector<Bitset> redundant(p, Bitset(p));
+    for (vertices_size_type a = 0; a < p; ++a)
+      for (Bitset::size_type b = children[a].find_first(); b != Bitset::npos;
+           b = children[a].find_next(b)) {
+        redundant[a].set(b);
+        redundant[a] |= anc[b];
+      }
+
+    for (vertices_size_type u = 0; u < p; ++u) {
+      Bitset blocked = redundant[u];
+      for (Bitset::size_type a = anc[u].find_first(); a != Bitset::npos;
+           a = anc[u].find_next(a))
+        blocked |= redundant[a];
+      for (vertices_size_type v = 0; v < p; ++v) {
+        if (u == v)
+          continue;
+        if (children[u][v] ||
+            (!_closure[u][v] && !_closure[v][u] && !blocked[v]))
+          moves.push_back(Edge(u, v));
+      }
+    }
+    break;
+  }
+  case 1:
+    /* Reversing edge u -> v yields a cycle if v is reachable from another
+     * child of u. It renders an existing edge a -> b redundant if a is v or a
+     * predecessor of v, and if b is u or a successor of u, once the edge
+     * u -> v is removed
+     */
+    for (boost::tie(ei, ei_end) = boost::edges(model.poset); ei != ei_end;
+         ++ei) {
+      Node u = source(*ei, model.poset);
+      Node v = target(*ei, model.poset);
+      Bitset desc_u(p);
+      desc_u.set(u);
+      for (Bitset::size_type w = children[u].find_first(); w != Bitset::npos;
+           w = children[u].find_next(w))
+        if (w != v) {
+          desc_u.set(w);
+          desc_u |= _closure[w];
+        }
+      if (desc_u[v])
+        continue;
+
+      Bitset anc_v(p);
+      anc_v.set(v);
+      boost::graph_traits<Poset>::in_edge_iterator in_begin, in_end;
+      for (boost::tie(in_begin, in_end) = boost::in_edges(v, model.poset);
+           in_begin != in_end; ++in_begin) {
+        Node w = source(*in_begin, model.poset);
+        if (w != u) {
+          if (anc.empty())
+            anc = ancestors();
+          anc_v.set(w);
+          anc_v |= anc[w];
+        }
+      }
+      bool redundant = false;
+      for (Bitset::size_type a = anc_v.find_first(); a != Bitset::npos;
+           a = anc_v.find_next(a))
+        if (children[a].intersects(desc_u)) {
+          redundant = true;
+          break;
+        }
+      if (!redundant)
+        moves.push_back(Edge(u, v));
+    }
+    break;
+  case 2:
+    /* Removing a cover relation always yields a valid poset. Adding cover
+     * relation u -> v yields a valid poset if neither v is reachable from u
+     * nor u from v. Redundant edges are removed by the move itself
+     */
+    for (vertices_size_type u = 0; u < p; ++u)
+      for (vertices_size_type v = 0; v < p; ++v)
+        if (u != v &&
+            (children[u][v] || (!_closure[u][v] && !_closure[v][u])))
+          moves.push_back(Edge(u, v));
+    break;
+  case 3:
+    /* Swapping node labels always yields a valid poset */
+    for (vertices_size_type u = 0; u < p; ++u)
+      for (vertices_size_type v = 0; v < p; ++v)
+        if (u != v)
+          moves.push_back(Edge(u, v));
+    break;
+  }
+  return moves;
+}
@@ -0,0 +1,52 @@
+/** 
+ * Feasible moves for the network learning using simulated annealing
+ *
+ * This file is part of the mccbn package
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef MOVE_TABLE_HPP
+#define MOVE_TABLE_HPP
+
+#include <vector>
+#include <boost/dynamic_bitset.hpp>
+#include "mcem.hpp"
+
+typedef boost::dynamic_bitset<> Bitset;
+
+/* Class tracking the transitive closure of the current poset, from which the
+ * moves that yield a valid poset are derived with bit operations. Moves are
+ * indexed by node (vertex descriptor) rather than by event id, such that
+ * swapping node labels doesn't alter the table
+ */
+class MoveTable {
+public:
+  MoveTable() {}
+
+  explicit MoveTable(const Model& model) {
+    rebuild(model);
+  }
+
+  void rebuild(const Model& model);
+
+  void update(const Model& model, const Node u);
+
+  edge_container feasible_moves(const Model& model, const int move) const;
+
+  inline bool reachable(const Node u, const Node v) const;
+
+protected:
+  std::vector<Bitset> _closure;  // _closure[u][v]: v is reachable from u
+
+  void update_row(const Model& model, const Node u);
+
+  std::vector<Bitset> ancestors() const;
+};
+
+bool MoveTable::reachable(const Node u, const Node v) const {
+  return _closure[u][v];
+}
+
+#endif
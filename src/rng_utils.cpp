@@ -15,28 +15,30 @@
 template <>
 VectorXd rtexp<MklRng>(const unsigned int N, const double rate,
                        const VectorXd& cutoff, MklRng& rng) {
-  std::vector<double> result(N), rand(N), temp(N);
-
-  VSLStreamStatePtr stream = rng.get_stream();
-
-  if (VSL_STATUS_OK != vdRngUniform(VSL_RNG_METHOD_UNIFORM_STD_ACCURATE,
-                                    stream, N, rand.data(), 0.0, 1.0))
-    throw std::runtime_error("Something went wrong!");
-
-  VectorXd exponent = -rate * cutoff;
-  vdExpm1(N, exponent.data(), temp.data());
-  vdMul(N, temp.data(), rand.data(), result.data());
-  
-  std::swap(temp, result);
-  vdLog1p(N, temp.data(), result.data());
-  
-  std::swap(temp, result);
-  std::fill(result.begin(), result.end(), 0.0);
-  cblas_daxpy(N, -1.0 / rate, temp.data(), 1, result.data(), 1);
-  
-  VectorXd output(result.size());
-  output = Map<VectorXd>(result.data(), result.size());
-  return output;
+  VectorXd result(N);
+  VectorXd temp = -rate * cutoff;
+  rng.fill_uniform(result.data(), N);
+
+  /* -log(1 + u * (exp(-rate * cutoff) - 1)) / rate, computed in place */
+  vdExpm1(N, temp.data(), temp.data());
+  vdMul(N, temp.data(), result.data(), result.data());
+  vdLog1p(N, result.data(), result.data());
+  result *= -1.0 / rate;
+  return result;
+}
+
+template <>
+VectorXf rtexp<MklRng>(const unsigned int N, const float rate,
+                       const VectorXf& cutoff, MklRng& rng) {
+  VectorXf result(N);
+  VectorXf temp = -rate * cutoff;
+  rng.fill_uniform(result.data(), N);
+
+  vsExpm1(N, temp.data(), temp.data());
+  vsMul(N, temp.data(), result.data(), result.data());
+  vsLog1p(N, result.data(), result.data());
+  result *= -1.0f / rate;
+  return result;
 }
 
 #else
@@ -44,13 +46,26 @@ VectorXd rtexp<MklRng>(const unsigned int N, const double rate,
 template <>
 VectorXd rtexp<StdRng>(const unsigned int N, const double rate,
                        const VectorXd& cutoff, StdRng& rng) {
-  std::uniform_real_distribution<double> distribution(0.0, 1.0);
   VectorXd result(N);
+  VectorXd temp = -rate * cutoff;
+  rng.fill_uniform(result.data(), N);
+
+  /* -log(1 + u * (exp(-rate * cutoff) - 1)) / rate, computed in place */
+  vexpm1(N, temp.data(), temp.data());
+  result = result.cwiseProduct(temp);
+  vlog1p(N, result.data(), result.data());
+  result *= -1.0 / rate;
+  return result;
+}
+
+template <>
+VectorXf rtexp<StdRng>(const unsigned int N, const float rate,
+                       const VectorXf& cutoff, StdRng& rng) {
+  VectorXf result(N);
+  rng.fill_uniform(result.data(), N);
 
-  for (unsigned int i = 0; i < N; ++i) {
-    double u = distribution(rng.get_rng());
-    result[i] = -std::log1p(u * std::expm1(-cutoff[i] * rate)) / rate;
-  }
+  for (unsigned int i = 0; i < N; ++i)
+    result[i] = -std::log1p(result[i] * std::expm1(-cutoff[i] * rate)) / rate;
 
   return result;
 }
@@ -10,23 +10,36 @@
 #define RNG_UTILS_HPP
 
 #include <config.h>
+#include <cmath>
 #include <limits>
+#include <vector>
 #include <RcppEigen.h>
+#include "vector_math.hpp"
 
 using Eigen::Map;
 using Eigen::VectorXd;
+using Eigen::VectorXf;
 
+/* Number of values generated at once for scalar draws. Buffers are allocated
+ * on first use, such that short-lived generators that only fill blocks do not
+ * pay for them
+ */
+static const unsigned int RNG_BUFFER_SIZE = 4096;
 
 template <typename RNG_TYPE>
 VectorXd rtexp(const unsigned int N, const double rate, const VectorXd& cutoff,
                RNG_TYPE& rng);
 
 template <typename RNG_TYPE>
-VectorXd rexp(const unsigned int N, const double rate, RNG_TYPE& rng) {
-  double inf = std::numeric_limits<double>::infinity();
-  VectorXd aux(N);
-  aux.setConstant(inf);
-  return rtexp(N, rate, aux, rng);
+VectorXf rtexp(const unsigned int N, const float rate, const VectorXf& cutoff,
+               RNG_TYPE& rng);
+
+template <typename Scalar=double, typename RNG_TYPE>
+Eigen::Matrix<Scalar, Eigen::Dynamic, 1> rexp(
+    const unsigned int N, const double rate, RNG_TYPE& rng) {
+  Eigen::Matrix<Scalar, Eigen::Dynamic, 1> ret(N);
+  rng.fill_exponential(ret.data(), N, (Scalar) rate);
+  return ret;
 }
 
 #ifdef MKL_ENABLED
@@ -37,7 +50,8 @@ VectorXd rexp(const unsigned int N, const double rate, RNG_TYPE& rng) {
 
 class MklRng: private boost::noncopyable {
 public:
-  MklRng(unsigned int seed) : _stream(NULL) {
+  MklRng(unsigned int seed) : _stream(NULL), _bits_pos(RNG_BUFFER_SIZE),
+    _uniform_pos(RNG_BUFFER_SIZE) {
     vslNewStream(&_stream, VSL_BRNG_MT19937, seed);
   }
   
@@ -51,12 +65,60 @@ public:
   
   typedef unsigned int result_type;
   
+  /* Random bits are generated in blocks of RNG_BUFFER_SIZE values */
   result_type operator()() {
-    unsigned int result;
-    if (VSL_STATUS_OK != viRngUniformBits32(VSL_RNG_METHOD_UNIFORMBITS32_STD,
-                                            _stream, 1, &result))
+    if (_bits_pos == RNG_BUFFER_SIZE) {
+      _bits.resize(RNG_BUFFER_SIZE);
+      if (VSL_STATUS_OK != viRngUniformBits32(VSL_RNG_METHOD_UNIFORMBITS32_STD,
+                                              _stream, RNG_BUFFER_SIZE,
+                                              _bits.data()))
+        throw std::runtime_error("Something went wrong!");
+      _bits_pos = 0;
+    }
+    return _bits[_bits_pos++];
+  }
+
+  /* Draw from U[0, 1) */
+  double uniform() {
+    if (_uniform_pos == RNG_BUFFER_SIZE) {
+      _uniform.resize(RNG_BUFFER_SIZE);
+      fill_uniform(_uniform.data(), RNG_BUFFER_SIZE);
+      _uniform_pos = 0;
+    }
+    return _uniform[_uniform_pos++];
+  }
+
+  /* Fill 'output' with N draws from U[0, 1) */
+  void fill_uniform(double* output, const unsigned int N) {
+    if (N > 0 &&
+        VSL_STATUS_OK != vdRngUniform(VSL_RNG_METHOD_UNIFORM_STD_ACCURATE,
+                                      _stream, N, output, 0.0, 1.0))
+      throw std::runtime_error("Something went wrong!");
+  }
+
+  /* Fill 'output' with N draws from Exp(rate) */
+  void fill_exponential(double* output, const unsigned int N,
+                        const double rate) {
+    if (N > 0 &&
+        VSL_STATUS_OK != vdRngExponential(VSL_RNG_METHOD_EXPONENTIAL_ICDF_ACCURATE,
+                                          _stream, N, output, 0.0, 1.0 / rate))
+      throw std::runtime_error("Something went wrong!");
+  }
+
+  /* Single-precision variants */
+  void fill_uniform(float* output, const unsigned int N) {
+    if (N > 0 &&
+        VSL_STATUS_OK != vsRngUniform(VSL_RNG_METHOD_UNIFORM_STD_ACCURATE,
+                                      _stream, N, output, 0.0f, 1.0f))
+      throw std::runtime_error("Something went wrong!");
+  }
+
+  void fill_exponential(float* output, const unsigned int N,
+                        const float rate) {
+    if (N > 0 &&
+        VSL_STATUS_OK != vsRngExponential(VSL_RNG_METHOD_EXPONENTIAL_ICDF_ACCURATE,
+                                          _stream, N, output, 0.0f, 1.0f / rate))
       throw std::runtime_error("Something went wrong!");
-    return result;
   }
   
   static constexpr result_type min() {
@@ -69,6 +131,10 @@ public:
 
 private:
   VSLStreamStatePtr _stream;
+  std::vector<unsigned int> _bits;
+  unsigned int _bits_pos;
+  std::vector<double> _uniform;
+  unsigned int _uniform_pos;
 };
 
 typedef MklRng rng_type;
@@ -77,6 +143,10 @@ template <>
 VectorXd rtexp<MklRng>(const unsigned int N, const double rate,
                        const VectorXd& cutoff, MklRng& rng);
 
+template <>
+VectorXf rtexp<MklRng>(const unsigned int N, const float rate,
+                       const VectorXf& cutoff, MklRng& rng);
+
 #else
 
 #include <random>
@@ -84,9 +154,12 @@ VectorXd rtexp<MklRng>(const unsigned int N, const double rate,
 #include <functional>
 #include <array>
 
+/* Number of draws converted per block of raw words of the engine */
+static const unsigned int RNG_WORDS_BLOCK = 256;
+
 class StdRng: private boost::noncopyable {
 public:
-  StdRng(unsigned int seed) {
+  StdRng(unsigned int seed) : _uniform_pos(RNG_BUFFER_SIZE) {
     std::ranlux24_base seeder_rng = std::ranlux24_base(seed);
     
     // adapted from https://stackoverflow.com/a/15509942
@@ -114,9 +187,74 @@ public:
   std::mt19937& get_rng() {
     return _rng;
   }
+
+  /* Draw from U[0, 1) */
+  double uniform() {
+    if (_uniform_pos == RNG_BUFFER_SIZE) {
+      _uniform.resize(RNG_BUFFER_SIZE);
+      fill_uniform(_uniform.data(), RNG_BUFFER_SIZE);
+      _uniform_pos = 0;
+    }
+    return _uniform[_uniform_pos++];
+  }
+
+  /* Fill 'output' with N draws from U[0, 1). Raw words of the engine are
+   * generated in blocks and converted in a separate loop. As in
+   * std::generate_canonical, each draw combines two 32-bit words, and draws
+   * that round to 1 are moved below 1
+   */
+  void fill_uniform(double* output, const unsigned int N) {
+    const double u_max = std::nextafter(1.0, 0.0);
+    result_type bits[2 * RNG_WORDS_BLOCK];
+    for (unsigned int first = 0; first < N; first += RNG_WORDS_BLOCK) {
+      const unsigned int n = std::min(RNG_WORDS_BLOCK, N - first);
+      for (unsigned int k = 0; k < 2 * n; ++k)
+        bits[k] = _rng();
+      for (unsigned int k = 0; k < n; ++k)
+        output[first + k] = std::min(
+          ((double) bits[2 * k] + (double) bits[2 * k + 1] * 4294967296.0) /
+          18446744073709551616.0,
+          u_max);
+    }
+  }
+
+  /* Fill 'output' with N draws from Exp(rate) by inversion */
+  void fill_exponential(double* output, const unsigned int N,
+                        const double rate) {
+    fill_uniform(output, N);
+    for (unsigned int i = 0; i < N; ++i)
+      output[i] = -output[i];
+    vlog1p(N, output, output);
+    for (unsigned int i = 0; i < N; ++i)
+      output[i] /= -rate;
+  }
+
+  /* Single-precision variants. Each draw takes one 32-bit word, and draws
+   * are clamped below 1, to which they can round
+   */
+  void fill_uniform(float* output, const unsigned int N) {
+    const float u_max = std::nextafter(1.0f, 0.0f);
+    result_type bits[RNG_WORDS_BLOCK];
+    for (unsigned int first = 0; first < N; first += RNG_WORDS_BLOCK) {
+      const unsigned int n = std::min(RNG_WORDS_BLOCK, N - first);
+      for (unsigned int k = 0; k < n; ++k)
+        bits[k] = _rng();
+      for (unsigned int k = 0; k < n; ++k)
+        output[first + k] = std::min((float) bits[k] / 4294967296.0f, u_max);
+    }
+  }
+
+  void fill_exponential(float* output, const unsigned int N,
+                        const float rate) {
+    fill_uniform(output, N);
+    for (unsigned int i = 0; i < N; ++i)
+      output[i] = -std::log1p(-output[i]) / rate;
+  }
   
 private:
   std::mt19937 _rng;
+  std::vector<double> _uniform;
+  unsigned int _uniform_pos;
 };
 
 typedef StdRng rng_type;
@@ -125,6 +263,10 @@ template <>
 VectorXd rtexp<StdRng>(const unsigned int N, const double rate,
                        const VectorXd& cutoff, StdRng& rng);
 
+template <>
+VectorXf rtexp<StdRng>(const unsigned int N, const float rate,
+                       const VectorXf& cutoff, StdRng& rng);
+
 #endif
 
 #endif
@@ -0,0 +1,195 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Posterior prediction of sampling times given the genotypes
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include "mcem.hpp"
+#include "add_remove.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+#include "not_acyclic_exception.hpp"
+
+/* Number of samples drawn by a task. Blocks do not depend on the number of
+ * threads, such that predictions are reproducible across thread counts
+ */
+static const unsigned int SAMPLING_TIME_BLOCK = 1024;
+
+/* Weighted sums of the sampling times, relative to exp(log_scale) */
+class SamplingTimeSums {
+public:
+  double w;
+  double w_sqrt;
+  double w_time;
+  double w_time_sqrt;
+  double log_scale;
+
+  SamplingTimeSums() : w(0.0), w_sqrt(0.0), w_time(0.0), w_time_sqrt(0.0),
+    log_scale(0.0) {}
+
+  void add(const VectorXd& log_w, const VectorXd& time) {
+    SamplingTimeSums block;
+    block.log_scale = log_w.maxCoeff();
+    if (!std::isfinite(block.log_scale))
+      return;
+    const VectorXd w_block = (log_w.array() - block.log_scale).exp();
+    block.w = w_block.sum();
+    block.w_sqrt = w_block.squaredNorm();
+    block.w_time = w_block.dot(time);
+    block.w_time_sqrt = w_block.dot(time.cwiseAbs2());
+    merge(block);
+  }
+
+  void merge(const SamplingTimeSums& other) {
+    if (other.w == 0)
+      return;
+    if (w == 0) {
+      *this = other;
+      return;
+    }
+    double factor_this = 1.0, factor_other = 1.0;
+    if (other.log_scale > log_scale) {
+      factor_this = std::exp(log_scale - other.log_scale);
+      log_scale = other.log_scale;
+    } else {
+      factor_other = std::exp(other.log_scale - log_scale);
+    }
+    w = factor_this * w + factor_other * other.w;
+    w_sqrt = factor_this * factor_this * w_sqrt +
+      factor_other * factor_other * other.w_sqrt;
+    w_time = factor_this * w_time + factor_other * other.w_time;
+    w_time_sqrt = factor_this * w_time_sqrt + factor_other * other.w_time_sqrt;
+  }
+};
+
+//' Posterior mean and standard deviation of the sampling time of each
+//' genotype, given the poset, the rate parameters and the rate of the
+//' sampling process. Sampling times are drawn from Exp(lambda_s) and
+//' mutation times from the proposal conditioned on the genotype, such that
+//' the importance weight of a sample is proportional to P(genotype | t_s).
+//' Identical genotypes share their samples, and the work is distributed over
+//' genotypes x blocks of samples
+//'
+//' @noRd
+//' @param ess effective sample size per genotype. Genotypes that are not
+//' compatible with the poset have zero effective sample size and undefined
+//' predictions
+void expected_sampling_time(
+    const MatrixXb& obs, const Model& model, const unsigned int L,
+    VectorXd& mean, VectorXd& sd, VectorXd& ess, const unsigned int thrds,
+    Context& ctx) {
+
+  const unsigned int N = obs.rows();
+  const unsigned int p = obs.cols();
+  if (L == 0)
+    throw std::runtime_error("ERROR: at least one sample is required");
+
+  /* Collapse identical genotypes */
+  std::map<std::vector<bool>, unsigned int> idx;
+  std::vector<unsigned int> pattern_of(N), first;
+  std::vector<bool> key(p);
+  for (unsigned int i = 0; i < N; ++i) {
+    for (unsigned int j = 0; j < p; ++j)
+      key[j] = obs(i, j);
+    auto it = idx.insert(std::make_pair(key, first.size()));
+    if (it.second)
+      first.push_back(i);
+    pattern_of[i] = it.first->second;
+  }
+  const unsigned int K = first.size();
+  std::vector<bool> compatible(K);
+  for (unsigned int k = 0; k < K; ++k)
+    compatible[k] = is_compatible(obs.row(first[k]), model);
+
+  const unsigned int num_blocks =
+    (L + SAMPLING_TIME_BLOCK - 1) / SAMPLING_TIME_BLOCK;
+  std::vector<SamplingTimeSums> partial_sums(K * num_blocks);
+  const VectorXd lambda = model.get_lambda();
+  const int seed = ctx.rng();
+  parallel_for(K * num_blocks, thrds, [&](const unsigned int t) {
+    const unsigned int k = t / num_blocks;
+    const unsigned int b = t % num_blocks;
+    if (!compatible[k])
+      return;
+    const unsigned int L_block = std::min(SAMPLING_TIME_BLOCK,
+                                          L - b * SAMPLING_TIME_BLOCK);
+    Context::rng_type rng(chunk_seed(seed, t));
+    const MatrixXb genotypes = obs.row(first[k]).replicate(L_block, 1);
+    VectorXd log_proposal = VectorXd::Zero(L_block);
+    VectorXd sampling_time;
+    MatrixXd time_events = generate_mutation_times(
+      genotypes, model, log_proposal, sampling_time, rng);
+    const VectorXd log_w =
+      cbn_density_log(time_events, lambda) - log_proposal;
+    partial_sums[t].add(log_w, sampling_time);
+  });
+
+  mean.resize(N);
+  sd.resize(N);
+  ess.resize(N);
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  std::vector<SamplingTimeSums> sums(K);
+  for (unsigned int k = 0; k < K; ++k)
+    for (unsigned int b = 0; b < num_blocks; ++b)
+      sums[k].merge(partial_sums[k * num_blocks + b]);
+  for (unsigned int i = 0; i < N; ++i) {
+    const SamplingTimeSums& s = sums[pattern_of[i]];
+    if (s.w == 0) {
+      mean[i] = nan;
+      sd[i] = nan;
+      ess[i] = 0.0;
+      continue;
+    }
+    mean[i] = s.w_time / s.w;
+    sd[i] = std::sqrt(std::max(s.w_time_sqrt / s.w - mean[i] * mean[i], 0.0));
+    ess[i] = s.w * s.w / s.w_sqrt;
+  }
+
+  if (ctx.get_verbose())
+    std::cout << "Number of distinct genotypes: " << K << std::endl;
+}
+
+RcppExport SEXP _expected_sampling_time(
+    SEXP obsSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP lambda_sSEXP,
+    SEXP LSEXP, SEXP thrdsSEXP, SEXP verboseSEXP, SEXP seedSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    const MatrixXb& obs = as<MatrixXb>(obsSEXP);
+    const MapMati poset(as<MapMati>(posetSEXP));
+    const MapVecd lambda(as<MapVecd>(lambdaSEXP));
+    const float lambda_s = as<float>(lambda_sSEXP);
+    const unsigned int L = as<unsigned int>(LSEXP);
+    const int thrds = as<int>(thrdsSEXP);
+    const bool verbose = as<bool>(verboseSEXP);
+    const int seed = as<int>(seedSEXP);
+
+    const auto p = poset.rows(); // Number of mutations / events
+    if (obs.cols() != p)
+      throw std::runtime_error(
+          "ERROR: genotypes do not match the number of events");
+    edge_container edge_list = adjacency_mat2list(poset);
+    Model M(edge_list, p, lambda_s);
+    M.set_lambda(lambda);
+    M.has_cycles();
+    if (M.cycle)
+      throw not_acyclic_exception();
+    M.topological_sort();
+
+    /* Call the underlying C++ function */
+    Context ctx(seed, verbose);
+    VectorXd mean, sd, ess;
+    expected_sampling_time(obs, M, L, mean, sd, ess, thrds, ctx);
+
+    /* Return the result as a SEXP */
+    return List::create(_["mean"]=mean, _["sd"]=sd, _["ess"]=ess);
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
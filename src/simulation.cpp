@@ -0,0 +1,387 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Simulation of genotypes in chunks of fixed size
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <Rcpp.h>
+#include <RcppEigen.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include "mcem.hpp"
+#include "simulation.hpp"
+#include "task_runtime.hpp"
+#include "not_acyclic_exception.hpp"
+
+
+BinaryGenotypeWriter::BinaryGenotypeWriter(
+  const std::string& filename, const unsigned int p, const bool event_times,
+  const bool sampling_times) :
+  _outfile(filename, std::ofstream::binary | std::ofstream::trunc), _p(p),
+  _event_times(event_times), _sampling_times(sampling_times) {
+
+  if (!_outfile)
+    throw std::runtime_error("ERROR: cannot open file '" + filename + "'");
+
+  /* Header */
+  const char magic[] = "MCCBNGT1";
+  _buffer.assign(magic, magic + 8);
+  append_uint32(_buffer, p);
+  append_uint32(_buffer, (event_times ? 1 : 0) | (sampling_times ? 2 : 0));
+  _outfile.write(reinterpret_cast<const char*>(_buffer.data()),
+                 _buffer.size());
+}
+
+void BinaryGenotypeWriter::write(
+    const MatrixXb& obs, const MatrixXd& T_events_sum,
+    const VectorXd& T_sampling) {
+
+  /* Sizes are computed in std::size_t, as chunks of many genotypes over many
+   * events exceed the range of unsigned int
+   */
+  const std::size_t n = obs.rows();
+  const std::size_t num_bytes = (_p + 7) / 8;
+
+  _buffer.clear();
+  _buffer.reserve(4 + n * num_bytes +
+    8 * n * ((_event_times ? _p : 0) + (_sampling_times ? 1 : 0)));
+  append_uint32(_buffer, n);
+
+  /* Pack genotypes */
+  const std::size_t offset = _buffer.size();
+  _buffer.resize(offset + n * num_bytes, 0);
+  for (unsigned int j = 0; j < _p; ++j)
+    for (std::size_t i = 0; i < n; ++i)
+      if (obs(i, j))
+        _buffer[offset + i * num_bytes + j / 8] |= 1 << (j % 8);
+
+  if (_event_times)
+    for (std::size_t k = 0; k < n * _p; ++k)
+      append_double(_buffer, T_events_sum.data()[k]);
+
+  if (_sampling_times)
+    for (std::size_t i = 0; i < n; ++i)
+      append_double(_buffer, T_sampling[i]);
+
+  _outfile.write(reinterpret_cast<const char*>(_buffer.data()),
+                 _buffer.size());
+  if (!_outfile)
+    throw std::runtime_error("ERROR: writing genotypes failed");
+}
+
+void CallbackGenotypeWriter::write(
+    const MatrixXb& obs, const MatrixXd& T_events_sum,
+    const VectorXd& T_sampling) {
+  _callback(Rcpp::wrap(obs), Rcpp::wrap(T_events_sum),
+            Rcpp::wrap(T_sampling));
+}
+
+SamplingTimeDistribution::SamplingTimeDistribution(
+  const std::string& name, const double param) : _param(param) {
+  if (name == "expo")
+    _type = EXPO;
+  else if (name == "norm")
+    _type = NORM;
+  else if (name == "const")
+    _type = CONST;
+  else if (name == "unif")
+    _type = UNIF;
+  else if (name == "dep")
+    _type = DEP;
+  else
+    throw std::runtime_error(
+        "ERROR: unknown sampling-time distribution '" + name + "'");
+
+  if ((_type == EXPO || _type == NORM || _type == UNIF) && param <= 0)
+    throw std::runtime_error(
+        "ERROR: the parameter of the sampling-time distribution should be "
+        "positive");
+}
+
+//' Draw one sampling time per genotype
+//'
+//' @noRd
+//' @param T_events_sum occurrence times of the genotypes. Only used by the
+//' "dep" distribution
+VectorXd SamplingTimeDistribution::draw(
+    const MatrixXd& T_events_sum, Context::rng_type& rng) const {
+
+  const unsigned int n = T_events_sum.rows();
+  VectorXd T_sampling(n);
+
+  switch(_type) {
+  case EXPO:
+    T_sampling = rexp(n, 1.0 / _param, rng);
+    break;
+  case NORM: {
+    std::normal_distribution<double> distribution(_param, 0.1 * _param);
+    for (unsigned int i = 0; i < n; ++i) {
+      /* Rejection sampling. Mean is 10 standard deviations away from 0 */
+      do {
+        T_sampling[i] = distribution(rng);
+      } while (T_sampling[i] < 0);
+    }
+    break;
+  }
+  case CONST:
+    T_sampling.setConstant(_param);
+    break;
+  case UNIF:
+    rng.fill_uniform(T_sampling.data(), n);
+    T_sampling = _param / 100 + (_param - _param / 100) * T_sampling.array();
+    break;
+  case DEP: {
+    const unsigned int num_first = std::min(2, (int) T_events_sum.cols());
+    for (unsigned int i = 0; i < n; ++i) {
+      if (rng.uniform() < _param) {
+        const double t_min = T_events_sum.row(i).minCoeff() / 1.1;
+        const double t_max = T_events_sum.row(i).maxCoeff() * 1.1;
+        T_sampling[i] = t_min + (t_max - t_min) * rng.uniform();
+      } else {
+        T_sampling[i] = T_events_sum.row(i).head(num_first).maxCoeff();
+      }
+    }
+    break;
+  }
+  }
+  return T_sampling;
+}
+
+//' Seed of the random number stream of a chunk. Each chunk is generated with
+//' its own stream, such that the output does not depend on the number of
+//' threads
+//'
+//' @noRd
+unsigned int chunk_seed(const int seed, const unsigned long long chunk) {
+  /* SplitMix64 mixing function */
+  std::uint64_t z = ((std::uint64_t) (unsigned int) seed << 32) + chunk +
+    0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (unsigned int) (z >> 32);
+}
+
+//' Generate a chunk of n observations using the random number stream of the
+//' chunk
+//'
+//' @noRd
+//' @param T_sampling sampling times. They are drawn from 'dist', unless
+//' 'sampling_times_available' is true
+//' @param thrds number of threads for the cumulative times of the chunk
+void simulate_chunk(
+    const unsigned int n, const Model& model,
+    const SamplingTimeDistribution& dist, const int seed,
+    const unsigned long long chunk, MatrixXd& T_events,
+    MatrixXd& T_events_sum, VectorXd& T_sampling, MatrixXb& obs,
+    const bool sampling_times_available=false, const unsigned int thrds=1) {
+
+  Context::rng_type rng(chunk_seed(seed, chunk));
+  T_events.resize(n, model.size());
+  T_events_sum = sample_times(n, model, T_events, rng, thrds);
+  if (!sampling_times_available)
+    T_sampling = dist.draw(T_events_sum, rng);
+  obs = generate_genotypes(T_events_sum, model, T_sampling, rng, true);
+}
+
+//' Generate observations from a given poset and given rates. Observations
+//' are generated in parallel in chunks of (at most) 'chunk_size' genotypes
+//'
+//' @noRd
+//' @param N number of samples
+//' @param T_sampling sampling times. They are drawn from 'dist', unless
+//' 'sampling_times_available' is true
+void sample_genotypes_chunked(
+    const unsigned int N, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, MatrixXb& obs,
+    MatrixXd& T_events, MatrixXd& T_events_sum, VectorXd& T_sampling,
+    const bool sampling_times_available) {
+
+  const vertices_size_type p = model.size();  // Number of mutations / events
+  const unsigned int num_chunks = (N + chunk_size - 1) / chunk_size;
+  obs.resize(N, p);
+  T_events.resize(N, p);
+  T_events_sum.resize(N, p);
+  if (!sampling_times_available)
+    T_sampling.resize(N);
+
+  parallel_for(num_chunks, thrds, [&](const unsigned int c) {
+    const unsigned int start = c * chunk_size;
+    const unsigned int n = std::min(chunk_size, N - start);
+    MatrixXd T_events_chunk, T_events_sum_chunk;
+    VectorXd T_sampling_chunk;
+    MatrixXb obs_chunk;
+    if (sampling_times_available)
+      T_sampling_chunk = T_sampling.segment(start, n);
+    simulate_chunk(n, model, dist, seed, c, T_events_chunk,
+                   T_events_sum_chunk, T_sampling_chunk, obs_chunk,
+                   sampling_times_available, thrds);
+    obs.middleRows(start, n) = obs_chunk;
+    T_events.middleRows(start, n) = T_events_chunk;
+    T_events_sum.middleRows(start, n) = T_events_sum_chunk;
+    T_sampling.segment(start, n) = T_sampling_chunk;
+  });
+}
+
+//' Generate observation times from a given poset and given rates. Times are
+//' generated in parallel in chunks of (at most) 'chunk_size' genotypes
+//'
+//' @noRd
+//' @param N number of samples
+void sample_times_chunked(
+    const unsigned int N, const Model& model, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, MatrixXd& T_events,
+    MatrixXd& T_events_sum) {
+
+  const vertices_size_type p = model.size();  // Number of mutations / events
+  const unsigned int num_chunks = (N + chunk_size - 1) / chunk_size;
+  T_events.resize(N, p);
+  T_events_sum.resize(N, p);
+
+  parallel_for(num_chunks, thrds, [&](const unsigned int c) {
+    const unsigned int start = c * chunk_size;
+    const unsigned int n = std::min(chunk_size, N - start);
+    Context::rng_type rng(chunk_seed(seed, c));
+    MatrixXd T_events_chunk(n, p);
+    T_events_sum.middleRows(start, n) =
+      sample_times(n, model, T_events_chunk, rng, thrds);
+    T_events.middleRows(start, n) = T_events_chunk;
+  });
+}
+
+//' Generate observations from occurrence times. Observations are generated
+//' in parallel in chunks of (at most) 'chunk_size' genotypes
+//'
+//' @noRd
+//' @param T_sampling sampling times. They are drawn from 'dist', unless
+//' 'sampling_times_available' is true
+MatrixXb generate_genotypes_chunked(
+    const MatrixXd& T_events_sum, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, VectorXd& T_sampling,
+    const bool sampling_times_available) {
+
+  const unsigned int N = T_events_sum.rows(); // Number of genotypes
+  const unsigned int num_chunks = (N + chunk_size - 1) / chunk_size;
+  MatrixXb obs(N, model.size());
+  if (!sampling_times_available)
+    T_sampling.resize(N);
+
+  parallel_for(num_chunks, thrds, [&](const unsigned int c) {
+    const unsigned int start = c * chunk_size;
+    const unsigned int n = std::min(chunk_size, N - start);
+    Context::rng_type rng(chunk_seed(seed, c));
+    MatrixXd T_events_sum_chunk = T_events_sum.middleRows(start, n);
+    VectorXd T_sampling_chunk;
+    if (sampling_times_available)
+      T_sampling_chunk = T_sampling.segment(start, n);
+    else
+      T_sampling_chunk = dist.draw(T_events_sum_chunk, rng);
+    obs.middleRows(start, n) = generate_genotypes(
+      T_events_sum_chunk, model, T_sampling_chunk, rng, true);
+    T_sampling.segment(start, n) = T_sampling_chunk;
+  });
+  return obs;
+}
+
+//' Generate observations from a given poset and given rates in chunks of
+//' (at most) 'chunk_size' genotypes. Memory usage only depends on the chunk
+//' size and on the number of threads. Up to 'thrds' chunks are generated in
+//' parallel and passed to the writer in order
+//'
+//' @noRd
+//' @param N number of samples
+//' @param writer consumer of the chunks of genotypes, mutation times and
+//' sampling times
+//' @return returns the number of genotypes generated
+unsigned long long simulate_genotypes(
+    const unsigned long long N, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    GenotypeWriter& writer, const int seed, const unsigned int thrds) {
+
+  const unsigned long long num_chunks = (N + chunk_size - 1) / chunk_size;
+  const unsigned int batch_size = std::max(thrds, 1u);
+  std::vector<MatrixXd> T_events(batch_size), T_events_sum(batch_size);
+  std::vector<VectorXd> T_sampling(batch_size);
+  std::vector<MatrixXb> obs(batch_size);
+
+  for (unsigned long long first = 0; first < num_chunks; first += batch_size) {
+    const unsigned int num =
+      std::min((unsigned long long) batch_size, num_chunks - first);
+
+    parallel_for(num, thrds, [&](const unsigned int k) {
+      const unsigned long long c = first + k;
+      const unsigned int n =
+        std::min((unsigned long long) chunk_size, N - c * chunk_size);
+      simulate_chunk(n, model, dist, seed, c, T_events[k], T_events_sum[k],
+                     T_sampling[k], obs[k], false, thrds);
+    });
+
+    for (unsigned int k = 0; k < num; ++k)
+      writer.write(obs[k], T_events_sum[k], T_sampling[k]);
+  }
+  return N;
+}
+
+RcppExport SEXP _simulate_genotypes(
+    SEXP NSEXP, SEXP posetSEXP, SEXP lambdaSEXP, SEXP samplingSEXP,
+    SEXP sampling_paramSEXP, SEXP chunk_sizeSEXP, SEXP fileSEXP,
+    SEXP callbackSEXP, SEXP event_timesSEXP, SEXP thrdsSEXP, SEXP seedSEXP) {
+
+  using namespace Rcpp;
+  try {
+    /* Convert input to C++ types */
+    const double N_double = as<double>(NSEXP);
+    const MapMati poset(as<MapMati>(posetSEXP));
+    const MapVecd lambda(as<MapVecd>(lambdaSEXP));
+    const std::string& sampling = as<std::string>(samplingSEXP);
+    const double sampling_param = as<double>(sampling_paramSEXP);
+    const int chunk_size = as<int>(chunk_sizeSEXP);
+    const bool event_times = as<bool>(event_timesSEXP);
+    const int thrds = as<int>(thrdsSEXP);
+    const int seed = as<int>(seedSEXP);
+
+    if (chunk_size < 1)
+      throw std::runtime_error("ERROR: chunk size must be at least one");
+    /* Integers above 2^53 are not represented exactly by doubles */
+    if (!std::isfinite(N_double) || N_double < 0 ||
+        N_double != std::floor(N_double) || N_double > 9007199254740992.0)
+      throw std::runtime_error(
+          "ERROR: number of genotypes must be a non-negative integer");
+    const unsigned long long N = N_double;
+
+    const auto p = poset.rows(); // Number of mutations / events
+    edge_container edge_list = adjacency_mat2list(poset);
+    Model M(edge_list, p);
+    M.set_lambda(lambda);
+    M.has_cycles();
+    if (M.cycle)
+      throw not_acyclic_exception();
+    M.topological_sort();
+
+    SamplingTimeDistribution dist(sampling, sampling_param);
+
+    std::unique_ptr<GenotypeWriter> writer;
+    if (!Rf_isNull(fileSEXP))
+      writer.reset(new BinaryGenotypeWriter(as<std::string>(fileSEXP), p,
+                                            event_times, true));
+    else
+      writer.reset(new CallbackGenotypeWriter(as<Function>(callbackSEXP)));
+
+    /* Call the underlying C++ function */
+    unsigned long long num_samples = simulate_genotypes(
+      N, M, dist, chunk_size, *writer, seed, thrds);
+
+    /* Return the result as a SEXP */
+    return wrap((double) num_samples);
+  } catch  (...) {
+    handle_exceptions();
+  }
+  return R_NilValue;
+}
@@ -0,0 +1,151 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Simulation of genotypes in chunks of fixed size
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef SIMULATION_HPP
+#define SIMULATION_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Rcpp.h>
+#include <RcppEigen.h>
+#include "mcem.hpp"
+
+/* Append value to the buffer in little-endian byte order */
+inline void append_uint32(std::vector<unsigned char>& buffer,
+                          const std::uint32_t value) {
+  for (unsigned int b = 0; b < 4; ++b)
+    buffer.push_back((value >> (8 * b)) & 0xFF);
+}
+
+inline void append_double(std::vector<unsigned char>& buffer,
+                          const double value) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(double));
+  for (unsigned int b = 0; b < 8; ++b)
+    buffer.push_back((bits >> (8 * b)) & 0xFF);
+}
+
+/* Interface for the consumers of chunks of simulated genotypes */
+class GenotypeWriter {
+public:
+  virtual ~GenotypeWriter() {}
+
+  virtual void write(const MatrixXb& obs, const MatrixXd& T_events_sum,
+                     const VectorXd& T_sampling) = 0;
+};
+
+/* Writer for the binary genotype format. Files start with the 8-byte magic
+ * string "MCCBNGT1", followed by the number of events, p, and by a bit mask
+ * indicating whether mutation times (1) and sampling times (2) are stored,
+ * both as 32-bit integers. Genotypes are then stored in blocks. Each block
+ * starts with the number of genotypes in the block, n, as a 32-bit integer,
+ * followed by
+ *  - the genotypes, each one packed into ceiling(p / 8) bytes (event j is
+ *    stored in bit j % 8 of byte j / 8),
+ *  - the (n x p) mutation times in column-major order, if stored, and
+ *  - the n sampling times, if stored,
+ * where times are stored as doubles. All values are little-endian
+ */
+class BinaryGenotypeWriter : public GenotypeWriter {
+public:
+  BinaryGenotypeWriter(const std::string& filename, const unsigned int p,
+                       const bool event_times=true,
+                       const bool sampling_times=true);
+
+  void write(const MatrixXb& obs, const MatrixXd& T_events_sum,
+             const VectorXd& T_sampling);
+
+protected:
+  std::ofstream _outfile;
+  unsigned int _p;
+  bool _event_times;
+  bool _sampling_times;
+  std::vector<unsigned char> _buffer;  // packed genotypes
+};
+
+/* Writer passing each chunk to an R function */
+class CallbackGenotypeWriter : public GenotypeWriter {
+public:
+  CallbackGenotypeWriter(const Rcpp::Function& callback) :
+    _callback(callback) {}
+
+  void write(const MatrixXb& obs, const MatrixXd& T_events_sum,
+             const VectorXd& T_sampling);
+
+protected:
+  Rcpp::Function _callback;
+};
+
+/* Distributions of the sampling times:
+ *  - "expo": exponential with mean 'param'
+ *  - "norm": normal with mean 'param' and standard deviation 0.1 * 'param',
+ *    truncated at 0
+ *  - "const": constant time 'param'
+ *  - "unif": uniform on ['param' / 100, 'param']
+ *  - "dep": with probability 1 - 'param', the largest occurrence time of the
+ *    first two events, otherwise uniform on [min(T) / 1.1, max(T) * 1.1],
+ *    where T are the occurrence times of the genotype
+ */
+class SamplingTimeDistribution {
+public:
+  enum Type { EXPO, NORM, CONST, UNIF, DEP };
+
+  SamplingTimeDistribution(const std::string& name, const double param);
+
+  VectorXd draw(const MatrixXd& T_events_sum, Context::rng_type& rng) const;
+
+  inline Type get_type() const {
+    return _type;
+  }
+
+protected:
+  Type _type;
+  double _param;
+};
+
+unsigned int chunk_seed(const int seed, const unsigned long long chunk);
+
+/* 64-bit FNV-1a hash of a key, used to derive the random number stream of a
+ * cached computation. Unlike std::hash, it does not depend on the standard
+ * library
+ */
+inline std::uint64_t fnv1a(const std::string& key) {
+  std::uint64_t hash = 14695981039346656037ULL;
+  for (std::string::const_iterator c = key.begin(); c != key.end(); ++c) {
+    hash ^= (unsigned char) *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void sample_genotypes_chunked(
+    const unsigned int N, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, MatrixXb& obs,
+    MatrixXd& T_events, MatrixXd& T_events_sum, VectorXd& T_sampling,
+    const bool sampling_times_available=false);
+
+void sample_times_chunked(
+    const unsigned int N, const Model& model, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, MatrixXd& T_events,
+    MatrixXd& T_events_sum);
+
+MatrixXb generate_genotypes_chunked(
+    const MatrixXd& T_events_sum, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    const int seed, const unsigned int thrds, VectorXd& T_sampling,
+    const bool sampling_times_available=false);
+
+unsigned long long simulate_genotypes(
+    const unsigned long long N, const Model& model,
+    const SamplingTimeDistribution& dist, const unsigned int chunk_size,
+    GenotypeWriter& writer, const int seed, const unsigned int thrds);
+
+#endif
@@ -0,0 +1,285 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Task runtime for the parallel loops
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <algorithm>
+#include <exception>
+#include "task_runtime.hpp"
+
+#if defined(TASK_RUNTIME_OPENMP) && defined(_OPENMP)
+
+#include <omp.h>
+
+void parallel_for(const unsigned int n, const unsigned int thrds,
+                  const std::function<void(unsigned int)>& body,
+                  const unsigned int grain) {
+
+  if (thrds <= 1 || n <= grain || omp_in_parallel()) {
+    for (unsigned int i = 0; i < n; ++i)
+      body(i);
+    return;
+  }
+
+  std::exception_ptr error;
+  #pragma omp parallel for schedule(dynamic, grain) num_threads(thrds)
+  for (unsigned int i = 0; i < n; ++i) {
+    try {
+      body(i);
+    } catch (...) {
+      #pragma omp critical(task_runtime_error)
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#else
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Iterations of a parallel loop. Threads taking part in the loop claim
+ * chunks of iterations until all of them have been claimed
+ */
+class Job {
+public:
+  Job(const unsigned int n, const unsigned int grain,
+      const std::function<void(unsigned int)>& body,
+      const unsigned int num_tickets) :
+    _n(n), _grain(std::max(grain, 1u)), _body(body), _next(0),
+    _pending(num_tickets) {}
+
+  void run() {
+    for (;;) {
+      const unsigned long long start = _next.fetch_add(_grain);
+      if (start >= _n)
+        break;
+      const unsigned int end = std::min(start + _grain, (unsigned long long) _n);
+      try {
+        for (unsigned int i = start; i < end; ++i)
+          _body(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(_error_mutex);
+        if (!_error)
+          _error = std::current_exception();
+        _next.store(_n);
+      }
+    }
+  }
+
+  /* Run a ticket handed out to another thread and return whether it was the
+   * last one. The job must not be accessed after the last ticket has been
+   * released
+   */
+  bool run_ticket() {
+    run();
+    return _pending.fetch_sub(1) == 1;
+  }
+
+  bool done() const {
+    return _pending.load() == 0;
+  }
+
+  void rethrow() {
+    if (_error)
+      std::rethrow_exception(_error);
+  }
+
+private:
+  const unsigned int _n;
+  const unsigned int _grain;
+  const std::function<void(unsigned int)>& _body;
+  std::atomic<unsigned long long> _next;
+  std::atomic<unsigned int> _pending;   // tickets not yet released
+  std::mutex _error_mutex;
+  std::exception_ptr _error;
+};
+
+/* Pool of worker threads. Each worker owns a deque of tickets: it takes work
+ * from the back of its own deque and steals from the front of the others.
+ * Threads waiting for a loop to finish execute pending tickets meanwhile, so
+ * nested loops do not block workers nor create additional threads
+ */
+class TaskPool {
+public:
+  static const unsigned int MAX_WORKERS = 256;
+
+  static TaskPool& instance() {
+    static TaskPool pool;
+    return pool;
+  }
+
+  ~TaskPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _cv.notify_all();
+    for (unsigned int w = 0; w < _threads.size(); ++w)
+      _threads[w].join();
+  }
+
+  void reserve(unsigned int num_workers) {
+    num_workers = std::min(num_workers, MAX_WORKERS);
+    std::lock_guard<std::mutex> lock(_spawn_mutex);
+    for (unsigned int w = _num_workers.load(); w < num_workers; ++w) {
+      _queues[w].reset(new Queue());
+      _num_workers.store(w + 1);
+      _threads.push_back(std::thread(&TaskPool::work, this, w));
+    }
+  }
+
+  inline unsigned int size() const {
+    return _num_workers.load();
+  }
+
+  void submit(Job* job, const unsigned int num_tickets) {
+    const unsigned int num_workers = _num_workers.load();
+    for (unsigned int k = 0; k < num_tickets; ++k) {
+      /* Workers push to their own deque, other threads distribute tickets */
+      const unsigned int w = (_self >= 0) ? _self : (_next_queue++ % num_workers);
+      std::lock_guard<std::mutex> lock(_queues[w]->mutex);
+      _queues[w]->tickets.push_back(job);
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queued += num_tickets;
+    }
+    _cv.notify_all();
+  }
+
+  /* Wait for all tickets of a job, executing pending tickets meanwhile. Once
+   * no ticket is left to run, the thread sleeps until the last ticket of the
+   * job is released or new tickets are submitted
+   */
+  void wait(Job& job) {
+    unsigned int failed_pops = 0;
+    while (!job.done()) {
+      Job* ticket = pop();
+      if (ticket) {
+        run_ticket(ticket);
+        failed_pops = 0;
+      } else if (++failed_pops < WAIT_SPINS) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this, &job] { return job.done() || _queued > 0; });
+        failed_pops = 0;
+      }
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job*> tickets;
+  };
+
+  /* Number of failed attempts to take a ticket before a waiting thread
+   * sleeps
+   */
+  static const unsigned int WAIT_SPINS = 64;
+
+  TaskPool() : _num_workers(0), _next_queue(0), _queued(0), _stop(false) {}
+
+  /* Run a ticket and wake up the threads waiting for its job, if it was the
+   * last ticket. Waiters check the job under the lock, such that the
+   * notification cannot be missed
+   */
+  void run_ticket(Job* ticket) {
+    if (ticket->run_ticket()) {
+      { std::lock_guard<std::mutex> lock(_mutex); }
+      _cv.notify_all();
+    }
+  }
+
+  Job* pop() {
+    const unsigned int num_workers = _num_workers.load();
+    Job* ticket = nullptr;
+    if (_self >= 0) {
+      Queue& own = *_queues[_self];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tickets.empty()) {
+        ticket = own.tickets.back();
+        own.tickets.pop_back();
+      }
+    }
+    const unsigned int first = (_self >= 0) ? _self + 1 : 0;
+    for (unsigned int k = 0; !ticket && k < num_workers; ++k) {
+      Queue& victim = *_queues[(first + k) % num_workers];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tickets.empty()) {
+        ticket = victim.tickets.front();
+        victim.tickets.pop_front();
+      }
+    }
+    if (ticket) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      --_queued;
+    }
+    return ticket;
+  }
+
+  void work(const unsigned int w) {
+    _self = w;
+    for (;;) {
+      Job* ticket = pop();
+      if (ticket) {
+        run_ticket(ticket);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [this] { return _stop || _queued > 0; });
+      if (_stop)
+        return;
+    }
+  }
+
+  std::unique_ptr<Queue> _queues[MAX_WORKERS];
+  std::vector<std::thread> _threads;
+  std::atomic<unsigned int> _num_workers;
+  std::atomic<unsigned int> _next_queue;
+  std::mutex _spawn_mutex;
+  std::mutex _mutex;              // protects _queued and _stop
+  std::condition_variable _cv;    // signals new tickets and finished jobs
+  long _queued;                   // number of tickets in all deques
+  bool _stop;
+  static thread_local int _self;  // index of the calling worker (-1: none)
+};
+
+thread_local int TaskPool::_self = -1;
+
+void parallel_for(const unsigned int n, const unsigned int thrds,
+                  const std::function<void(unsigned int)>& body,
+                  const unsigned int grain) {
+
+  const unsigned int num_chunks = (n + std::max(grain, 1u) - 1) / std::max(grain, 1u);
+  if (thrds <= 1 || num_chunks <= 1) {
+    for (unsigned int i = 0; i < n; ++i)
+      body(i);
+    return;
+  }
+
+  /* The calling thread takes part in the loop */
+  TaskPool& pool = TaskPool::instance();
+  pool.reserve(thrds - 1);
+  const unsigned int num_tickets =
+    std::min(std::min(thrds - 1, num_chunks - 1), pool.size());
+  Job job(n, grain, body, num_tickets);
+  pool.submit(&job, num_tickets);
+  job.run();
+  pool.wait(job);
+  job.rethrow();
+}
+
+#endif
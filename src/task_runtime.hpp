@@ -0,0 +1,29 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Task runtime for the parallel loops
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef TASK_RUNTIME_HPP
+#define TASK_RUNTIME_HPP
+
+#include <config.h>
+#include <functional>
+
+/* Execute body(i) for i = 0, ..., n - 1 using up to 'thrds' threads.
+ * Iterations are claimed dynamically in chunks of 'grain' iterations, so the
+ * assignment of iterations to threads is not deterministic. Calls can be
+ * nested: inner loops reuse the threads of the outer loop instead of
+ * spawning new ones. The first exception thrown by 'body' is rethrown once
+ * all running iterations have finished.
+ *
+ * The backend is selected at configure time (--with-task-runtime): a pool of
+ * std::thread workers with work-stealing deques (default), or OpenMP, where
+ * nested loops run sequentially on the calling thread
+ */
+void parallel_for(const unsigned int n, const unsigned int thrds,
+                  const std::function<void(unsigned int)>& body,
+                  const unsigned int grain=1);
+
+#endif
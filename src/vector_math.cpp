@@ -0,0 +1,287 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Elementwise exp, log, log1p and expm1 over arrays of doubles
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#include <cmath>
+#include <limits>
+#include "vector_math.hpp"
+
+#ifdef MKL_ENABLED
+#include "mkl_vml.h"
+#endif
+
+#if !defined(MKL_ENABLED) && defined(__GNUC__) && defined(__x86_64__)
+#define VECTOR_MATH_AVX2
+#include <immintrin.h>
+#endif
+
+typedef void (*kernel_type)(const unsigned int, const double*, double*);
+
+struct VectorMathKernels {
+  kernel_type exp;
+  kernel_type log;
+  kernel_type log1p;
+  kernel_type expm1;
+  const char* name;
+};
+
+#ifndef MKL_ENABLED
+
+/* Scalar kernels */
+static void exp_scalar(const unsigned int n, const double* x, double* y) {
+  for (unsigned int i = 0; i < n; ++i)
+    y[i] = std::exp(x[i]);
+}
+
+static void log_scalar(const unsigned int n, const double* x, double* y) {
+  for (unsigned int i = 0; i < n; ++i)
+    y[i] = std::log(x[i]);
+}
+
+static void log1p_scalar(const unsigned int n, const double* x, double* y) {
+  for (unsigned int i = 0; i < n; ++i)
+    y[i] = std::log1p(x[i]);
+}
+
+static void expm1_scalar(const unsigned int n, const double* x, double* y) {
+  for (unsigned int i = 0; i < n; ++i)
+    y[i] = std::expm1(x[i]);
+}
+
+#else
+
+static void exp_mkl(const unsigned int n, const double* x, double* y) {
+  vdExp(n, x, y);
+}
+
+static void log_mkl(const unsigned int n, const double* x, double* y) {
+  vdLn(n, x, y);
+}
+
+static void log1p_mkl(const unsigned int n, const double* x, double* y) {
+  vdLog1p(n, x, y);
+}
+
+static void expm1_mkl(const unsigned int n, const double* x, double* y) {
+  vdExpm1(n, x, y);
+}
+
+#endif
+
+#ifdef VECTOR_MATH_AVX2
+
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+/* exp(x) = 2^n exp(r), with |r| <= ln(2) / 2 and exp(r) approximated by the
+ * rational function of Cephes. The scaling by 2^n is split into two factors
+ * to cover results in the subnormal range
+ */
+AVX2_TARGET static inline __m256d exp_avx2(const __m256d x) {
+  const __m256d log2e = _mm256_set1_pd(1.4426950408889634073599);
+  const __m256d c1 = _mm256_set1_pd(6.93145751953125E-1);
+  const __m256d c2 = _mm256_set1_pd(1.42860682030941723212E-6);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d two = _mm256_set1_pd(2.0);
+
+  __m256d xc = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-745.2)),
+                             _mm256_set1_pd(709.8));
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(xc, log2e),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(n, c1, xc);
+  r = _mm256_fnmadd_pd(n, c2, r);
+
+  __m256d rr = _mm256_mul_pd(r, r);
+  __m256d px = _mm256_fmadd_pd(_mm256_set1_pd(1.26177193074810590878E-4), rr,
+                               _mm256_set1_pd(3.02994407707441961300E-2));
+  px = _mm256_fmadd_pd(px, rr, _mm256_set1_pd(9.99999999999999999910E-1));
+  px = _mm256_mul_pd(px, r);
+  __m256d qx = _mm256_fmadd_pd(_mm256_set1_pd(3.00198505138664455042E-6), rr,
+                               _mm256_set1_pd(2.52448340349684104192E-3));
+  qx = _mm256_fmadd_pd(qx, rr, _mm256_set1_pd(2.27265548208155028766E-1));
+  qx = _mm256_fmadd_pd(qx, rr, _mm256_set1_pd(2.00000000000000000009E0));
+  __m256d e = _mm256_div_pd(px, _mm256_sub_pd(qx, px));
+  e = _mm256_fmadd_pd(two, e, one);
+
+  /* 2^n1 * 2^n2 with n1 = floor(n / 2) and n2 = n - n1 */
+  __m256d n1 = _mm256_floor_pd(_mm256_mul_pd(n, _mm256_set1_pd(0.5)));
+  __m256d n2 = _mm256_sub_pd(n, n1);
+  const __m256i bias = _mm256_set1_epi64x(1023);
+  __m256d s1 = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(
+    _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n1)), bias), 52));
+  __m256d s2 = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(
+    _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n2)), bias), 52));
+  __m256d result = _mm256_mul_pd(_mm256_mul_pd(e, s1), s2);
+
+  /* Propagate NaN */
+  return _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+/* log(x) = e ln(2) + log(m), with m in [sqrt(1/2), sqrt(2)) and log(m)
+ * approximated by the rational function of Cephes
+ */
+AVX2_TARGET static inline __m256d log_avx2(const __m256d x) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+
+  /* Scale subnormal numbers into the normal range */
+  __m256d subnormal = _mm256_cmp_pd(
+    x, _mm256_set1_pd(std::numeric_limits<double>::min()), _CMP_LT_OQ);
+  __m256d xs = _mm256_blendv_pd(
+    x, _mm256_mul_pd(x, _mm256_set1_pd(18014398509481984.0)), subnormal);
+  __m256d e_offset = _mm256_and_pd(subnormal, _mm256_set1_pd(54.0));
+
+  /* x = m 2^e with m in [0.5, 1) */
+  const __m256i bits = _mm256_castpd_si256(xs);
+  const __m256i exp_bits = _mm256_srli_epi64(bits, 52);
+  __m256d e = _mm256_sub_pd(
+    _mm256_castsi256_pd(_mm256_or_si256(
+      exp_bits, _mm256_castpd_si256(_mm256_set1_pd(4503599627370496.0)))),
+    _mm256_set1_pd(4503599627370496.0));
+  e = _mm256_sub_pd(e, _mm256_add_pd(_mm256_set1_pd(1022.0), e_offset));
+  __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+    _mm256_and_si256(bits, _mm256_set1_epi64x(0x800fffffffffffffLL)),
+    _mm256_set1_epi64x(0x3fe0000000000000LL)));
+
+  /* if m < sqrt(1/2): e -= 1, m = 2m - 1, otherwise m = m - 1 */
+  __m256d small = _mm256_cmp_pd(
+    m, _mm256_set1_pd(0.70710678118654752440), _CMP_LT_OQ);
+  e = _mm256_sub_pd(e, _mm256_and_pd(small, one));
+  m = _mm256_sub_pd(_mm256_add_pd(m, _mm256_and_pd(small, m)), one);
+
+  __m256d z = _mm256_mul_pd(m, m);
+  __m256d p = _mm256_fmadd_pd(_mm256_set1_pd(1.01875663804580931796E-4), m,
+                              _mm256_set1_pd(4.97494994976747001425E-1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(4.70579119878881725854E0));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.44989225341610930846E1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.79368678507819816313E1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(7.70838733755885391666E0));
+  __m256d q = _mm256_add_pd(m, _mm256_set1_pd(1.12873587189167450590E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(4.52279145837532221105E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(8.29875266912776603211E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(7.11544750618563894466E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(2.31251620126765340583E1));
+
+  __m256d y = _mm256_mul_pd(m, _mm256_div_pd(_mm256_mul_pd(z, p), q));
+  y = _mm256_fnmadd_pd(e, _mm256_set1_pd(2.121944400546905827679E-4), y);
+  y = _mm256_fnmadd_pd(_mm256_set1_pd(0.5), z, y);
+  __m256d result = _mm256_add_pd(m, y);
+  result = _mm256_fmadd_pd(e, _mm256_set1_pd(0.693359375), result);
+
+  /* Special values: log(0) = -inf, log(inf) = inf, log(x < 0) = NaN */
+  result = _mm256_blendv_pd(result, _mm256_sub_pd(zero, inf),
+                            _mm256_cmp_pd(x, zero, _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(result, inf, _mm256_cmp_pd(x, inf, _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(
+    result, _mm256_set1_pd(std::numeric_limits<double>::quiet_NaN()),
+    _mm256_cmp_pd(x, zero, _CMP_NGE_UQ));
+  return result;
+}
+
+/* log1p(x) = log(u) x / (u - 1) with u = 1 + x, which compensates the
+ * rounding error of u
+ */
+AVX2_TARGET static inline __m256d log1p_avx2(const __m256d x) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d u = _mm256_add_pd(one, x);
+  const __m256d d = _mm256_sub_pd(u, one);
+  __m256d result = _mm256_mul_pd(log_avx2(u), _mm256_div_pd(x, d));
+  /* u = 1 (|x| below the rounding error) and u = inf */
+  result = _mm256_blendv_pd(result, x, _mm256_cmp_pd(d, _mm256_setzero_pd(),
+                                                     _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(
+    result, u, _mm256_cmp_pd(
+      u, _mm256_set1_pd(std::numeric_limits<double>::infinity()), _CMP_EQ_OQ));
+  return result;
+}
+
+/* expm1(x) = (u - 1) x / log(u) with u = exp(x) */
+AVX2_TARGET static inline __m256d expm1_avx2(const __m256d x) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d u = exp_avx2(x);
+  const __m256d d = _mm256_sub_pd(u, one);
+  __m256d result = _mm256_mul_pd(d, _mm256_div_pd(x, log_avx2(u)));
+  /* u = 1 (|x| below the rounding error), u = 0 and u = inf */
+  result = _mm256_blendv_pd(result, x, _mm256_cmp_pd(d, _mm256_setzero_pd(),
+                                                     _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(result, d, _mm256_cmp_pd(d, _mm256_set1_pd(-1.0),
+                                                     _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(
+    result, u, _mm256_cmp_pd(
+      u, _mm256_set1_pd(std::numeric_limits<double>::infinity()), _CMP_EQ_OQ));
+  return result;
+}
+
+/* Apply a kernel to blocks of four values. The remainder is padded, such
+ * that every value is computed by the same kernel
+ */
+#define DEFINE_AVX2_LOOP(name, kernel)                                         \
+  AVX2_TARGET static void name(const unsigned int n, const double* x,         \
+                               double* y) {                                    \
+    unsigned int i = 0;                                                        \
+    for (; i + 4 <= n; i += 4)                                                 \
+      _mm256_storeu_pd(y + i, kernel(_mm256_loadu_pd(x + i)));                 \
+    if (i < n) {                                                               \
+      double buffer[4] = {1.0, 1.0, 1.0, 1.0};                                 \
+      for (unsigned int j = i; j < n; ++j)                                     \
+        buffer[j - i] = x[j];                                                  \
+      _mm256_storeu_pd(buffer, kernel(_mm256_loadu_pd(buffer)));               \
+      for (unsigned int j = i; j < n; ++j)                                     \
+        y[j] = buffer[j - i];                                                  \
+    }                                                                          \
+  }
+
+DEFINE_AVX2_LOOP(exp_avx2_loop, exp_avx2)
+DEFINE_AVX2_LOOP(log_avx2_loop, log_avx2)
+DEFINE_AVX2_LOOP(log1p_avx2_loop, log1p_avx2)
+DEFINE_AVX2_LOOP(expm1_avx2_loop, expm1_avx2)
+
+#endif
+
+static VectorMathKernels select_kernels() {
+#ifdef MKL_ENABLED
+  VectorMathKernels kernels = {exp_mkl, log_mkl, log1p_mkl, expm1_mkl, "mkl"};
+  return kernels;
+#else
+#ifdef VECTOR_MATH_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    VectorMathKernels kernels = {exp_avx2_loop, log_avx2_loop, log1p_avx2_loop,
+                                 expm1_avx2_loop, "avx2"};
+    return kernels;
+  }
+#endif
+  VectorMathKernels kernels = {exp_scalar, log_scalar, log1p_scalar,
+                               expm1_scalar, "scalar"};
+  return kernels;
+#endif
+}
+
+/* Kernels are selected once, on first use */
+static const VectorMathKernels& vector_math_kernels() {
+  static const VectorMathKernels kernels = select_kernels();
+  return kernels;
+}
+
+void vexp(const unsigned int n, const double* x, double* y) {
+  vector_math_kernels().exp(n, x, y);
+}
+
+void vlog(const unsigned int n, const double* x, double* y) {
+  vector_math_kernels().log(n, x, y);
+}
+
+void vlog1p(const unsigned int n, const double* x, double* y) {
+  vector_math_kernels().log1p(n, x, y);
+}
+
+void vexpm1(const unsigned int n, const double* x, double* y) {
+  vector_math_kernels().expm1(n, x, y);
+}
+
+const char* vector_math_backend() {
+  return vector_math_kernels().name;
+}
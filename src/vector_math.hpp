@@ -0,0 +1,31 @@
+/** mccbn: large-scale inference on conjunctive Bayesian networks
+ *  Elementwise exp, log, log1p and expm1 over arrays of doubles
+ *
+ * @author Susana Posada Céspedes
+ * @email susana.posada@bsse.ethz.ch
+ */
+
+#ifndef VECTOR_MATH_HPP
+#define VECTOR_MATH_HPP
+
+#include <config.h>
+
+/* Elementwise transcendental functions, y[i] = f(x[i]). Input and output may
+ * alias. With Intel MKL, the VM functions are used. Otherwise, an AVX2
+ * implementation is selected at runtime if the CPU supports it, and libm is
+ * used as a fallback. The maximum error of the AVX2 kernels is 1 ulp for log
+ * and 2 ulp for exp, log1p and expm1 (measured against libm, including
+ * subnormal results), and special values (0, inf, NaN) follow libm
+ */
+void vexp(const unsigned int n, const double* x, double* y);
+
+void vlog(const unsigned int n, const double* x, double* y);
+
+void vlog1p(const unsigned int n, const double* x, double* y);
+
+void vexpm1(const unsigned int n, const double* x, double* y);
+
+/* Name of the kernels selected for this CPU ("mkl", "avx2" or "scalar") */
+const char* vector_math_backend();
+
+#endif